@@ -100,6 +100,8 @@ typedef struct
 
 array_item *	add_to_array 		(array *, array_item *);
 array_item *	remove_from_array 	(array *, const char *);
+int		add_to_array_bulk	(array *, array_item **, int, array_item **);
+int		remove_from_array_bulk	(array *, const char **, int, array_item **);
 array_item *	array_lookup 		(array *, const char *, int, int);
 array_item *	find_array_item 	(array *, const char *, int *, int *);
 array_item *	array_pop		(array *, int);
@@ -323,6 +323,9 @@
 #define DEFAULT_LASTLOG 256
 #define DEFAULT_LASTLOG_LEVEL "ALL"
 #define DEFAULT_LASTLOG_REWRITE NULL
+#define DEFAULT_LASTLOG_SPILL 0
+#define DEFAULT_LASTLOG_SPILL_DIR NULL
+#define DEFAULT_LAZY_SYNC_CHANNELS NULL
 #define DEFAULT_LOG 0
 #define DEFAULT_LOGFILE "irc.log"
 #define DEFAULT_MAIL 2
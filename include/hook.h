@@ -57,6 +57,7 @@ enum HOOK_TYPES {
 	MSG_LIST,
 	MSG_GROUP_LIST,
 	NAMES_LIST,
+	NETSPLIT_LIST,
 	NEW_NICKNAME_LIST,
 	NICKNAME_LIST,
 	NOTE_LIST,
@@ -303,6 +303,9 @@ extern ssize_t iconv_list_size;
 extern int my_iconv_open (iconv_t *, iconv_t *, const char *);
 #endif
 
+extern	iconv_t	get_iconv_handle (const char *to, const char *from);
+extern	void	flush_iconv_pool (void);
+extern	char *	iconv_pool_stats (void);
 extern	int	recode_with_iconv (const char *from, const char *to, char **data, size_t *numbytes);
 extern	int     recode_with_iconv_t (iconv_t iref, char **data, size_t *numbytes);
 
@@ -319,6 +322,7 @@ extern	int     previous_code_point	(const unsigned char *, const unsigned char *
 extern	int	quick_code_point_index	(const unsigned char *, const unsigned char *);
 
 extern	int	strext2		(unsigned char **, unsigned char *, size_t , size_t);
+extern	int     valid_utf8str	(const unsigned char *str);
 extern	int     invalid_utf8str (unsigned char *utf8str);
 extern	int     is_iso2022_jp (const unsigned char *buffer);
 extern	void    create_utf8_locale (void);
@@ -334,6 +338,7 @@ extern	int     ucs_to_console (u_32int_t key, unsigned char *utf8str, size_t utf
 BUILT_IN_COMMAND(encoding);
 extern	const char *	outbound_recode (const char *, int, const char *, char **);
 extern	const char *	inbound_recode (const char *, int, const char *, const char *, char **);
+extern	void		invalidate_recode_decisions (void);
 extern	char *	function_encodingctl (char *);
 
 #endif /* _IRCAUX_H_ */
@@ -28,6 +28,7 @@ extern	double	output_expires_after;
 	Mask	real_notify_mask 		(void);
 	void	set_lastlog_mask 		(void *);
 	void	set_lastlog_size 		(void *);
+	void	set_lastlog_spill 		(void *);
 	void	set_notify_mask 		(void *);
 	int		recount_window_lastlog	(struct WindowStru *);
 	void	trim_lastlog			(struct WindowStru *);
@@ -38,6 +39,7 @@ extern	double	output_expires_after;
 	void	set_new_server_lastlog_mask	(void *);
 	void	set_old_server_lastlog_mask	(void *);
 	void	reconstitute_scrollback		(struct WindowStru *);
+	intmax_t rewrap_scrollback		(struct WindowStru *, intmax_t, intmax_t, int);
 	int	do_expire_lastlog_entries	(void *);
 	void	truncate_lastlog		(struct WindowStru *);
 
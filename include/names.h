@@ -25,8 +25,11 @@
 	char *	create_chops_list	(Char *, int);
 	char *	create_nochops_list	(Char *, int);
 	int     chanmodetype		(char);
+	void	rebuild_prefix_list	(int);
 	int	channel_is_syncing	(Char *, int);
 	void	channel_not_waiting	(Char *, int); 
+	int	is_channel_lazy		(Char *, int);
+	int	defer_names		(Char *, Char *, int);
 	void	update_channel_mode	(Char *, Char *);
 	Char *	get_channel_key		(Char *, int);
 	Char *	get_channel_mode	(Char *, int);
@@ -34,6 +37,7 @@
 	int	is_channel_nomsgs	(Char *, int);
 	int	is_channel_anonymous	(Char *, int);
 	char *	scan_channel		(char *);
+	const char *status_to_prefixes	(int, u_32int_t, char *, size_t);
 	void	list_channels		(void);
 	BUILT_IN_KEYBINDING(switch_channels);
 	Char *	window_current_channel	(int, int);
@@ -43,6 +47,13 @@
 	Char *	what_channel		(Char *, int);
 	Char *	walk_channels		(int, Char *);
 	Char *	fetch_userhost		(int, Char *, Char *);
+	void	cache_userhost		(int, Char *, Char *);
+	char *	userhost_cache_stats	(int);
+	Char *	fetch_account		(int, Char *);
+	Char *	fetch_away		(int, Char *);
+	void	set_user_userhost	(int, Char *, Char *);
+	void	set_user_account	(int, Char *, Char *);
+	void	set_user_away		(int, Char *, Char *);
 	int	get_channel_limit	(Char *, int);
 	int	get_channel_oper	(Char *, int);
 	int	get_channel_voice	(Char *, int);
@@ -20,8 +20,16 @@ typedef struct notify_alist
 	alist_func 		func;
 	hash_type		hash;
 	char *			ison;
+	int			mode;		/* NOTIFY_ISON, etc */
+	int			changes;	/* Sign{on,off}s since last ISON */
+	int			poll_every;	/* ISON every this many ticks */
+	int			poll_countdown;	/* Ticks until the next ISON */
 } NotifyList;
 
+#define NOTIFY_ISON	0
+#define NOTIFY_MONITOR	1
+#define NOTIFY_WATCH	2
+
 extern	char	notify_timeref[];
 
 	BUILT_IN_COMMAND(notify);
@@ -32,6 +40,9 @@ extern	char	notify_timeref[];
 	void	make_notify_list 	(int);
 	char *	get_notify_nicks 	(int, int);
 	void	destroy_notify_list	(int);
+	void	notify_check_005	(int);
+	void	notify_server_reset	(int);
+	int	notify_monitor_reply	(int, int, const char **);
 
 	void	notify_systimer		(void);
 	void	set_notify_interval	(void *);
@@ -25,6 +25,7 @@ const 	char	*PasteArgs 	(const char **, int);
 	void	parse_server 	(const char *, size_t);
 	int	is_channel	(const char *);
 	void    rfc1459_any_to_utf8 (char *, size_t, char **);
+	void	flush_netsplit	(void);
 
 extern	const char	*FromUserHost;
 
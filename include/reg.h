@@ -42,5 +42,10 @@
         int     pattern_regcomp (regex_t *, const char *, int);
         char *  pattern2regex   (const char *, int *);
 
+	void	trigram_signature_add	(unsigned char *, size_t, const char *);
+	int	trigram_signature_test	(const unsigned char *, size_t, const u_32int_t *, int);
+	int	wild_match_trigrams	(const char *, u_32int_t *, int);
+	int	regex_trigrams		(const char *, u_32int_t *, int);
+
 #endif
 
@@ -80,26 +80,19 @@ const	AI	*next_addr;		/* The next one to try upon failure */
 	int	server2_8;		/* defined if we get an 001 numeric */
 	char	*version_string;	/* what is says */
 	char	umode[54];		/* Currently set user modes */
-	char	prefixmodes[256];	/* A quarter kilobyte of crud.
-					 * Query with:
-					 * server->prefixmodes['q']
-					 * or server->prefixmodes['~']
-	                                 * Used by the modern prefix support
-	                                 * to cope with IRCds like Unreal
-	                                 * A user w/ a prefix to the left of
-	                                 * @ is assumed to be op by default.
-	                                 */
-	char	prefixes[256];		/* A quarter kilobyte of crud.
-					 * Query with:
-					 * or server->prefixmodes['~']
-	                                 * A user w/ a prefix to the left of
-	                                 * @ is assumed to be op by default.
-	                                 */
-	short	isopprefix[256];	/* ... Also a quarter kilobyte of crud.
-					 * 0 = not at least hop, 1 = hop, 2 = op
-	                                 * if (server->isopprefix['~'] == 0)
-	                                 * then '~' is below op or dead.
-	                                 */
+	/*
+	 * The channel status prefixes from the 005 PREFIX, highest rank
+	 * first.  Rank 1 is bit 0 of a channel member's status mask.
+	 * These are set up by rebuild_prefix_list() in names.c, and turned
+	 * back into strings by status_to_prefixes().
+	 */
+	int	prefix_count;		/* How many prefixes there are */
+	char	prefix_chars[33];	/* rank - 1 -> NAMES prefix ("@") */
+	unsigned char prefix_rank[256];	/* NAMES prefix -> rank, 0 if none */
+	unsigned char mode_rank[256];	/* channel mode -> rank, 0 if none */
+	u_32int_t op_status;		/* Status bits that make you a chop */
+	u_32int_t halfop_status;	/* Status bits that make you a halfop */
+	u_32int_t voice_status;		/* Status bits that make you voiced */
 	int	des;			/* file descriptor to server */
 	int	sent;			/* set if something has been sent,
 					 * used for redirect */
@@ -69,6 +69,9 @@ int	ALLOW_C1_CHARS_VAR,
 	LASTLOG_VAR,
 	LASTLOG_LEVEL_VAR,
 	LASTLOG_REWRITE_VAR,
+	LASTLOG_SPILL_VAR,
+	LASTLOG_SPILL_DIR_VAR,
+	LAZY_SYNC_CHANNELS_VAR,
 	LOAD_PATH_VAR,
 	LOG_VAR,
 	LOGFILE_VAR,
@@ -20,6 +20,7 @@ typedef struct WhoEntryT
 	char *undernet_extended_args;
 	int  dalnet_extended;
 	char *dalnet_extended_args;
+	int  whox_tag;
         int  who_mask;
 	char *who_target;
         char *who_name;
@@ -30,15 +30,32 @@ struct	ScreenStru;
 /* Should be a way to make static to window.c */
 typedef	struct	DisplayStru
 {
-	size_t			count;
+	intmax_t		count;		/* Position in the scrollback */
 	char			*line;
 	intmax_t		linked_refnum;
-	struct	DisplayStru	*prev;
-	struct	DisplayStru	*next;
 	ssize_t			unique_refnum;
 	time_t			when;
+	unsigned char		trigrams[32];	/* For searching, see reg.c */
 }	Display;
 
+/*
+ * The scrollback is a ring of rows, kept in blocks of SCROLLBACK_BLOCK 
+ * rows.  Just like the lastlog rings, positions only go up (well, except 
+ * when rows are put back on the top after a resize), and the row at any 
+ * position 'pos' is in the block at (pos & (size - 1)) / SCROLLBACK_BLOCK.
+ * The blocks never move once they're allocated, so it's safe to hang 
+ * onto a (Display *) as long as that row is still in the scrollback.
+ */
+#define SCROLLBACK_BLOCK	128
+
+typedef struct	ScrollbackStru
+{
+	Display **	blocks;
+	intmax_t	first;		/* The position of the oldest row */
+	int		count;
+	int		size;		/* Always a power of two */
+}	Scrollback;
+
 typedef struct	WNickListStru
 {
 struct WNickListStru	*next;
@@ -71,7 +88,7 @@ typedef	struct	WindowStru
 	short	cursor;			/* WINDOW line where the cursor is */
 	short	change_line;		/* True if this is a scratch window */
 	short	update;			/* True if window display is dirty */
-	short	rebuild_scrollback;	/* True if scrollback needs rebuild */
+	short	rebuild_scrollback;	/* 1 = needs rebuild, 2 = from scratch */
 
 	/* User-settable flags */
 	short	notify_when_hidden;	/* True to notify for hidden output */
@@ -95,7 +112,7 @@ typedef	struct	WindowStru
 
 	/* SCROLLBACK stuff */
 	/*
-	 * The "scrollback" buffer is a linked list of lines that have
+	 * The "scrollback" buffer is a ring (see above) of lines that have
 	 * appeared, are appearing, or will appear on the visible window.
 	 * The "top" of the scrollback buffer usually floats forward in
 	 * the line as items are added.  The visible part of the screen is
@@ -112,6 +129,7 @@ typedef	struct	WindowStru
 	 * line will go.  When the user does a /clear, the screen is scrolled
 	 * up until display_ip is the top_of_display.  
 	 */
+	Scrollback scrollback_rows;	/* The scrollback buffer itself */
 	Display *top_of_scrollback;	/* Start of the scrollback buffer */
 	Display *display_ip;		/* End of the scrollback buffer */
 	int	display_buffer_size;	/* How big the scrollback buffer is */
@@ -126,11 +144,22 @@ typedef	struct	WindowStru
 	Display *scrollback_top_of_display;
 	int	scrollback_distance_from_display_ip;
 
-	int	display_counter;
 	short	hold_slider;
 
 	Display *scrollback_indicator;	/* The === thing */
 
+	/*
+	 * After a resize, only what's on the screen is rewrapped right away,
+	 * and the older lastlog entries are rewrapped a little at a time.
+	 * The rows at the old width are kept around, because they're still
+	 * good if we get resized back to it.
+	 */
+	intmax_t rewrap_before;		/* Entries older than this need rewrap */
+	Scrollback rewrap_rows;		/* Reusable rows at our width */
+	Scrollback rewrap_spare;	/* Rows from some other width */
+	int	rewrap_spare_cols;	/* How wide the spare rows are */
+	int	rewrap_cols;		/* How wide our rows are */
+
 	/*
 	 * Window geometry stuff
 	 *
@@ -160,6 +189,7 @@ struct lastlog_stru *lastlog_oldest;	/* pointer to bottom of lastlog list */
 					 * messages go to lastlog */
 	int	lastlog_size;		/* number of messages in lastlog. */
 	int	lastlog_max;		/* Max number of messages in lastlog */
+struct lastlog_index_stru *lastlog_index; /* This window's lastlog entries */
 
 
 	/* /WINDOW LOG stuff */
@@ -272,7 +302,11 @@ const	char	*get_echannel_by_refnum		(unsigned);
 	unsigned current_refnum			(void);
 	int	number_of_windows_on_screen	(Window *);
 	int	add_to_scrollback		(Window *, const unsigned char *, intmax_t);
+	int	prepend_to_scrollback		(Window *, unsigned char **, intmax_t);
+	int	reuse_scrollback_rows		(Window *, intmax_t);
+	int	scrollback_rewrap_pending	(void);
 	int	trim_scrollback			(Window *);
+	Display	*window_display_line		(Window *, intmax_t);
 	BUILT_IN_KEYBINDING(scrollback_backwards);
 	BUILT_IN_KEYBINDING(scrollback_forwards);
 	BUILT_IN_KEYBINDING(scrollback_end);
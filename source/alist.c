@@ -111,6 +111,197 @@ array_item *remove_from_array (array *a, const char *name)
 	return NULL;	/* Cant delete whats not there */
 }
 
+/*
+ * The bulk functions below need to put items in the same order that
+ * find_array_item() expects them to be in, so this compares two names 
+ * the same way it does.  If 'a' is a prefix of 'b', 'a' goes first.
+ */
+static int	alist_compare (array *set, const array_item *a, const array_item *b)
+{
+	size_t		len = strlen(a->name);
+	u_32int_t	mask;
+	int		c;
+
+	if (set->hash == HASH_INSENSITIVE)
+		ci_alist_hash(a->name, &mask);
+	else
+		cs_alist_hash(a->name, &mask);
+
+	c = (a->hash & mask) - (b->hash & mask);
+	if (c == 0)
+		c = set->func(a->name, b->name, len);
+	if (c == 0 && b->name[len] != 0)
+		c = -1;
+	return c;
+}
+
+/* 
+ * For qsort(), which sorts the places of the items, not the items.
+ * Items that compare equal stay in the order they were given, so the 
+ * last one of them wins, just as if you had added them one by one.
+ */
+static	array *		bulk_array;
+static	array_item **	bulk_items;
+
+static int	bulk_compare (const void *a, const void *b)
+{
+	int	ia = *(const int *)a;
+	int	ib = *(const int *)b;
+	int	c;
+
+	if ((c = alist_compare(bulk_array, bulk_items[ia], bulk_items[ib])))
+		return c;
+	return ia - ib;
+}
+
+/*
+ * add_to_array_bulk - Add a bunch of items to an array all at once.
+ * If you have a lot of items to add, this is a lot cheaper than calling
+ * add_to_array() for each one, because it sorts the new items and merges
+ * them into the array in one pass, instead of moving the rest of the
+ * array over to make room for every one of them.
+ *
+ * Arguments:
+ *	a	  - The array
+ *	items	  - The items to add ('count' of them)
+ *	count	  - How many items there are
+ *	displaced - Room for 'count' items, which gets the items that were
+ *		    displaced (either because they were already in the array,
+ *		    or because a later item in 'items' had the same name).
+ * Returns the number of items put in 'displaced'.
+ */
+int	add_to_array_bulk (array *a, array_item **items, int count, array_item **displaced)
+{
+	array_item **	newlist;
+	array_item *	item;
+	int *		order;
+	int		i, j, k, ndisplaced = 0;
+	u_32int_t	mask;
+	int		c;
+
+	if (count <= 0)
+		return 0;
+
+	order = (int *)new_malloc(sizeof(int) * count);
+	for (i = 0; i < count; i++)
+	{
+		if (a->hash == HASH_INSENSITIVE)
+			items[i]->hash = ci_alist_hash(items[i]->name, &mask);
+		else
+			items[i]->hash = cs_alist_hash(items[i]->name, &mask);
+		order[i] = i;
+	}
+
+	bulk_array = a;
+	bulk_items = items;
+	qsort(order, count, sizeof(int), bulk_compare);
+
+	/* 
+	 * Merge them with what's already there.  The new list might be
+	 * a little too big if some things get displaced, but that's ok.
+	 */
+	newlist = (array_item **)new_malloc(sizeof(array_item *) * (a->max + count));
+	for (i = 0, j = 0, k = 0; i < a->max || j < count; )
+	{
+		if (j >= count)
+		{
+			newlist[k++] = ARRAY_ITEM(a, i++);
+			continue;
+		}
+
+		item = items[order[j]];
+
+		/* Only the last of the ones with the same name goes in */
+		if (j + 1 < count && !alist_compare(a, item, items[order[j + 1]]))
+		{
+			displaced[ndisplaced++] = item;
+			j++;
+			continue;
+		}
+
+		if (i >= a->max)
+			c = 1;
+		else
+			c = alist_compare(a, ARRAY_ITEM(a, i), item);
+
+		if (c < 0)
+			newlist[k++] = ARRAY_ITEM(a, i++);
+		else
+		{
+			if (c == 0)
+				displaced[ndisplaced++] = ARRAY_ITEM(a, i++);
+			newlist[k++] = item;
+			j++;
+		}
+	}
+
+	new_free((char **)&order);
+	new_free((char **)&a->list);
+	a->list = newlist;
+	a->max = k;
+
+	/* Leave it the size check_array_size() would have made it */
+	for (a->total_max = 6; a->total_max <= a->max + 1; a->total_max *= 2)
+		;
+	RESIZE(a->list, array_item *, a->total_max);
+	return ndisplaced;
+}
+
+static int	int_compare (const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+/*
+ * remove_from_array_bulk - Remove a bunch of items from an array at once.
+ * Like add_to_array_bulk(), this squeezes the array together once, instead
+ * of once for every item you remove.
+ *
+ * Arguments:
+ *	a	- The array
+ *	names	- The names of the items to remove ('count' of them)
+ *	count	- How many names there are
+ *	removed - Room for 'count' items, which gets the items that were
+ *		  removed.  Names that aren't in the array are skipped.
+ * Returns the number of items put in 'removed'.
+ */
+int	remove_from_array_bulk (array *a, const char **names, int count, array_item **removed)
+{
+	int *	where;
+	int	i, j, w, cnt, loc, nfound = 0, nremoved = 0;
+
+	if (count <= 0 || !a->max)
+		return 0;
+
+	/* Find everything first, so we don't lose our place */
+	where = (int *)new_malloc(sizeof(int) * count);
+	for (i = 0; i < count; i++)
+	{
+		find_array_item(a, names[i], &cnt, &loc);
+		if (cnt < 0)
+			where[nfound++] = loc;
+	}
+	qsort(where, nfound, sizeof(int), int_compare);
+
+	/* Then squeeze out the ones we found */
+	for (i = 0, j = 0, w = 0; i < a->max; i++)
+	{
+		if (w < nfound && where[w] == i)
+		{
+			removed[nremoved++] = ARRAY_ITEM(a, i);
+			while (w < nfound && where[w] == i)
+				w++;		/* Asked for more than once */
+		}
+		else
+			LARRAY_ITEM(a, j++) = ARRAY_ITEM(a, i);
+	}
+	a->max = j;
+
+	new_free((char **)&where);
+	check_array_size(a);
+	return nremoved;
+}
+
 /* Remove the 'which'th item from the given array */
 array_item *array_pop (array *a, int which)
 {
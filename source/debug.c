@@ -83,6 +83,7 @@ static struct debug_opts opts[] =
 	{ "UNICODE",		DEBUG_UNICODE },
 	{ "DWORD",        	DEBUG_DWORD },
 	{ "RECODE",		DEBUG_RECODE },
+	{ "NO_PATTERN_CACHE",	DEBUG_NO_PATTERN_CACHE },
 	{ "ALL",		~0},
 	{ NULL,			0 },
 };
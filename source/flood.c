@@ -50,6 +50,24 @@
 #include "lastlog.h"
 #include "window.h"
 #include "reg.h"
+#include <math.h>
+
+/*
+ * Each slot counts the messages from one person over the last "window",
+ * which is how long it would take them to send /SET FLOOD_AFTER messages
+ * at exactly /SET FLOOD_RATE per FLOOD_RATE_PER seconds.  If they send
+ * FLOOD_AFTER messages inside the window (and then one more), they are
+ * flooding.  The window is cut up into FLOOD_BUCKETS parts, and each part
+ * counts the messages that came in during it; as time goes on, the parts
+ * that fall out of the window are emptied, a few at a time, whenever 
+ * someone looks at the slot.  This used to be "count messages until they 
+ * slow down and then start over", which let someone flood you forever as 
+ * long as they paused now and then.
+ */
+#define FLOOD_BUCKETS	8
+
+/* How many slots we look at to find one to reuse */
+#define FLOOD_PROBES	8
 
 typedef struct flood_stru
 {
@@ -58,14 +76,194 @@ typedef struct flood_stru
 	int		server;
 
 	int		level;
-	long		cnt;
-	Timeval		start;
+	long		cnt;		/* Messages in the window */
+	Timeval		start;		/* When the window's messages started */
 	int		floods;
+
+	int		bucket[FLOOD_BUCKETS];	/* Messages in each part */
+	double		tick;		/* Which part of time is the newest */
+	double		width;		/* How long each part is (seconds) */
+
+	u_32int_t	hash;		/* flood_key_hash() of the above */
+	int		hnext;		/* Next slot in this hash bucket */
 }	Flooding;
 
 static	Flooding *flood = (Flooding *) 0;
 int	users = 0;
 
+/*
+ * Every message you get goes through new_check_flooding(), and it used to
+ * walk the whole array looking for the sender, which means the more people
+ * that are flooding you, the slower it gets to notice each one of them.
+ * So the slots are also hashed on (server, level, nuh, channel); each 
+ * bucket holds the index of the first slot in it, and each slot holds the 
+ * index of the next one (-1 ends the chain).  There are always at least 
+ * twice as many buckets as slots.
+ */
+static	int *	flood_hash = NULL;
+static	int	flood_hash_size = 0;
+
+/*
+ * This has to agree with my_stricmp(), so it folds each code point 
+ * exactly the same way that does.
+ */
+static u_32int_t	flood_string_hash (u_32int_t hash, const char *str)
+{
+	const unsigned char *s = (const unsigned char *)str;
+	int	c;
+
+	if (!s)
+		return (hash ^ 0xFFU) * 16777619U;
+
+	while ((c = next_code_point(&s, 1)) > 0)
+		hash = (hash ^ (u_32int_t)mkupper_l(c)) * 16777619U;
+	return (hash ^ 0U) * 16777619U;
+}
+
+static u_32int_t	flood_key_hash (int server, int level, const char *nuh, const char *chan)
+{
+	u_32int_t	hash = 2166136261U;
+
+	hash = (hash ^ (u_32int_t)server) * 16777619U;
+	hash = (hash ^ (u_32int_t)level) * 16777619U;
+	hash = flood_string_hash(hash, nuh);
+	hash = flood_string_hash(hash, chan);
+	return hash;
+}
+
+static void	flood_hash_add (int i)
+{
+	int	bucket;
+
+	if (!flood[i].nuh)
+		return;
+
+	flood[i].hash = flood_key_hash(flood[i].server, flood[i].level, 
+					flood[i].nuh, flood[i].channel);
+	bucket = flood[i].hash & (flood_hash_size - 1);
+	flood[i].hnext = flood_hash[bucket];
+	flood_hash[bucket] = i;
+}
+
+static void	flood_hash_remove (int i)
+{
+	int	*p;
+
+	if (!flood[i].nuh)
+		return;
+
+	for (p = &flood_hash[flood[i].hash & (flood_hash_size - 1)]; *p != -1;
+			p = &flood[*p].hnext)
+	{
+		if (*p == i)
+		{
+			*p = flood[i].hnext;
+			break;
+		}
+	}
+	flood[i].hnext = -1;
+}
+
+static void	rebuild_flood_hash (void)
+{
+	int	i, size;
+
+	for (size = 16; size < users * 2; size *= 2)
+		;
+	if (size != flood_hash_size)
+	{
+		RESIZE(flood_hash, int, size);
+		flood_hash_size = size;
+	}
+	for (i = 0; i < flood_hash_size; i++)
+		flood_hash[i] = -1;
+	for (i = 0; i < users; i++)
+		flood_hash_add(i);
+}
+
+
+/*
+ * flood_bucket_width - How long each part of the window is right now.
+ * Zero means the window never ends (/SET FLOOD_RATE 0).
+ */
+static double	flood_bucket_width (void)
+{
+	double	after, rate, per;
+
+	after = get_int_var(FLOOD_AFTER_VAR);
+	rate = get_int_var(FLOOD_RATE_VAR);
+	per = get_int_var(FLOOD_RATE_PER_VAR);
+	if (per < 1)
+		per = 1;
+	if (rate <= 0 || after <= 0)
+		return 0;
+	return (after * per / rate) / FLOOD_BUCKETS;
+}
+
+static void	clear_flood_slot (Flooding *f, Timeval now)
+{
+	int	b;
+
+	for (b = 0; b < FLOOD_BUCKETS; b++)
+		f->bucket[b] = 0;
+	f->cnt = 0;
+	f->start = now;
+}
+
+/*
+ * age_flood_slot - Empty out the parts of a slot's window that have gone
+ * by since the last time we looked.  This never does more than 
+ * FLOOD_BUCKETS worth of work, no matter how long it's been.
+ */
+static void	age_flood_slot (Flooding *f, Timeval now, double width)
+{
+	double	seconds, tick, gap;
+	int	b, a;
+
+	seconds = now.tv_sec + now.tv_usec / 1000000.0;
+	tick = width > 0 ? floor(seconds / width) : 0;
+
+	/* If the /SETs changed, the old parts don't mean anything */
+	if (width != f->width)
+	{
+		f->width = width;
+		f->tick = tick;
+		clear_flood_slot(f, now);
+		return;
+	}
+
+	if ((gap = tick - f->tick) <= 0)
+		return;
+	if (gap > FLOOD_BUCKETS)
+		gap = FLOOD_BUCKETS;
+	for (a = 1; a <= gap; a++)
+	{
+		b = (int)fmod(f->tick + a, FLOOD_BUCKETS);
+		f->cnt -= f->bucket[b];
+		f->bucket[b] = 0;
+	}
+	f->tick = tick;
+
+	/* 
+	 * The window now starts with the oldest part that has anything.
+	 * (If it's empty, this is when they were last counted from zero)
+	 */
+	for (a = FLOOD_BUCKETS - 1; f->cnt && a >= 0; a--)
+	{
+		if (f->bucket[(int)fmod(tick - a, FLOOD_BUCKETS)])
+		{
+			f->start = double_to_timeval((tick - a) * width);
+			break;
+		}
+	}
+}
+
+/* Count one message in a slot (that has just been aged) */
+static void	count_flood_message (Flooding *f)
+{
+	f->bucket[(int)fmod(f->tick, FLOOD_BUCKETS)]++;
+	f->cnt++;
+}
 
 /*
  * If flood_maskuser is 0, proceed normally.  If 2, keep
@@ -109,10 +307,11 @@ static	int	 pos = 0;
 		 server,
 		 retval = 0;
 	Timeval	 right_now;
-	double	 diff;
+	double	 diff, width;
 	Flooding *tmp;
 	int	l;
 	char *	freeit;
+	u_32int_t hash;
 
 	freeit = malloc_strdup(nuh);
 	nuh = freeit;
@@ -143,10 +342,15 @@ static	int	 pos = 0;
 			flood[i].cnt = 0;
 			get_time(&(flood[i].start));
 			flood[i].floods = 0;
+			flood[i].tick = 0;
+			flood[i].width = -1;
 		}
 		users = numusers;
 		if (users)
+		{
 			pos %= users;
+			rebuild_flood_hash();
+		}
 	}
 
 	/*
@@ -156,6 +360,9 @@ static	int	 pos = 0;
 	{
 		if (flood)
 			new_free((char **)&flood);
+		if (flood_hash)
+			new_free((char **)&flood_hash);
+		flood_hash_size = 0;
 		users = 0;
 		new_free(&freeit);
 		return 0;
@@ -183,17 +390,19 @@ static	int	 pos = 0;
 	 *	else if we're not for a channel, it must also not be for
 	 *		a channel.
 	 */
-	for (i = 0; i < users; i++)
+	hash = flood_key_hash(server, level, nuh, chan);
+	for (i = flood_hash[hash & (flood_hash_size - 1)]; i != -1; 
+				i = flood[i].hnext)
 	{
 		/*
 		 * Do some inexpensive tests first
 		 */
+		if (hash != flood[i].hash)
+			continue;
 		if (level != flood[i].level)
 			continue;
 		if (server != flood[i].server)
 			continue;
-		if (!flood[i].nuh)
-			continue;
 
 		/*
 		 * Must be for the person we're looking for
@@ -220,21 +429,44 @@ static	int	 pos = 0;
 	}
 
 	get_time(&right_now);
+	width = flood_bucket_width();
 
 	/*
 	 * We didnt find anybody.
 	 */
-	if (i == users)
+	if (i == -1)
 	{
 		/*
-		 * pos points at the next insertion point in the array.
+		 * pos is the clock hand.  We'd like to take over a slot 
+		 * for someone who's gone quiet (whose window is empty) and 
+		 * hasn't flooded lately, but we only look at a few slots, 
+		 * and if none of them are quiet, we take the one that has 
+		 * been the least busy.
 		 */
-		int old_pos = pos;
-		do {
+		int	probe, best = -1;
+
+		for (probe = 0; probe < FLOOD_PROBES && probe < users; probe++)
+		{
 			pos = (0 < pos ? pos : users) - 1;
-		} while (0 < --flood[pos].floods && pos != old_pos);
+			tmp = flood + pos;
+			if (!tmp->nuh)
+			{
+				best = pos;
+				break;
+			}
 
-		tmp = flood + pos;
+			age_flood_slot(tmp, right_now, width);
+			if (tmp->cnt == 0 && --tmp->floods <= 0)
+			{
+				best = pos;
+				break;
+			}
+			if (best == -1 || tmp->cnt < flood[best].cnt)
+				best = pos;
+		}
+
+		tmp = flood + best;
+		flood_hash_remove(best);
 		malloc_strcpy(&tmp->nuh, nuh);
 		if (chan)
 			malloc_strcpy(&tmp->channel, chan);
@@ -243,10 +475,12 @@ static	int	 pos = 0;
 
 		tmp->server = server;
 		tmp->level = level;
-		tmp->cnt = 0;
-		tmp->start = right_now;
+		tmp->floods = 0;
+		tmp->width = -1;		/* Start a new window */
+		age_flood_slot(tmp, right_now, width);
+		count_flood_message(tmp);
+		flood_hash_add(best);
 
-		pos = (0 < old_pos ? old_pos : users) - 1;
 		new_free(&freeit);
 		return 0;
 	}
@@ -254,16 +488,15 @@ static	int	 pos = 0;
 		tmp = flood + i;
 
 	/*
-	 * Has the person flooded too much?
+	 * Has the person flooded too much?  That's if they've already 
+	 * sent FLOOD_AFTER messages inside the window.
 	 */
-	if (++tmp->cnt >= get_int_var(FLOOD_AFTER_VAR))
+	age_flood_slot(tmp, right_now, width);
+	if (tmp->cnt >= get_int_var(FLOOD_AFTER_VAR))
 	{
-		float rate = get_int_var(FLOOD_RATE_VAR);
-		rate /= get_int_var(FLOOD_RATE_PER_VAR);
 		diff = time_diff(tmp->start, right_now);
 
-		if ((diff == 0.0 || tmp->cnt / diff >= rate) &&
-				(retval = do_hook(FLOOD_LIST, "%s %s %s %ld %s",
+		if ((retval = do_hook(FLOOD_LIST, "%s %s %s %ld %s",
 				nick, level_to_str(tmp->level),
 				chan ? chan : "*", tmp->cnt, line)))
 		{
@@ -277,12 +510,12 @@ static	int	 pos = 0;
 		else
 		{
 			/*
-			 * Not really flooding -- reset back to normal.
+			 * The user says they're not flooding -- start over.
 			 */
-			tmp->cnt = 0;
-			tmp->start = right_now;
+			clear_flood_slot(tmp, right_now);
 		}
 	}
+	count_flood_message(tmp);
 
 	new_free(&freeit);
 
@@ -308,10 +541,16 @@ char *	function_floodinfo (char *args)
 	size_t	clue = 0;
 	Timeval right_now;
 	int	i;
-	double	idiff;
+	double	idiff, width;
 
 	get_time(&right_now);
 
+	/* So everybody's count is up to date */
+	width = flood_bucket_width();
+	for (i = 0; i < users; i++)
+		if (flood[i].nuh)
+			age_flood_slot(&flood[i], right_now, width);
+
 	while ((arg = new_next_arg(args, &args))) 
 	{
 	const	char	*nuh = star;
@@ -185,6 +185,8 @@ static	char
 	*function_tolower 	(char *),
 	*function_toupper 	(char *),
 	*function_userhost 	(char *),
+	*function_useraccount 	(char *),
+	*function_useraway 	(char *),
 	*function_word 		(char *),
 	*function_utime		(char *),
 	*function_strftime	(char *),
@@ -766,6 +768,8 @@ static BuiltInFunctions	built_in_functions[] =
 	{ "UNLINK",		function_unlink 	},
 	{ "UNSHIFT",		function_unshift 	},
 	{ "UNSPLIT",		function_unsplit	},
+	{ "USERACCOUNT",	function_useraccount	},
+	{ "USERAWAY",		function_useraway	},
 	{ "USERHOST",		function_userhost 	},
 	{ "USERMODE",		function_umode		},
 	{ "USETITEM",           function_usetitem 	},
@@ -1448,6 +1452,30 @@ BUILT_IN_FUNCTION(function_userhost, input)
 	RETURN_STR(FromUserHost);
 }
 
+/*
+ * Usage: $useraccount(nick)
+ * Usage: $useraway(nick)
+ * Returns: The services account, or the away message, of someone on one of
+ *	    your channels, if the server has told us about it (with the
+ *	    extended-join, account-notify, or away-notify capabilities).
+ *	    If we don't know, returns the empty string.
+ */
+BUILT_IN_FUNCTION(function_useraccount, input)
+{
+	char *	nick;
+
+	GET_FUNC_ARG(nick, input);
+	RETURN_STR(fetch_account(from_server, nick));
+}
+
+BUILT_IN_FUNCTION(function_useraway, input)
+{
+	char *	nick;
+
+	GET_FUNC_ARG(nick, input);
+	RETURN_STR(fetch_away(from_server, nick));
+}
+
 /* 
  * Usage: $strip(characters text)
  * Returns: <text> with all instances of any characters in the <characters>
@@ -7597,8 +7625,8 @@ BUILT_IN_FUNCTION(function_channellimit, word)
  *
  *   echo $xform(iconv FROMCODE/TOCODE[/OPTION] stuff) 
  *
- * which is heaps expensive, because it /opens/ and 
- * /closes/ an iconv_t descriptor for each usage. 
+ * which used to be heaps expensive, because it /opened/ and 
+ * /closed/ an iconv_t descriptor for each usage (see below).
  *   Or the user can control this stuff herself, by first
  * opening the iconv descriptor manually, and then refering to
  * its identifier thusly:
@@ -7621,6 +7649,15 @@ BUILT_IN_FUNCTION(function_channellimit, word)
  *
  *   echo $iconvctl(get $id)
  *
+ * The descriptors used by $xform(iconv FROMCODE/TOCODE stuff) (and by
+ * /ENCODING, and /LOAD -ENCODING, etc) are kept in a pool so they don't
+ * really get opened and closed every time.  You can see how well that's
+ * working with:
+ *
+ *   echo $iconvctl(pool)
+ *
+ * which returns "hits misses evictions descriptors-in-use".
+ *
  * Other functionality may or may not be added at
  * a later point of time.
  */
@@ -7680,6 +7717,12 @@ char *function_iconvctl (char *input)
 		RETURN_INT(id);
 	}
 
+	/*
+	 * Return the iconv pool statistics.
+	 */
+	if (!my_strnicmp(listc, "POOL", len))
+		RETURN_MSTR(iconv_pool_stats());
+
 	if (iconv_list_size == 0)
 		RETURN_EMPTY;
 
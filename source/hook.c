@@ -187,6 +187,7 @@ Hookables hook_function_templates[] =
 	{ "MSG",		NULL,	2,	0,	0,	NULL, 0 },
 	{ "MSG_GROUP",		NULL,	3,	0,	0,	NULL, 0 },
 	{ "NAMES",		NULL,	2,	0,	0,	NULL, 0 },
+	{ "NETSPLIT",		NULL,	3,	0,	0,	NULL, 0 },
 	{ "NEW_NICKNAME",	NULL,	2,	0,	HF_NORECURSE,	NULL, 0 },
 	{ "NICKNAME",		NULL,	2,	0,	0,	NULL, 0 },
 	{ "NOTE",		NULL,	3,	0,	0,	NULL, 0 },
@@ -121,12 +121,14 @@ typedef struct	IgnoreStru
 	Timeval	expiration;		/* When this ignore expires */
 	char	*reason;
 	int	enabled;
+	int	position;		/* Where it is on the list (see below) */
 }	Ignore;
 
 /* ignored_nicks: pointer to the head of the ignore list */
 static	Ignore *ignored_nicks = NULL;
 static	int	global_ignore_refnum = 0;
 static	int	ignores_are_suspended = 0;
+static	int	ignore_index_dirty = 1;
 
 static void	expire_ignores			(void);
 static const char *	get_ignore_types 		(Ignore *item, int);
@@ -158,6 +160,7 @@ static Ignore *new_ignore (const char *new_nick)
 	item->expiration.tv_usec = 0;
 	item->enabled = 1;
 	add_to_list((List **)&ignored_nicks, (List *)item);
+	ignore_index_dirty = 1;
 	return item;
 }
 
@@ -267,6 +270,7 @@ static int 	remove_ignore (const char *nick)
 			last->next = item->next;
 		    else
 			ignored_nicks = item->next;
+		    ignore_index_dirty = 1;
 
 		    say("%s removed from ignorance list (ignore refnum %d)", 
 				item->nick, item->refnum);
@@ -290,6 +294,8 @@ static int 	remove_ignore (const char *nick)
 				*user ? user : star,
 				*host ? host : star);
 
+	ignore_index_dirty = 1;
+
 	/*
 	 * Look for an exact match first.
 	 */
@@ -1129,6 +1135,7 @@ char *	ignorectl (char *input)
 		len = strlen(listc);
 		if (!my_strnicmp(listc, "NICK", len)) {
 			malloc_strcpy(&i->nick, input);
+			ignore_index_dirty = 1;
 			RETURN_INT(i->refnum);
 		} else if (!my_strnicmp(listc, "LEVELS", len)) {
 			mask_unsetall(&i->type);
@@ -1192,6 +1199,289 @@ char *	ignorectl (char *input)
 
 
 /***************************** BACK END *************************************/
+/*
+ * The ignore index
+ *
+ * Every message from the server goes through check_ignore_channel(), and
+ * walking the whole ignore list and wild_match()ing every pattern for 
+ * every message adds up when you have a few hundred ignores and busy 
+ * channels.  So we sort the ignores into buckets by the shape of their
+ * pattern, and each message only looks in the buckets it could possibly
+ * be in.  The shapes are:
+ *
+ *	IX_EXACT	No wildcards at all ("#EPIC", "irc.foo.com")
+ *	IX_NICK		"NICK!*@*" (what /ignore nick turns into)
+ *	IX_USERHOST	"*!USER@HOST"
+ *	IX_HOST		"*!*@HOST"
+ *	IX_TAIL		Ends with 4, 8, or 16 literal chars ("*!*@*.AOL.COM")
+ *	IX_HEAD		Starts with 4, 8, or 16 literal chars ("SPAM*")
+ *
+ * and everything else (including anything with a backslash in it) goes
+ * into the residue, which is checked for every message, just like before.
+ * The buckets are keyed by a hash of the part of the nick!user@host that
+ * the pattern would have to match, so they are only a shortlist; 
+ * wild_match() still has the final say on every candidate, so you get
+ * exactly the same answers as you did by walking the list.
+ *
+ * The index is thrown away and rebuilt whenever the list changes, which
+ * is a lot less often than messages arrive.
+ */
+#define IX_EXACT	'='
+#define IX_NICK		'n'
+#define IX_USERHOST	'u'
+#define IX_HOST		'h'
+#define IX_TAIL		't'
+#define IX_HEAD		'p'
+
+typedef struct IgnoreIndexStru
+{
+	struct IgnoreIndexStru *next;
+	u_32int_t	hash;
+	Ignore *	item;
+} IgnoreIndex;
+
+static	IgnoreIndex **	ignore_index = NULL;
+static	int		ignore_index_size = 0;
+static	Ignore **	ignore_residue = NULL;
+static	int		ignore_residue_count = 0;
+static	int		ignore_key_sizes[] = { 16, 8, 4 };
+
+static u_32int_t	ignore_key_hash (int kind, const char *key, size_t len)
+{
+	const unsigned char *s = (const unsigned char *)key;
+	u_32int_t	hash = 2166136261U;
+
+	hash = (hash ^ (u_32int_t)kind) * 16777619U;
+	hash = (hash ^ (u_32int_t)len) * 16777619U;
+	for (; len > 0; s++, len--)
+		hash = (hash ^ (u_32int_t)tolower(*s)) * 16777619U;
+	return hash;
+}
+
+/* Does this run of a pattern have any wildcards in it? */
+static int	ignore_is_literal (const char *str, size_t len, const char *also)
+{
+	for (; len > 0; str++, len--)
+	{
+		if (*str == '*' || *str == '%' || *str == '?' || *str == '\\')
+			return 0;
+		if (also && strchr(also, *str))
+			return 0;
+	}
+	return 1;
+}
+
+static void	index_ignore (Ignore *item, int kind, const char *key, size_t len)
+{
+	IgnoreIndex *	ix;
+	int		bucket;
+
+	ix = (IgnoreIndex *)new_malloc(sizeof(IgnoreIndex));
+	ix->hash = ignore_key_hash(kind, key, len);
+	ix->item = item;
+	bucket = ix->hash & (ignore_index_size - 1);
+	ix->next = ignore_index[bucket];
+	ignore_index[bucket] = ix;
+}
+
+/*
+ * classify_ignore - Figure out which bucket an ignore's pattern goes in.
+ * If it doesn't fit any of them, then it goes into the residue.
+ */
+static void	classify_ignore (Ignore *item)
+{
+	const char *	p = item->nick;
+	size_t		len = strlen(p);
+	const char *	bang;
+	const char *	at;
+	size_t		head, tail;
+	int		i;
+
+	if (ignore_is_literal(p, len, NULL))
+	{
+		index_ignore(item, IX_EXACT, p, len);
+		return;
+	}
+
+	if (!strchr(p, '\\'))
+	{
+	    /* NICK!*@* */
+	    if ((bang = strchr(p, '!')) && bang > p && !strcmp(bang, "!*@*") &&
+			ignore_is_literal(p, bang - p, "@"))
+	    {
+		index_ignore(item, IX_NICK, p, bang - p);
+		return;
+	    }
+
+	    /* *!*@HOST and *!USER@HOST */
+	    if (!strncmp(p, "*!", 2) && (at = strchr(p + 2, '@')) && at[1] &&
+			ignore_is_literal(at + 1, strlen(at + 1), "@!"))
+	    {
+		if (at == p + 3 && p[2] == '*')
+		{
+		    index_ignore(item, IX_HOST, at + 1, strlen(at + 1));
+		    return;
+		}
+		if (at > p + 2 && ignore_is_literal(p + 2, at - (p + 2), "!"))
+		{
+		    index_ignore(item, IX_USERHOST, p + 2, strlen(p + 2));
+		    return;
+		}
+	    }
+
+	    for (tail = 0; tail < len; tail++)
+		if (!ignore_is_literal(p + len - tail - 1, 1, NULL))
+			break;
+	    for (head = 0; head < len; head++)
+		if (!ignore_is_literal(p + head, 1, NULL))
+			break;
+
+	    for (i = 0; i < 3; i++)
+	    {
+		if (tail >= (size_t)ignore_key_sizes[i])
+		{
+		    index_ignore(item, IX_TAIL, p + len - ignore_key_sizes[i],
+					ignore_key_sizes[i]);
+		    return;
+		}
+	    }
+	    for (i = 0; i < 3; i++)
+	    {
+		if (head >= (size_t)ignore_key_sizes[i])
+		{
+		    index_ignore(item, IX_HEAD, p, ignore_key_sizes[i]);
+		    return;
+		}
+	    }
+	}
+
+	ignore_residue[ignore_residue_count++] = item;
+}
+
+static void	rebuild_ignore_index (void)
+{
+	Ignore *	item;
+	IgnoreIndex *	ix;
+	int		count = 0, i;
+
+	for (i = 0; i < ignore_index_size; i++)
+	{
+		while ((ix = ignore_index[i]))
+		{
+			ignore_index[i] = ix->next;
+			new_free((char **)&ix);
+		}
+	}
+
+	for (item = ignored_nicks; item; item = item->next)
+		item->position = count++;
+
+	for (i = 16; i < count * 2; i *= 2)
+		;
+	if (i != ignore_index_size)
+	{
+		RESIZE(ignore_index, IgnoreIndex *, i);
+		ignore_index_size = i;
+	}
+	for (i = 0; i < ignore_index_size; i++)
+		ignore_index[i] = NULL;
+
+	RESIZE(ignore_residue, Ignore *, count + 1);
+	ignore_residue_count = 0;
+
+	for (item = ignored_nicks; item; item = item->next)
+		classify_ignore(item);
+
+	ignore_index_dirty = 0;
+}
+
+/*
+ * This is what would have happened if we walked the list looking at
+ * 'item' -- An ignore that is exactly 'str' beats everything, otherwise
+ * the best wild_match() wins, and the one higher on the list wins a tie.
+ * Ignores at or below position 'stop' are never considered (the exact 
+ * match used to 'break' out of the loop).
+ */
+static void	consider_ignore (Ignore *item, const char *str, int stop, Ignore **best, int *bestcount, Ignore **exact)
+{
+	int	count;
+
+	if (!item->enabled || item->position >= stop)
+		return;
+
+	if (exact)
+	{
+		if (!strcmp(item->nick, str))
+		{
+			if (!*exact || item->position < (*exact)->position)
+				*exact = item;
+			return;
+		}
+	}
+
+	count = wild_match(item->nick, str);
+	if (count > *bestcount || 
+	    (count && count == *bestcount && item->position < (*best)->position))
+	{
+		*bestcount = count;
+		*best = item;
+	}
+}
+
+static void	lookup_ignore (int kind, const char *key, size_t len, const char *str, int stop, Ignore **best, int *bestcount, Ignore **exact)
+{
+	IgnoreIndex *	ix;
+	u_32int_t	hash;
+
+	hash = ignore_key_hash(kind, key, len);
+	for (ix = ignore_index[hash & (ignore_index_size - 1)]; ix; ix = ix->next)
+		if (ix->hash == hash)
+			consider_ignore(ix->item, str, stop, best, bestcount, exact);
+}
+
+/*
+ * best_ignore - Which ignore would the old list walk have picked for 'str'?
+ * If 'exact' is not NULL, an ignore that is exactly 'str' is returned 
+ * through it, and takes precedence over the return value.
+ */
+static Ignore *	best_ignore (const char *str, int stop, Ignore **exact)
+{
+	Ignore *	best = NULL;
+	int		bestcount = 0;
+	const char *	s;
+	size_t		len = strlen(str);
+	int		i;
+
+	lookup_ignore(IX_EXACT, str, len, str, stop, &best, &bestcount, exact);
+
+	if ((s = strchr(str, '!')))
+	{
+		lookup_ignore(IX_NICK, str, s - str, str, stop, &best, &bestcount, exact);
+		s = strrchr(str, '!') + 1;
+		lookup_ignore(IX_USERHOST, s, strlen(s), str, stop, &best, &bestcount, exact);
+	}
+	if ((s = strrchr(str, '@')))
+	{
+		s++;
+		lookup_ignore(IX_HOST, s, strlen(s), str, stop, &best, &bestcount, exact);
+	}
+
+	for (i = 0; i < 3; i++)
+	{
+		if (len < (size_t)ignore_key_sizes[i])
+			continue;
+		lookup_ignore(IX_TAIL, str + len - ignore_key_sizes[i], 
+				ignore_key_sizes[i], str, stop, &best, &bestcount, exact);
+		lookup_ignore(IX_HEAD, str, ignore_key_sizes[i], 
+				str, stop, &best, &bestcount, exact);
+	}
+
+	for (i = 0; i < ignore_residue_count; i++)
+		consider_ignore(ignore_residue[i], str, stop, &best, &bestcount, exact);
+
+	return best;
+}
+
 /* 
  * check_ignore -- replaces the old double_ignore
  *   Why did i change the name?
@@ -1216,10 +1506,8 @@ int	check_ignore_channel (const char *nick, const char *uh, const char *channel,
 {
 	char 	nuh[IRCD_BUFFER_SIZE];
 	Ignore	*tmp;
-	int	count = 0;
-	int	bestimatch = 0;
+	Ignore	*exact = NULL;
 	Ignore	*i_match = NULL;
-	int	bestcmatch = 0;
 	Ignore	*c_match = NULL;
 
 	if (!ignored_nicks)
@@ -1241,43 +1529,18 @@ int	check_ignore_channel (const char *nick, const char *uh, const char *channel,
 						nick ? nick : star,
 						uh ? uh : star);
 
-	for (tmp = ignored_nicks; tmp; tmp = tmp->next)
-	{
-		if (!tmp->enabled)
-			continue;
-
-		/*
-		 * Always check for exact matches first...
-		 */
-		if (!strcmp(tmp->nick, nuh))
-		{
-			i_match = tmp;
-			break;
-		}
-
-		/*
-		 * Then check for wildcard matches...
-		 */
-		count = wild_match(tmp->nick, nuh);
-		if (count > bestimatch)
-		{
-			bestimatch = count;
-			i_match = tmp;
-		}
+	if (ignore_index_dirty)
+		rebuild_ignore_index();
 
-		/*
-		 * Then check for channels...
-		 */
-		if (channel)
-		{
-			count = wild_match(tmp->nick, channel);
-			if (count > bestcmatch)
-			{
-				bestcmatch = count;
-				c_match = tmp;
-			}
-		}
-	}
+	/*
+	 * Always check for exact matches first, then check for wildcard
+	 * matches, then check for channels.
+	 */
+	i_match = best_ignore(nuh, INT_MAX, &exact);
+	if (exact)
+		i_match = exact;
+	if (channel)
+		c_match = best_ignore(channel, exact ? exact->position : INT_MAX, NULL);
 
 	/*
 	 * We've found something... Always prefer a nickuserhost match
@@ -909,6 +909,17 @@ static	int		level = 0,
 	/* Calculate the time to the next timer timeout */
 	timer = TimerTimeout();
 
+	/* 
+	 * If there are scrollbacks left to rewrap, don't go to sleep.
+	 * (But don't poll either -- that would lock out the user's typing)
+	 */
+	if (scrollback_rewrap_pending() && 
+	    (timer.tv_sec > 0 || timer.tv_usec > 1000))
+	{
+		timer.tv_sec = 0;
+		timer.tv_usec = 1000;
+	}
+
 	/* GO AHEAD AND WAIT FOR SOME DATA TO COME IN */
 	make_window_current(NULL);
 	switch (do_wait(&timer))
@@ -948,6 +959,9 @@ static	int		level = 0,
 	 * Various things that need to be done synchronously...
 	 */
 
+	/* Handle any QUITs we were saving up for a netsplit */
+	flush_netsplit();
+
 	/* deal with caught signals - pegasus */
 	if (signals_caught[0] != 0)
 		do_signals();
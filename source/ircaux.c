@@ -34,6 +34,10 @@
  * SUCH DAMAGE.
  */
 
+/* This has to come before irc.h, which #defines __A and __N */
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "irc.h"
 #include "screen.h"
 #include <pwd.h>
@@ -6219,15 +6223,27 @@ static ssize_t	sha256_encoder (const char *orig, size_t orig_len, const void *me
 ssize_t iconv_list_size = 0;
 struct Iconv_stuff **iconv_list = NULL;
 
-int my_iconv_open (iconv_t *forward, iconv_t *reverse, const char *stuff2)
+/*
+ * iconv_spec_names - Convert FROMCODE/TOCODE[/OPTION] into iconv_open() args
+ *
+ * Arguments:
+ *	stuff	- A FROMCODE/TOCODE[/OPTION] string, as used by $xform(ICONV)
+ *	reverse	- 0 if you want to go from FROMCODE to TOCODE,
+ *		  1 if you want to go from TOCODE to FROMCODE
+ *	to	- A buffer of at least strlen(stuff) + 1 bytes for the 
+ *		  "to" argument to iconv_open()
+ *	from	- Same thing for the "from" argument
+ *	size	- How big "to" and "from" are
+ *
+ * Return value:
+ *	0 on success, 1 if "stuff" is not complete.
+ */
+static int	iconv_spec_names (const char *stuff2, int reverse, char *to, char *from, size_t size)
 {
 	size_t pos, len;
-	char *stuff, *fromcode, *tocode, *option, *tmp;
-	int	size;
+	char *stuff, *fromcode, *tocode, *option;
 
 	stuff = LOCAL_COPY(stuff2);
-	size = strlen(stuff) + 1;
-	tmp = alloca(size);
 	len = strlen(stuff);
 	for (pos = 0; pos < len && stuff[pos] != '/'; pos++);
 	if (stuff[pos] != '/')
@@ -6249,43 +6265,62 @@ int my_iconv_open (iconv_t *forward, iconv_t *reverse, const char *stuff2)
 	}
 	else
 		option = NULL;
-	
-	/* forward: tocode (+option), fromcode*/
+
+	/* 
+	 * forward: tocode (+option), fromcode
+	 * reverse: fromcode (+option), tocode
+	 */
+	if (reverse)
+	{
+		char *x = fromcode;
+		fromcode = tocode;
+		tocode = x;
+	}
+
+	strlcpy(to, tocode, size);
+	if (option)
+	{
+		len = strlen(tocode);
+		to[len] = '/';
+		to[len + 1] = '\0';
+		strlcpy(to + len + 1, option, size - len - 1);
+	}
+	strlcpy(from, fromcode, size);
+	return 0;
+}
+
+int my_iconv_open (iconv_t *forward, iconv_t *reverse, const char *stuff)
+{
+	char *	to;
+	char *	from;
+	size_t	size;
+
+	size = strlen(stuff) + 1;
+	to = alloca(size);
+	from = alloca(size);
+
 	if (forward)
 	{
-		strlcpy(tmp, tocode, size);
-		if (option)
-		{
-			len = strlen(tocode);
-			tmp[len] = '/';
-			tmp[len + 1] = '\0';
-			strlcpy(tmp + len + 1, option, size - len - 1);
-		}
-		if ((*forward = iconv_open(tmp, fromcode)) == (iconv_t) (-1))
+		if (iconv_spec_names(stuff, 0, to, from, size))
+			return 1;
+		if ((*forward = iconv_open(to, from)) == (iconv_t) (-1))
 		{
 			if (x_debug & DEBUG_UNICODE)
 				yell ("Unicode debug: my_iconv_open() fwd: iconv_open(%s, %s) failed.",
-					tmp, fromcode);
+					to, from);
 			return 1;
 		}
 
 	}
-	/* reverse: fromcode (+option), tocode*/
 	if (reverse)
 	{
-		strlcpy(tmp, fromcode, size);
-		if (option)
-		{
-			len = strlen(fromcode);
-			tmp[len] = '/';
-			tmp[len +1] = '\0';
-			strlcpy(tmp + len + 1, option, size - len - 1);
-		}
-		if ((*reverse = iconv_open(tmp, tocode)) == (iconv_t) (-1))
+		if (iconv_spec_names(stuff, 1, to, from, size))
+			return 1;
+		if ((*reverse = iconv_open(to, from)) == (iconv_t) (-1))
 		{
 			if (x_debug & DEBUG_UNICODE)
 				yell ("Unicode debug: my_iconv_open() rev: iconv_open(%s, %s) failed.",
-					tmp, tocode);
+					to, from);
 			return 1;
 		}
 	}
@@ -6296,8 +6331,7 @@ static ssize_t	iconv_recoder (const char *orig, size_t orig_len, const void *met
 {
 	size_t	orig_left = orig_len, 
 		dest_left = dest_len, 
-		n, 
-		close_it = 1;
+		n;
 	int	id;
 	char 	*dest_ptr;
 	char 	*orig_ptr;
@@ -6348,7 +6382,6 @@ static ssize_t	iconv_recoder (const char *orig, size_t orig_len, const void *met
 				}
 				encodingx = iconv_list[id]->reverse;
 			}
-			close_it = 0;
 		}
 		else
 		{
@@ -6361,8 +6394,22 @@ static ssize_t	iconv_recoder (const char *orig, size_t orig_len, const void *met
 	}
 	else
 	{
-		if (my_iconv_open(&encodingx, NULL, (const char *) meta))
+		char *	to;
+		char *	from;
+		size_t	size;
+
+		size = strlen((const char *)meta) + 1;
+		to = alloca(size);
+		from = alloca(size);
+		if (iconv_spec_names((const char *)meta, 0, to, from, size))
+			return 0;
+		if ((encodingx = get_iconv_handle(to, from)) == (iconv_t)-1)
+		{
+			if (x_debug & DEBUG_UNICODE)
+				yell ("Unicode debug: iconv_recoder(): iconv_open(%s, %s) failed.",
+					to, from);
 			return 0;
+		}
 	}
 
 	/* Stuff seems to be working... */
@@ -6378,8 +6425,6 @@ static ssize_t	iconv_recoder (const char *orig, size_t orig_len, const void *met
 		}
 		break;
 	}
-	if (close_it)
-		iconv_close(encodingx);
 	return dest_len - dest_left;
 }
 
@@ -6759,6 +6804,145 @@ ssize_t	findchar_quoted (const char *source, int delim)
 		return -1;
 }
 
+/*
+ * The iconv pool.
+ *
+ * iconv_open() is not cheap -- glibc has to go find and load the gconv 
+ * modules every time -- and we were calling it for every $xform(ICONV),
+ * every file /LOADed in another encoding, and so forth.  So instead, 
+ * everybody gets their (iconv_t)s from here, and we keep them around.
+ * Before we hand one out, we reset its shift state, so it's just as good
+ * as a brand new one.
+ *
+ * The (iconv_t) you get back belongs to the pool.  Don't iconv_close() it!
+ * It's good until the next time you call get_iconv_handle(), which might
+ * recycle it for something else, so don't hang onto it -- just ask again
+ * next time (it's cheap).
+ *
+ * We remember the ones that iconv_open() refused, too, so asking for an
+ * encoding your system doesn't have (like //TRANSLIT on some libcs) over
+ * and over doesn't go looking for it every time.
+ */
+#define ICONV_POOL_SIZE	32
+
+typedef struct IconvPoolStru
+{
+	char *		to;
+	char *		from;
+	iconv_t		handle;		/* (iconv_t)-1 if iconv_open failed */
+	int		error;		/* The errno if iconv_open failed */
+	unsigned long	last_used;
+} IconvPool;
+
+static	IconvPool	iconv_pool[ICONV_POOL_SIZE];
+static	unsigned long	iconv_pool_clock = 0;
+static	unsigned long	iconv_pool_hits = 0;
+static	unsigned long	iconv_pool_misses = 0;
+static	unsigned long	iconv_pool_evictions = 0;
+
+/*
+ * get_iconv_handle - Return a ready-to-use (iconv_t) from "from" to "to"
+ *
+ * Arguments:
+ *	to	- The encoding you want to convert to (see iconv_open(3))
+ *	from	- The encoding you want to convert from (see iconv_open(3))
+ *
+ * Return value:
+ *	(iconv_t)-1 if iconv_open(to, from) fails (errno is set)
+ *	Otherwise, an (iconv_t) in its initial state.  See above.
+ */
+iconv_t	get_iconv_handle (const char *to, const char *from)
+{
+	IconvPool *	p;
+	IconvPool *	victim = NULL;
+	iconv_t		handle;
+	int		i, error = 0;
+
+	for (i = 0; i < ICONV_POOL_SIZE; i++)
+	{
+		p = &iconv_pool[i];
+		if (!p->to)
+		{
+			if (!victim || victim->to)
+				victim = p;
+			continue;
+		}
+		if (!strcmp(p->to, to) && !strcmp(p->from, from))
+		{
+			iconv_pool_hits++;
+			p->last_used = ++iconv_pool_clock;
+			if (p->handle == (iconv_t)-1)
+				errno = p->error;
+			else
+				iconv(p->handle, NULL, NULL, NULL, NULL);
+			return p->handle;
+		}
+		if (!victim || (victim->to && p->last_used < victim->last_used))
+			victim = p;
+	}
+
+	iconv_pool_misses++;
+	if ((handle = iconv_open(to, from)) == (iconv_t)-1)
+		error = errno;
+
+	if (victim->to)
+	{
+		iconv_pool_evictions++;
+		if (victim->handle != (iconv_t)-1)
+			iconv_close(victim->handle);
+	}
+
+	malloc_strcpy(&victim->to, to);
+	malloc_strcpy(&victim->from, from);
+	victim->handle = handle;
+	victim->error = error;
+	victim->last_used = ++iconv_pool_clock;
+	if (handle == (iconv_t)-1)
+		errno = error;
+	return handle;
+}
+
+/*
+ * flush_iconv_pool - Close every pooled (iconv_t), and forget about the
+ *		      ones that failed.  The recode rules call this when 
+ *		      they change.
+ */
+void	flush_iconv_pool (void)
+{
+	int	i;
+
+	for (i = 0; i < ICONV_POOL_SIZE; i++)
+	{
+		if (!iconv_pool[i].to)
+			continue;
+		if (iconv_pool[i].handle != (iconv_t)-1)
+			iconv_close(iconv_pool[i].handle);
+		new_free(&iconv_pool[i].to);
+		new_free(&iconv_pool[i].from);
+		iconv_pool[i].last_used = 0;
+	}
+}
+
+/*
+ * iconv_pool_stats - Describe how well the pool is doing
+ *
+ * Return value:
+ *	A malloced string: "hits misses evictions entries-in-use"
+ *	You must new_free() the return value.
+ */
+char *	iconv_pool_stats (void)
+{
+	int	i, used = 0;
+
+	for (i = 0; i < ICONV_POOL_SIZE; i++)
+		if (iconv_pool[i].to)
+			used++;
+
+	return malloc_sprintf(NULL, "%lu %lu %lu %d", 
+			iconv_pool_hits, iconv_pool_misses,
+			iconv_pool_evictions, used);
+}
+
 /*
  * recode_with_iconv -- copy and iconv convert a string
  * Arguments:
@@ -6805,8 +6989,9 @@ int	recode_with_iconv (const char *from, const char *to, char **data, size_t *nu
 
  	/*
 	 * So iconv(3) says I need to create an iconv_t with iconv_open
+	 * (but the pool does that for us, if it needs to)
 	 */
-	if ((iref = iconv_open(to, from)) == (iconv_t)-1)
+	if ((iref = get_iconv_handle(to, from)) == (iconv_t)-1)
 	{
 		yell("Iconv_open %s/%s failed; %s",
 			to, from, strerror(errno));
@@ -6844,7 +7029,6 @@ int	recode_with_iconv (const char *from, const char *to, char **data, size_t *nu
 
                 break;
         }
-	iconv_close (iref);
 
 	new_free(data);
 	*data = retstr;
@@ -7040,6 +7224,102 @@ int	strext2 (unsigned char **cut, unsigned char *buffer, size_t part2, size_t pa
 }
 
 
+/*
+ * ascii_span - How many 7 bit bytes does a buffer start with?
+ *
+ * Arguments:
+ *	str	- A buffer that might contain 8 bit bytes
+ *	len	- The number of bytes in 'str'
+ *
+ * Return Value:
+ *	The offset of the first byte in 'str' with the high bit set,
+ *	or 'len' if there aren't any.
+ *
+ * Notes:
+ *	Almost everything we get from irc is pure 7 bit ascii, so this is
+ *	worth doing 16 bytes at a time when the cpu can.  Everybody else
+ *	gets to do it 8 bytes at a time.  The odd bytes at the end are 
+ *	done the old fashioned way.
+ */
+static size_t	ascii_span (const unsigned char *str, size_t len)
+{
+	size_t	i = 0;
+
+#ifdef __SSE2__
+	for (; i + 16 <= len; i += 16)
+	{
+		__m128i	chunk = _mm_loadu_si128((const __m128i *)(str + i));
+
+		if (_mm_movemask_epi8(chunk))
+			break;
+	}
+#else
+	for (; i + 8 <= len; i += 8)
+	{
+		uint64_t	chunk;
+
+		memcpy(&chunk, str + i, sizeof(chunk));
+		if (chunk & 0x8080808080808080ULL)
+			break;
+	}
+#endif
+
+	for (; i < len; i++)
+		if (str[i] & 0x80)
+			break;
+
+	return i;
+}
+
+/*
+ * valid_utf8str - Quickly test whether a string is well formed utf8
+ *
+ * Arguments:
+ *	str	- A string to be tested for utf8-ness.  Must be nul terminated.
+ *		  Unlike invalid_utf8str(), this string is never modified.
+ *
+ * Return Value:
+ *	2	The string is pure 7 bit ascii (which is also utf8)
+ *	1	The string is well formed utf8
+ *	0	The string has at least one byte that is not part of a
+ *		utf8 sequence, or it ends with a partial sequence.
+ *		You need invalid_utf8str() to sort out which.
+ *
+ * Notes:
+ *	A "well formed" sequence is exactly what next_code_point() accepts,
+ *	so if this returns non-zero, invalid_utf8str() would have found no
+ *	defects (and trimmed nothing).  The ascii runs between the 8 bit
+ *	sequences are skipped with ascii_span().
+ */
+int	valid_utf8str (const unsigned char *str)
+{
+	size_t	len, i, j, n;
+	int	all_ascii = 1;
+
+	len = strlen((const char *)str);
+	for (i = 0; ; i += n + 1)
+	{
+		if ((i += ascii_span(str + i, len - i)) >= len)
+			return all_ascii ? 2 : 1;
+
+		all_ascii = 0;
+		if ((str[i] & 0xE0) == 0xC0)
+			n = 1;
+		else if ((str[i] & 0xF0) == 0xE0)
+			n = 2;
+		else if ((str[i] & 0xF8) == 0xF0)
+			n = 3;
+		else
+			return 0;
+
+		if (i + n >= len)
+			return 0;
+		for (j = 1; j <= n; j++)
+			if ((str[i + j] & 0xC0) != 0x80)
+				return 0;
+	}
+}
+
 /*
  * invalid_utf8str - Test whether a string is valid utf8 string (or not)
  *
@@ -7063,6 +7343,10 @@ int	invalid_utf8str (unsigned char *utf8str)
 	int	errors = 0;
 	int	count = 0;
 
+	/* The overwhelmingly common case is that it's fine. */
+	if (valid_utf8str(utf8str))
+		return 0;
+
 	s = utf8str;
 	while ((code_point = next_code_point((const unsigned char **)&s, 0)))
 	{
@@ -7127,16 +7411,19 @@ int	is_iso2022_jp (const unsigned char *buffer)
 	const unsigned char *x;
 	int	found_one = 0;
 
+	/* 
+	 * ISO-2022-JP has to have a 2022 <escape> sequence somewhere.
+	 * Hardly anything has an <escape>, so check that first.
+	 */
+	if (!strchr((const char *)buffer, 0x1B))
+		return 0;
+
 	/* ISO-2022-JP has no 8 bit chars. */
-	for (x = buffer; *x; x++)
-		if (*x & 0x80)
-			return 0;
+	if (valid_utf8str(buffer) != 2)
+		return 0;
 
-	/* ISO-2022-JP has to have a 2022 <escape> sequence somewhere */
-	for (x = buffer; *x; x++)
+	for (x = buffer; (x = (const unsigned char *)strchr((const char *)x, 0x1B)); x++)
 	{
-	    if (*x == 0x1B)	/* Escape */
-	    {
 		if (x[1] == '$')
 		{
 			if (x[2] == '@')
@@ -7158,7 +7445,6 @@ int	is_iso2022_jp (const unsigned char *buffer)
 			else if (x[2] == 'J')
 				found_one++;
 		}
-	    }
 	}
 
 	/* I could run the string through iconv() to see if it converts.. */
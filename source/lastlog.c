@@ -45,6 +45,7 @@
 #include "reg.h"
 #include "alias.h"
 #include "timer.h"
+#include <sys/mman.h>
 
 typedef struct	lastlog_stru
 {
@@ -59,19 +60,164 @@ typedef struct	lastlog_stru
 	intmax_t refnum;
 	Window *window;
 	int	dead;
+	intmax_t winpos;	/* Where it is in window's "all" ring */
+	intmax_t vispos;	/* Where it is in window's "visible" ring */
+	struct lastlog_chunk_stru *chunk;	/* Where it lives (see below) */
 }	Lastlog;
 
+/*
+ * Lastlog entries (the Lastlog, the text, and the target, all in a row)
+ * are carved out of big chunks of memory instead of being new_malloc()ed
+ * one at a time, because with a big lastlog that's a whole lot of tiny
+ * allocations, and freeing them one at a time as they're trimmed chops up
+ * the heap something fierce.  Each window hands out entries from its own
+ * chunk until it's full, and then starts a new one (twice as big as the
+ * last one, up to LASTLOG_CHUNK_MAX).  Each chunk counts how many of its 
+ * entries are still alive, and when the last one is removed, the whole 
+ * chunk goes away (or is reused, if the window is still filling it).
+ */
+#define LASTLOG_CHUNK_MIN	4096
+#define LASTLOG_CHUNK_MAX	65536
+#define LASTLOG_ALIGN(x)	(((x) + 15) & ~((size_t)15))
+
+typedef struct	lastlog_chunk_stru
+{
+	size_t	size;		/* How many bytes can be handed out */
+	size_t	used;		/* How many bytes have been handed out */
+	int	live;		/* How many entries are still in here */
+	int	filling;	/* Is some window still handing these out? */
+}	LastlogChunk;
+
+/*
+ * All of the lastlog entries are kept on one big list in the order they
+ * were created (the refnum is the sequence number), but most of the time 
+ * we only care about one window's entries, and walking everybody's entries
+ * to find them got very expensive with big lastlogs.  So each window also
+ * keeps its entries in two rings -- one with all of them, and one with 
+ * only the visible ones (which is what $line() and /LASTLOG count).
+ *
+ * Each entry remembers its position in its window's rings.  Positions
+ * only ever go up; the position of the oldest entry is ring->first, and
+ * the entry at any position 'pos' is at items[pos % size].
+ *
+ * The "all" ring also keeps a trigram signature (see reg.c) for each block
+ * of LASTLOG_BLOCK entries, so /LASTLOG can skip the ones that can't 
+ * possibly match what you're looking for without looking at them.  The 
+ * ring always has at least LASTLOG_BLOCK empty spots so a new block never 
+ * shares its signature with one that's still in use.
+ */
+#define LASTLOG_BLOCK		64
+#define LASTLOG_TRIGRAM_BITS	8192
+
+typedef struct	lastlog_ring_stru
+{
+	Lastlog **	items;
+	intmax_t	first;		/* The position of the oldest entry */
+	int		count;
+	int		size;		/* Always a power of two */
+	unsigned char *	trigrams;	/* Signatures, one per block */
+	int		stale;		/* Signatures need to be redone */
+}	LastlogRing;
+
+typedef struct	lastlog_index_stru
+{
+	LastlogRing	all;
+	LastlogRing	visible;
+	LastlogChunk *	chunk;		/* Where new entries come from */
+	size_t		chunk_size;	/* How big the next chunk will be */
+	size_t *	spilled;	/* Where spilled entries are (see below) */
+	intmax_t	spill_first;	/* The position of the oldest one */
+	int		spill_count;
+	int		spill_size;	/* Always a power of two */
+	intmax_t	spill_next;	/* Used by compact_lastlog_spill */
+}	LastlogIndex;
+
+/*
+ * With /SET LASTLOG_SPILL, the entries that are trimmed off of a window's
+ * lastlog aren't thrown away -- they're written to a file, and the window
+ * keeps up to LASTLOG_SPILL of them there.  $line(), $lastlog() and 
+ * /LASTLOG just keep going into the file when they run out of entries 
+ * in memory.  Only visible entries are kept.
+ *
+ * The file is only ever appended to, and it's mmap()ed, so looking at a
+ * spilled entry is just a matter of knowing where it is.  Each window keeps
+ * the offsets of its spilled entries in a ring, like the ones above.  
+ * They're always dropped oldest first, so when more than half of the file
+ * is entries that nobody wants any more, we can slide the rest down
+ * without having to sort anything out.
+ *
+ * The file is unlinked as soon as it's created, so it never outlives the
+ * client (even if it crashes).
+ */
+#define LASTLOG_SPILL_GROW	(1024 * 1024)
+
+typedef struct	lastlog_spilled_stru
+{
+	intmax_t	refnum;
+	time_t		created;
+	unsigned	window;		/* The refnum of its window */
+	int		level;
+	int		msglen;		/* Including the nul */
+	int		targetlen;	/* Including the nul, or 0 if no target */
+}	LastlogSpilled;
+
+typedef struct	spill_cursor_stru
+{
+	Window *	window;
+	intmax_t	pos;		/* The next one to look at */
+	intmax_t	first;		/* The oldest one to look at */
+	intmax_t	last;		/* The newest one to look at */
+}	SpillCursor;
+
+typedef struct	spill_walk_stru
+{
+	SpillCursor *	cursors;	/* One for each window we look at */
+	int		ncursors;
+	int		reverse;
+	intmax_t	threshold;	/* Nothing older than this (-NUMBER) */
+	SpillCursor *	context;	/* What we passed over (-CONTEXT) */
+	int		unshown;	/* How much we passed over */
+}	SpillWalk;
+
+static	int	spill_fd = -1;
+static	char *	spill_map = NULL;
+static	size_t	spill_mapped = 0;	/* How big the file (and map) is */
+static	size_t	spill_used = 0;		/* Where the next entry goes */
+static	size_t	spill_dead = 0;		/* How much of that nobody wants */
+static	int	spill_busy = 0;		/* Don't drop or move anything now */
+static	int	spill_failed = 0;	/* Already complained, don't retry */
+static	char *	spill_dir = NULL;	/* Where the file is */
+static	int	spill_moving = 0;	/* Move it when we're not busy */
+
 static	intmax_t global_lastlog_refnum = 0;
 	double	output_expires_after = 0.0;
 
-static int	show_lastlog (Lastlog **l, int *skip, int *number, Mask *level_mask, char *match, regex_t *rex, char *nomatch, regex_t *norex, int *max, const char *target, int mangler, Window *window, int exempt, char **, int, int);
+static int	show_lastlog (Lastlog **l, int *skip, int *number, Mask *level_mask, char *match, regex_t *rex, char *nomatch, regex_t *norex, int *max, const char *target, int mangler, Window *window, int exempt, char **, int, int, const u_32int_t *, int);
 static Lastlog *oldest_lastlog_for_window (Window *window);
 static Lastlog *newer_lastlog_entry (Lastlog *item, Window *window);
 static Lastlog *older_lastlog_entry (Lastlog *item, Window *window);
 static Lastlog *newest_lastlog_for_window (Window *window);
+static Lastlog *older_lastlog_than (Window *window, intmax_t refnum);
 static void	remove_lastlog_item (Lastlog *item);
 static void	move_lastlog_item (Lastlog *item, Window *newwin);
 static void	expire_lastlog_entries (void);
+static void	index_lastlog_item (Lastlog *item);
+static void	unindex_lastlog_item (Lastlog *item);
+static void	reindex_window_lastlog (Window *window);
+static Lastlog *visible_lastlog_entry (Window *window, int line);
+static LastlogIndex *window_lastlog_index (Window *window);
+static Lastlog *new_lastlog_item (Window *window, const char *msg, const char *target);
+static void	free_lastlog_item (Lastlog *item);
+static int	lastlog_might_match (Lastlog *item, const u_32int_t *keys, int nkeys);
+static int	spill_lastlog_item (Lastlog *item);
+static void	trim_lastlog_spill (Window *window);
+static void	drop_lastlog_spill (Window *window);
+static int	lastlog_spill_count (Window *window);
+static Lastlog *lastlog_line_entry (Window *window, int line, Lastlog *tmp);
+static void	output_lastlog_entry (FILE *outfp, char *rewrite, Lastlog *l, const char *result);
+static void	start_spilled_lastlog (SpillWalk *walk, Window *window, Window *scope, int global, int this_server, int reverse, int number, Mask *level_mask, int before);
+static void	show_spilled_lastlog (SpillWalk *walk, Lastlog *until, Window *window, int global, int this_server, Mask *level_mask, int *skip, int *max, char *match, regex_t *rex, char *nomatch, regex_t *norex, const char *target, int mangler, const u_32int_t *trigrams, int ntrigrams, int before, int after, int *exempt_counter, int *but_not_first_time, const char *separator, char *rewrite, FILE *outfp);
+static void	finish_spilled_lastlog (SpillWalk *walk);
 
 Lastlog *	lastlog_oldest = NULL;
 Lastlog *	lastlog_newest = NULL;
@@ -211,18 +357,13 @@ intmax_t	add_to_lastlog (Window *window, const char *line)
 	if (!window)
 		window = current_window;
 
-	new_l = (Lastlog *)new_malloc(sizeof(Lastlog));
+	new_l = new_lastlog_item(window, line, who_from);
 	new_l->dead = 0;
 	new_l->refnum = global_lastlog_refnum++;
 	new_l->older = lastlog_newest;
 	new_l->newer = NULL;
 	new_l->level = who_level;
-	new_l->msg = malloc_strdup(line);
 	new_l->window = window;
-	if (who_from)
-		new_l->target = malloc_strdup(who_from);
-	else
-		new_l->target = NULL;
 
 	time(&new_l->created);
 	if (output_expires_after != 0.0)
@@ -247,13 +388,16 @@ intmax_t	add_to_lastlog (Window *window, const char *line)
 		lastlog_oldest = lastlog_newest;
 
 	if (mask_isset(&window->lastlog_mask, who_level))
-	{
 		new_l->visible = 1;
+	else
+		new_l->visible = 0;
+
+	index_lastlog_item(new_l);
+	if (new_l->visible)
+	{
 		window->lastlog_size++;
 		trim_lastlog(window);
 	}
-	else
-		new_l->visible = 0;
 
 	/* * * */
 	return new_l->refnum;
@@ -282,14 +426,15 @@ void 	trim_lastlog (Window *window)
 			window->refnum);
 
 	/* This must eventually terminate, because it will reach the end
-	 * of the linked-list of lastlog items. */
-	item = oldest_lastlog_for_window(window);
-	while (item && window->lastlog_size > window->lastlog_max)
+	 * of the window's lastlog items. */
+	while (window->lastlog_size > window->lastlog_max &&
+			(item = oldest_lastlog_for_window(window)))
 	{
-		Lastlog *next_item = newer_lastlog_entry(item, window);
-
+		/* If it can't go in the file right now, try again later */
+		if (item->visible && get_int_var(LASTLOG_SPILL_VAR) > 0 &&
+				spill_lastlog_item(item))
+			break;
 		remove_lastlog_item(item);
-		item = next_item;
 	}
 }
 
@@ -306,13 +451,27 @@ void 	truncate_lastlog (Window *window)
 	debuglog("truncate_lastlog: Will remove %d entr(y/ies) from window %d",
 			window->lastlog_size, window->refnum);
 
-	item = oldest_lastlog_for_window(window);
-	while (item)
+	while ((item = oldest_lastlog_for_window(window)))
+		remove_lastlog_item(item);
+
+	if (window->lastlog_index)
 	{
-		Lastlog *next_item = newer_lastlog_entry(item, window);
+		LastlogChunk *chunk;
 
-		remove_lastlog_item(item);
-		item = next_item;
+		drop_lastlog_spill(window);
+
+		/* Entries moved to other windows may still be in here */
+		if ((chunk = window->lastlog_index->chunk))
+		{
+			if (chunk->live == 0)
+				new_free((char **)&chunk);
+			else
+				chunk->filling = 0;
+		}
+		new_free((char **)&window->lastlog_index->all.items);
+		new_free((char **)&window->lastlog_index->all.trigrams);
+		new_free((char **)&window->lastlog_index->visible.items);
+		new_free((char **)&window->lastlog_index);
 	}
 }
 
@@ -439,11 +598,15 @@ BUILT_IN_COMMAND(lastlog)
 	int		lc;
 	char *		rewrite = NULL;
 	Window *	window = current_window;
+	Window *	scope;
 	int		this_server = 0;
 	int		global = 0;
+	u_32int_t	trigrams[64];
+	int		ntrigrams = 0;
+	SpillWalk	walk;
 
 	lc = message_setall(0, NULL, LEVEL_OTHER);
-	cnt = current_window->lastlog_size;
+	cnt = current_window->lastlog_size + lastlog_spill_count(current_window);
 	save_mask = current_window->lastlog_mask;
 	mask_unsetall(&current_window->lastlog_mask);
 	mask_unsetall(&level_mask);
@@ -720,6 +883,19 @@ BUILT_IN_COMMAND(lastlog)
 		norex = &realnoreg;
 	}
 
+	/*
+	 * Figure out what text a line must have to be matched by -LITERAL
+	 * and -REGEX, so we can skip the ones that don't without checking.
+	 * -MANGLE changes the text, so we can't use the trigrams then.
+	 */
+	if (!mangler)
+	{
+		if (match)
+			ntrigrams = wild_match_trigrams(match, trigrams, 32);
+		if (regex)
+			ntrigrams += regex_trigrams(regex, trigrams + ntrigrams, 32);
+	}
+
 	if (x_debug & DEBUG_LASTLOG)
 	{
 		yell("Lastlog summary status:");
@@ -752,6 +928,15 @@ BUILT_IN_COMMAND(lastlog)
 		}
 	}
 
+	/*
+	 * If we're only looking at one window, then we only walk that
+	 * window's entries; otherwise we have to walk everybody's.
+	 */
+	if (global || this_server)
+		scope = NULL;
+	else
+		scope = window;
+
 	/* Iterate over the lastlog here */
 	if (header)
 		file_put_it(outfp, "%s Lastlog:", banner());
@@ -785,7 +970,8 @@ BUILT_IN_COMMAND(lastlog)
 	     * Starting at the NEWEST entry, count back <number> entries.
 	     * This establishes the START POINT for our searches
 	     */
-	    for (start = end = lastlog_newest; start != lastlog_oldest; )
+	    for (start = end = newest_lastlog_for_window(scope); 
+			start != oldest_lastlog_for_window(scope); )
 	    {
 		if (start->visible && 
 		      (global || 
@@ -799,18 +985,35 @@ BUILT_IN_COMMAND(lastlog)
 		    if (i == number)
 			break;
 		}
-		start = start->older;
+		start = older_lastlog_entry(start, scope);
 	    }
 
+	    /*
+	     * Some of the <number> entries may have been spilled, which
+	     * means we start later in memory than we thought.
+	     */
+	    start_spilled_lastlog(&walk, window, scope, global, this_server,
+				0, number, &level_mask, before);
+	    while (start && start->refnum < walk.threshold)
+		start = newer_lastlog_entry(start, scope);
+
 	    /*
 	     * Fine.  Now walk all of the lastlog entries between "start" and "end".
 	     */
 	    lastshown = NULL;
-	    for (l = start; l; (void)(l && (l = l->newer)))
+	    for (l = start; l; (void)(l && (l = newer_lastlog_entry(l, scope))))
 	    {
 		char *result;
 		int	exempt, matching;
 
+		/* First, any spilled entries that are older than this one */
+		show_spilled_lastlog(&walk, l, window, global, this_server,
+				&level_mask, &skip, &max, match, rex, 
+				nomatch, norex, target, mangler, 
+				trigrams, ntrigrams, before, after,
+				&exempt_counter, &but_not_first_time, 
+				separator, rewrite, outfp);
+
 restart:
 		result = NULL;
 		exempt = 0;
@@ -828,7 +1031,7 @@ restart:
 		matching = show_lastlog(&l, &skip, &number, &level_mask, 
 					match, rex, nomatch, norex, &max, target, 
 					mangler, window, exempt, &result, 
-					global, this_server);
+					global, this_server, trigrams, ntrigrams);
 
 		/* 
 		 * Now if the present entry "matches" and we are already in a context
@@ -873,8 +1076,8 @@ restart:
 			     * Note that "counter" counts the number of lines we want
 			     * to unconditionally show!
 			     */
-			    if (l && l->older)
-				l = l->older;
+			    if (l && older_lastlog_entry(l, scope))
+				l = older_lastlog_entry(l, scope);
 			}
 
 			if (l && l == lastshown)
@@ -882,8 +1085,8 @@ restart:
 			        if (x_debug & DEBUG_LASTLOG)
 					yell("I found the previous context at %d / %s", i, l->msg);
 
-				if (l->newer)
-				    l = l->newer;
+				if (newer_lastlog_entry(l, scope))
+				    l = newer_lastlog_entry(l, scope);
 
 				/* Don't show the separator if the contexts overlap */
 				show_separator = 0;
@@ -943,26 +1146,7 @@ restart:
 		 */
 		if (matching || exempt)
     		{
-			/* Honor /LOG REWRITE. */
-			if (rewrite)
-			{
-				unsigned char *n, vitals[10240];
-
-				snprintf(vitals, sizeof(vitals),
-					"%ld %ld %ld %ld . . . %s %s",
-						(long)l->refnum,
-						(long)l->created,
-						(long)l->window->refnum,
-						(long)l->level,
-						l->target?l->target:".",
-						result?result:".");
-
-				n = expand_alias(rewrite, vitals);
-				file_put_it(outfp, "%s", n);
-				new_free(&n);
-			}
-			else
-				file_put_it(outfp, "%s", result);
+			output_lastlog_entry(outfp, rewrite, l, result);
 
 			/* Keep track of what we have shown. */
 			lastshown = l;
@@ -972,6 +1156,15 @@ restart:
 		if (l == end)
 			break;
 	    }
+
+	    /* And then whatever spilled entries are left */
+	    show_spilled_lastlog(&walk, NULL, window, global, this_server,
+				&level_mask, &skip, &max, match, rex, 
+				nomatch, norex, target, mangler, 
+				trigrams, ntrigrams, before, after,
+				&exempt_counter, &but_not_first_time, 
+				separator, rewrite, outfp);
+	    finish_spilled_lastlog(&walk);
 	}
 
 	/* 
@@ -983,7 +1176,8 @@ restart:
 	{
 	    int i = 0;
 
-	    for (start = end = lastlog_newest; end != lastlog_oldest; )
+	    for (start = end = newest_lastlog_for_window(scope); 
+			end != oldest_lastlog_for_window(scope); )
 	    {
 		if (end->visible && 
 		      (global || 
@@ -997,18 +1191,34 @@ restart:
 		    if (i == number)
 			break;
 		}
-		end = end->older;
+		end = older_lastlog_entry(end, scope);
 	    }
 
+	    /* Some of the <number> entries may have been spilled */
+	    start_spilled_lastlog(&walk, window, scope, global, this_server,
+				1, number, &level_mask, before);
+	    while (end && end->refnum < walk.threshold)
+		end = newer_lastlog_entry(end, scope);
+	    if (!end)
+		start = NULL;
+
 	    /*
 	     * Fine.  Now walk all of the lastlog entries between "start" and "end".
 	     */
 	    lastshown = NULL;
-	    for (l = start; l; (void)(l && (l = l->older)))	/* <<<< */
+	    for (l = start; l; (void)(l && (l = older_lastlog_entry(l, scope))))	/* <<<< */
 	    {
 		char *result;
 		int	exempt, matching;
 
+		/* First, any spilled entries that are newer than this one */
+		show_spilled_lastlog(&walk, l, window, global, this_server,
+				&level_mask, &skip, &max, match, rex, 
+				nomatch, norex, target, mangler, 
+				trigrams, ntrigrams, before, after,
+				&exempt_counter, &but_not_first_time, 
+				separator, rewrite, outfp);
+
 restart2:
 		result = NULL;
 		exempt = 0;
@@ -1026,7 +1236,7 @@ restart2:
 		matching = show_lastlog(&l, &skip, &number, &level_mask, 
 					match, rex, nomatch, norex, &max, target, 
 					mangler, window, exempt, &result,
-					global, this_server);
+					global, this_server, trigrams, ntrigrams);
 
 		/* 
 		 * Now if the present entry "matches" and we are already in a context
@@ -1071,8 +1281,8 @@ restart2:
 			     * Note that "counter" counts the number of lines we want
 			     * to unconditionally show!
 			     */
-			    if (l && l->newer)		/* <<<<<< */
-				l = l->newer;		/* <<<<<< */
+			    if (l && newer_lastlog_entry(l, scope))	/* <<<<<< */
+				l = newer_lastlog_entry(l, scope);	/* <<<<<< */
 			}
 
 			if (l && l == lastshown)
@@ -1080,8 +1290,8 @@ restart2:
 			        if (x_debug & DEBUG_LASTLOG)
 					yell("I found the previous context at %d / %s", i, l->msg);
 
-				if (l->older)
-				    l = l->older;
+				if (older_lastlog_entry(l, scope))
+				    l = older_lastlog_entry(l, scope);
 
 				/* Don't show the separator if the contexts overlap */
 				show_separator = 0;
@@ -1141,26 +1351,7 @@ restart2:
 		 */
 		if (matching || exempt)
     		{
-			/* Honor /LOG REWRITE. */
-			if (rewrite)
-			{
-				unsigned char *n, vitals[10240];
-
-				snprintf(vitals, sizeof(vitals),
-					"%ld %ld %ld %ld . . . %s %s",
-						(long)l->refnum,
-						(long)l->created,
-						(long)l->window->refnum,
-						(long)l->level,
-						l->target?l->target:".",
-						result?result:".");
-
-				n = expand_alias(rewrite, vitals);
-				file_put_it(outfp, "%s", n);
-				new_free(&n);
-			}
-			else
-				file_put_it(outfp, "%s", result);
+			output_lastlog_entry(outfp, rewrite, l, result);
 
 			/* Keep track of what we have shown. */
 			lastshown = l;
@@ -1170,6 +1361,15 @@ restart2:
 		if (l == end)
 			break;
 	    }
+
+	    /* And then whatever spilled entries are left */
+	    show_spilled_lastlog(&walk, NULL, window, global, this_server,
+				&level_mask, &skip, &max, match, rex, 
+				nomatch, norex, target, mangler, 
+				trigrams, ntrigrams, before, after,
+				&exempt_counter, &but_not_first_time, 
+				separator, rewrite, outfp);
+	    finish_spilled_lastlog(&walk);
 	}
 	if (header)
 		file_put_it(outfp, "%s End of Lastlog", banner());
@@ -1189,7 +1389,7 @@ bail:
  * This returns 1 if the current item pointed to by 'l' is something that
  * should be displayed based on the criteron provided.
  */
-static int	show_lastlog (Lastlog **l, int *skip, int *number, Mask *level_mask, char *match, regex_t *rex, char *nomatch, regex_t *norex, int *max, const char *target, int mangler, Window *window, int exempt, char **result, int global, int this_server)
+static int	show_lastlog (Lastlog **l, int *skip, int *number, Mask *level_mask, char *match, regex_t *rex, char *nomatch, regex_t *norex, int *max, const char *target, int mangler, Window *window, int exempt, char **result, int global, int this_server, const u_32int_t *trigrams, int ntrigrams)
 {
 	const char *str = NULL;
 	int	retval = 1;
@@ -1251,6 +1451,17 @@ static int	show_lastlog (Lastlog **l, int *skip, int *number, Mask *level_mask,
 		str = (*l)->msg;
 
 
+	if (ntrigrams && !lastlog_might_match(*l, trigrams, ntrigrams))
+	{
+		if (x_debug & DEBUG_LASTLOG)
+			yell("Line [%s] doesn't have the right trigrams", str);
+
+		if (exempt)
+			retval = 0;
+		else
+			return 0;			/* Can't possibly match */
+	}
+
 	if (match && !wild_match(match, str))
 	{
 		if (x_debug & DEBUG_LASTLOG)
@@ -1321,6 +1532,34 @@ static int	show_lastlog (Lastlog **l, int *skip, int *number, Mask *level_mask,
 	return retval;		/* Show it! (or not, if exempt) */
 }
 
+/*
+ * output_lastlog_entry - Show one line of /LASTLOG output, either as it is
+ * ('result') or rewritten with /SET LASTLOG_REWRITE (or -REWRITE).
+ */
+static void	output_lastlog_entry (FILE *outfp, char *rewrite, Lastlog *l, const char *result)
+{
+	/* Honor /LOG REWRITE. */
+	if (rewrite)
+	{
+		unsigned char *n, vitals[10240];
+
+		snprintf(vitals, sizeof(vitals),
+			"%ld %ld %ld %ld . . . %s %s",
+				(long)l->refnum,
+				(long)l->created,
+				(long)l->window->refnum,
+				(long)l->level,
+				l->target?l->target:".",
+				result?result:".");
+
+		n = expand_alias(rewrite, vitals);
+		file_put_it(outfp, "%s", n);
+		new_free(&n);
+	}
+	else
+		file_put_it(outfp, "%s", result);
+}
+
 /*
  * reconstitute_scrollback: walk through the lastlog, and put_it everything,
  * making sure to reset the level and all that jazz.  This will cause the 
@@ -1330,11 +1569,32 @@ void	reconstitute_scrollback (Window *window)
 {
 	Lastlog *li;
 
-	for (li = lastlog_oldest; li; li = li->newer)
-	{
-	    if (li->window == window)
+	for (li = oldest_lastlog_for_window(window); li; 
+			li = newer_lastlog_entry(li, window))
 		add_to_window_scrollback(window, li->msg, li->refnum);
+}
+
+/*
+ * rewrap_scrollback: Put the window's lastlog entries that are older than
+ * 'before' (or all of them, if 'before' is -1) back into the top of its
+ * scrollback, newest first.  We stop after we've added at least 'rows' 
+ * rows and have gotten back as far as the entry 'until' (if it isn't -1).
+ * Returns the refnum of the oldest entry we put back, or -1 if there
+ * aren't any older entries left.
+ */
+intmax_t	rewrap_scrollback (Window *window, intmax_t before, intmax_t until, int rows)
+{
+	Lastlog *li;
+	int	added = 0;
+
+	for (li = older_lastlog_than(window, before); li;
+			li = older_lastlog_entry(li, window))
+	{
+		added += prepend_to_window_scrollback(window, li->msg, li->refnum);
+		if (added >= rows && (until < 0 || li->refnum <= until))
+			return li->refnum;
 	}
+	return -1;
 }
 	
 /*
@@ -1352,6 +1612,7 @@ BUILT_IN_FUNCTION(function_line, word)
 	int	line = 0;
 	const char *	windesc = zero;
 	Lastlog	*start_pos;
+	Lastlog	spilled;
 	Window	*win;
 	char	*extra;
 	int	do_level = 0;
@@ -1378,29 +1639,11 @@ BUILT_IN_FUNCTION(function_line, word)
 		RETURN_EMPTY;
 
 	/* Make sure that the line request is within reason */
-	if (line < 1 || line > win->lastlog_size)
+	if (line < 1 || line > win->lastlog_size + lastlog_spill_count(win))
 		RETURN_EMPTY;
 
 	/* Get the line from the lastlog */
-	for (start_pos = lastlog_newest; line; start_pos = start_pos->older)
-	{
-		if (start_pos->window != win)
-			continue;
-		if (start_pos->visible)
-			line--;
-	}
-
-	if (!start_pos)
-		start_pos = lastlog_oldest;
-	else
-		start_pos = start_pos->newer;
-
-	while ((start_pos->visible == 0 || start_pos->window != win) && 
-				start_pos->newer)
-		start_pos = start_pos->newer;
-
-	/* If there are no visible lastlog items, punt */
-	if (!start_pos)
+	if (!(start_pos = lastlog_line_entry(win, line, &spilled)))
 		RETURN_EMPTY;
 
 	malloc_strcat_c(&retval, start_pos->msg, &clue);
@@ -1428,11 +1671,14 @@ BUILT_IN_FUNCTION(function_lastlog, word)
 	char *	pattern = NULL;
 	char *	retval = NULL;
 	Lastlog	*iter;
+	Lastlog	spilled;
 	Window *win;
 	Mask	lastlog_levels;
 	int	line = 1;
 	size_t	rvclue = 0;
 	char *	rejects = NULL;
+	u_32int_t trigrams[32];
+	int	ntrigrams;
 
 	GET_FUNC_ARG(windesc, word);
 	GET_DWORD_ARG(pattern, word);
@@ -1443,15 +1689,12 @@ BUILT_IN_FUNCTION(function_lastlog, word)
 	if (!(win = get_window_by_desc(windesc)))
 		RETURN_EMPTY;
 
-	for (iter = lastlog_newest; iter; iter = iter->older)
+	ntrigrams = wild_match_trigrams(pattern, trigrams, 32);
+	while ((iter = lastlog_line_entry(win, line, &spilled)))
 	{
-		if (iter->window != win)
-			continue;
-		if (iter->visible == 0)
-			continue;
-
 		if (mask_isset(&lastlog_levels, iter->level))
-		    if (wild_match(pattern, iter->msg))
+		    if (!ntrigrams || lastlog_might_match(iter, trigrams, ntrigrams))
+		      if (wild_match(pattern, iter->msg))
 			malloc_strcat_word_c(&retval, space, 
 					ltoa(line), DWORD_NO, &rvclue);
 		line++;
@@ -1539,6 +1782,204 @@ BUILT_IN_FUNCTION(function_lastlogctl, input)
 
 /************************************************************************/
 
+static LastlogIndex *	window_lastlog_index (Window *window)
+{
+	if (!window->lastlog_index)
+	{
+		window->lastlog_index = (LastlogIndex *)new_malloc(sizeof(LastlogIndex));
+		memset(window->lastlog_index, 0, sizeof(LastlogIndex));
+	}
+	return window->lastlog_index;
+}
+
+static Lastlog *	ring_at (LastlogRing *ring, intmax_t pos)
+{
+	if (pos < ring->first || pos >= ring->first + ring->count)
+		return NULL;
+	return ring->items[pos & (ring->size - 1)];
+}
+
+static unsigned char *	ring_block_trigrams (LastlogRing *ring, intmax_t pos)
+{
+	int	blocks = ring->size / LASTLOG_BLOCK;
+
+	return ring->trigrams + ((pos / LASTLOG_BLOCK) & (blocks - 1)) * 
+					(LASTLOG_TRIGRAM_BITS / 8);
+}
+
+static intmax_t	ring_push (LastlogRing *ring, Lastlog *item, int with_trigrams)
+{
+	intmax_t	pos;
+
+	if (ring->count + LASTLOG_BLOCK >= ring->size)
+	{
+		Lastlog **	items;
+		unsigned char *	trigrams = NULL;
+		intmax_t	i;
+		int		size, blocks;
+
+		size = ring->size ? ring->size * 2 : LASTLOG_BLOCK * 2;
+		blocks = size / LASTLOG_BLOCK;
+		items = (Lastlog **)new_malloc(sizeof(Lastlog *) * size);
+		for (i = ring->first; i < ring->first + ring->count; i++)
+			items[i & (size - 1)] = ring->items[i & (ring->size - 1)];
+
+		if (with_trigrams)
+		{
+		    trigrams = new_malloc(blocks * (LASTLOG_TRIGRAM_BITS / 8));
+		    memset(trigrams, 0, blocks * (LASTLOG_TRIGRAM_BITS / 8));
+		    if (ring->trigrams)
+		    {
+			for (i = ring->first / LASTLOG_BLOCK; 
+			     i <= (ring->first + ring->count) / LASTLOG_BLOCK; i++)
+			    memcpy(trigrams + (i & (blocks - 1)) * (LASTLOG_TRIGRAM_BITS / 8),
+				   ring_block_trigrams(ring, i * LASTLOG_BLOCK),
+				   LASTLOG_TRIGRAM_BITS / 8);
+		    }
+		}
+
+		new_free((char **)&ring->items);
+		new_free((char **)&ring->trigrams);
+		ring->items = items;
+		ring->trigrams = trigrams;
+		ring->size = size;
+	}
+
+	pos = ring->first + ring->count;
+	ring->items[pos & (ring->size - 1)] = item;
+	ring->count++;
+
+	if (ring->trigrams)
+	{
+		unsigned char *bits = ring_block_trigrams(ring, pos);
+
+		if (pos % LASTLOG_BLOCK == 0)
+			memset(bits, 0, LASTLOG_TRIGRAM_BITS / 8);
+		trigram_signature_add(bits, LASTLOG_TRIGRAM_BITS, item->msg);
+	}
+
+	return pos;
+}
+
+/*
+ * Removing the oldest (or newest) entry is cheap.  Removing one from the 
+ * middle (which only happens when they expire out of order) means sliding
+ * all the newer ones down a spot, and they all get new positions (and 
+ * some of them are now in a different block than their signature).
+ */
+static void	ring_remove (LastlogRing *ring, intmax_t pos, int visible)
+{
+	Lastlog *	item;
+	intmax_t	i;
+
+	if (pos < ring->first || pos >= ring->first + ring->count)
+		panic(1, "Lastlog position %jd is not in the ring [%jd, %jd)",
+			pos, ring->first, ring->first + ring->count);
+
+	if (pos == ring->first)
+	{
+		ring->first++;
+		ring->count--;
+		return;
+	}
+
+	for (i = pos + 1; i < ring->first + ring->count; i++)
+	{
+		item = ring_at(ring, i);
+		ring->items[(i - 1) & (ring->size - 1)] = item;
+		if (visible)
+			item->vispos = i - 1;
+		else
+			item->winpos = i - 1;
+	}
+	ring->count--;
+	if (i - 1 > pos)
+		ring->stale = 1;
+}
+
+/*
+ * lastlog_might_match - Could 'item' contain all of these trigrams?
+ * If this returns 0, it definitely does not.
+ */
+static int	lastlog_might_match (Lastlog *item, const u_32int_t *keys, int nkeys)
+{
+	LastlogRing *	ring = &item->window->lastlog_index->all;
+	intmax_t	i;
+
+	if (!ring->trigrams || item->winpos < 0)	/* Spilled */
+		return 1;
+
+	if (ring->stale)
+	{
+		memset(ring->trigrams, 0, (ring->size / LASTLOG_BLOCK) * 
+						(LASTLOG_TRIGRAM_BITS / 8));
+		for (i = ring->first; i < ring->first + ring->count; i++)
+			trigram_signature_add(ring_block_trigrams(ring, i), 
+				LASTLOG_TRIGRAM_BITS, ring_at(ring, i)->msg);
+		ring->stale = 0;
+	}
+
+	return trigram_signature_test(ring_block_trigrams(ring, item->winpos),
+				LASTLOG_TRIGRAM_BITS, keys, nkeys);
+}
+
+static void	index_lastlog_item (Lastlog *item)
+{
+	LastlogIndex *	index = window_lastlog_index(item->window);
+
+	item->winpos = ring_push(&index->all, item, 1);
+	if (item->visible)
+		item->vispos = ring_push(&index->visible, item, 0);
+	else
+		item->vispos = -1;
+}
+
+static void	unindex_lastlog_item (Lastlog *item)
+{
+	LastlogIndex *	index = window_lastlog_index(item->window);
+
+	ring_remove(&index->all, item->winpos, 0);
+	if (item->visible)
+		ring_remove(&index->visible, item->vispos, 1);
+}
+
+/*
+ * Moving entries between windows can put them anywhere in the new window's
+ * rings, so after a move we just rebuild them from the big list.
+ */
+static void	reindex_window_lastlog (Window *window)
+{
+	LastlogIndex *	index = window_lastlog_index(window);
+	Lastlog *	l;
+
+	index->all.first += index->all.count;
+	index->all.count = 0;
+	index->visible.first += index->visible.count;
+	index->visible.count = 0;
+
+	for (l = lastlog_oldest; l; l = l->newer)
+		if (l->window == window)
+			index_lastlog_item(l);
+}
+
+/*
+ * Return the <line>th newest visible entry for the window (the newest 
+ * one is 1), just like $line() counts them.
+ */
+static Lastlog *visible_lastlog_entry (Window *window, int line)
+{
+	LastlogRing *	ring;
+
+	if (!window->lastlog_index || line < 1)
+		return NULL;
+	ring = &window->lastlog_index->visible;
+	return ring_at(ring, ring->first + ring->count - line);
+}
+
+/*
+ * These walk the lastlog entries for 'window', or everybody's entries if
+ * 'window' is NULL.  Passing NULL for 'item' starts at the oldest (newest).
+ */
 static Lastlog *oldest_lastlog_for_window (Window *window)
 {
 	return newer_lastlog_entry(NULL, window);
@@ -1546,26 +1987,28 @@ static Lastlog *oldest_lastlog_for_window (Window *window)
 
 static Lastlog *newer_lastlog_entry (Lastlog *item, Window *window)
 {
-	Lastlog *i;
-
-	i = item ? item->newer : lastlog_oldest;
+	LastlogRing *	ring;
 
-	while (i && i->window != window)
-		i = i->newer;
+	if (!window)
+		return item ? item->newer : lastlog_oldest;
+	if (!window->lastlog_index)
+		return NULL;
 
-	return i;
+	ring = &window->lastlog_index->all;
+	return ring_at(ring, item ? item->winpos + 1 : ring->first);
 }
 
 static Lastlog *older_lastlog_entry (Lastlog *item, Window *window)
 {
-	Lastlog *i;
-
-	i = item ? item->older : lastlog_newest;
+	LastlogRing *	ring;
 
-	while (i && i->window != window)
-		i = i->older;
+	if (!window)
+		return item ? item->older : lastlog_newest;
+	if (!window->lastlog_index)
+		return NULL;
 
-	return i;
+	ring = &window->lastlog_index->all;
+	return ring_at(ring, item ? item->winpos - 1 : ring->first + ring->count - 1);
 }
 
 static Lastlog *newest_lastlog_for_window (Window *window)
@@ -1573,6 +2016,35 @@ static Lastlog *newest_lastlog_for_window (Window *window)
 	return older_lastlog_entry(NULL, window);
 }
 
+/*
+ * The newest of the window's entries that is older than 'refnum' (or the
+ * newest one, if 'refnum' is -1).  The window's entries are always kept 
+ * in refnum order, so this is a binary search.
+ */
+static Lastlog *older_lastlog_than (Window *window, intmax_t refnum)
+{
+	LastlogRing *	ring;
+	intmax_t	lo, hi, mid;
+
+	if (refnum < 0)
+		return newest_lastlog_for_window(window);
+	if (!window->lastlog_index)
+		return NULL;
+
+	ring = &window->lastlog_index->all;
+	lo = ring->first;
+	hi = ring->first + ring->count;
+	while (lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		if (ring_at(ring, mid)->refnum < refnum)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return ring_at(ring, lo - 1);
+}
+
 int	recount_window_lastlog (Window *window)
 {
 	Lastlog *i;
@@ -1582,9 +2054,91 @@ int	recount_window_lastlog (Window *window)
 		if (i->window == window && i->visible)
 			count++;
 
+	if ((x_debug & DEBUG_LASTLOG) && window->lastlog_index && 
+			window->lastlog_index->visible.count != count)
+		yell("window [%d]'s lastlog index is wrong: should be [%d], is [%d]",
+			window->refnum, count, window->lastlog_index->visible.count);
+
 	return count;
 }
 
+/*
+ * new_lastlog_item - Carve out a new entry (with a copy of 'msg' and
+ * 'target') from the window's chunk, starting a new chunk if needed.
+ */
+static Lastlog *new_lastlog_item (Window *window, const char *msg, const char *target)
+{
+	LastlogIndex *	index = window_lastlog_index(window);
+	LastlogChunk *	chunk = index->chunk;
+	Lastlog *	item;
+	size_t		msglen, targetlen, need;
+	char *		p;
+
+	msglen = strlen(msg) + 1;
+	targetlen = target ? strlen(target) + 1 : 0;
+	need = LASTLOG_ALIGN(sizeof(Lastlog) + msglen + targetlen);
+
+	if (!chunk || chunk->used + need > chunk->size)
+	{
+		size_t	size;
+
+		if (chunk)
+		{
+			if (chunk->live == 0)
+				new_free((char **)&chunk);
+			else
+				chunk->filling = 0;
+		}
+
+		if (index->chunk_size < LASTLOG_CHUNK_MIN)
+			index->chunk_size = LASTLOG_CHUNK_MIN;
+		size = index->chunk_size;
+		if (size < need)
+			size = need;
+		else if (index->chunk_size < LASTLOG_CHUNK_MAX)
+			index->chunk_size *= 2;
+
+		chunk = (LastlogChunk *)new_malloc(LASTLOG_ALIGN(sizeof(LastlogChunk)) + size);
+		chunk->size = size;
+		chunk->used = 0;
+		chunk->live = 0;
+		chunk->filling = 1;
+		index->chunk = chunk;
+	}
+
+	p = (char *)chunk + LASTLOG_ALIGN(sizeof(LastlogChunk)) + chunk->used;
+	chunk->used += need;
+	chunk->live++;
+
+	item = (Lastlog *)p;
+	item->chunk = chunk;
+	item->msg = p + sizeof(Lastlog);
+	memcpy(item->msg, msg, msglen);
+	if (target)
+	{
+		item->target = item->msg + msglen;
+		memcpy(item->target, target, targetlen);
+	}
+	else
+		item->target = NULL;
+
+	return item;
+}
+
+static void	free_lastlog_item (Lastlog *item)
+{
+	LastlogChunk *	chunk = item->chunk;
+
+	if (--chunk->live > 0)
+		return;
+
+	/* The window is still using it -- just start over from the top */
+	if (chunk->filling)
+		chunk->used = 0;
+	else
+		new_free((char **)&chunk);
+}
+
 static void	remove_lastlog_item (Lastlog *item)
 {
 	if (item->dead)
@@ -1617,6 +2171,8 @@ static void	remove_lastlog_item (Lastlog *item)
 		item->older = NULL;
 	}
 
+	unindex_lastlog_item(item);
+
 	/* 
 	 * We used to do this in trim_lastlog, but it makes more sense
 	 * to do it here, doesn't it?
@@ -1633,9 +2189,7 @@ static void	remove_lastlog_item (Lastlog *item)
 	item->newer = item->older = NULL;
 
 	item->dead = 1;
-	new_free((char **)&item->msg);
-	new_free((char **)&item->target);
-	new_free((char **)&item);
+	free_lastlog_item(item);
 }
 
 /***************************************************************************/
@@ -1663,6 +2217,8 @@ void	move_all_lastlog (Window *oldwin, Window *newwin)
 		if (l->window == oldwin)
 			move_lastlog_item(l, newwin);
 	}
+	reindex_window_lastlog(oldwin);
+	reindex_window_lastlog(newwin);
 }
 
 void	move_lastlog_item_by_string (Window *oldwin, Window *newwin, const char *str)
@@ -1674,6 +2230,8 @@ void	move_lastlog_item_by_string (Window *oldwin, Window *newwin, const char *st
 		if (l->window == oldwin && stristr(l->msg, str) >= 0)
 			move_lastlog_item(l, newwin);
 	}
+	reindex_window_lastlog(oldwin);
+	reindex_window_lastlog(newwin);
 }
 
 void	move_lastlog_item_by_target (Window *oldwin, Window *newwin, const char *str)
@@ -1685,6 +2243,8 @@ void	move_lastlog_item_by_target (Window *oldwin, Window *newwin, const char *st
 		if (l->window == oldwin && !my_stricmp(l->target, str))
 			move_lastlog_item(l, newwin);
 	}
+	reindex_window_lastlog(oldwin);
+	reindex_window_lastlog(newwin);
 }
 
 void	move_lastlog_item_by_level (Window *oldwin, Window *newwin, Mask *levels)
@@ -1696,6 +2256,8 @@ void	move_lastlog_item_by_level (Window *oldwin, Window *newwin, Mask *levels)
 		if (l->window == oldwin && mask_isset(levels, l->level))
 			move_lastlog_item(l, newwin);
 	}
+	reindex_window_lastlog(oldwin);
+	reindex_window_lastlog(newwin);
 }
 
 void	move_lastlog_item_by_regex (Window *oldwin, Window *newwin, const char *str)
@@ -1719,6 +2281,8 @@ void	move_lastlog_item_by_regex (Window *oldwin, Window *newwin, const char *str
 		if (l->window == oldwin && !regexec(&preg, l->msg, 0, NULL, 0))
 			move_lastlog_item(l, newwin);
 	}
+	reindex_window_lastlog(oldwin);
+	reindex_window_lastlog(newwin);
 
 	regfree(&preg);
 }
@@ -1749,3 +2313,639 @@ static void	expire_lastlog_entries (void)
 }
 
 
+
+/************************************************************************/
+static int	open_lastlog_spill (void);
+static int	grow_lastlog_spill (size_t need);
+
+/* Where the spill file should be */
+static const char *	lastlog_spill_dir (void)
+{
+	const char *	dir;
+
+	if (!(dir = get_string_var(LASTLOG_SPILL_DIR_VAR)) && 
+	    !(dir = getenv("TMPDIR")))
+		dir = "/tmp";
+	return dir;
+}
+
+/*
+ * move_lastlog_spill - /SET LASTLOG_SPILL_DIR changed, so make a new 
+ * spill file there, and copy everything from the old one into it.  
+ * Everything is at the same place in the new file, so nobody has to know.
+ * If we can't make the new one, we just keep using the old one.
+ */
+static void	move_lastlog_spill (void)
+{
+	int	old_fd = spill_fd;
+	char *	old_map = spill_map;
+	size_t	old_mapped = spill_mapped;
+	size_t	old_used = spill_used;
+	size_t	old_dead = spill_dead;
+
+	spill_moving = 0;
+	spill_fd = -1;
+	spill_map = NULL;
+	spill_failed = 0;
+	if (open_lastlog_spill() || grow_lastlog_spill(old_used))
+	{
+		if (spill_fd != -1)
+			close(spill_fd);
+		spill_fd = old_fd;
+		spill_map = old_map;
+		spill_mapped = old_mapped;
+		spill_used = old_used;
+		spill_dead = old_dead;
+		return;
+	}
+
+	if (old_used)
+		memcpy(spill_map, old_map, old_used);
+	spill_used = old_used;
+	spill_dead = old_dead;
+
+	if (old_map)
+		munmap(old_map, old_mapped);
+	close(old_fd);
+}
+
+/*
+ * set_lastlog_spill - Called when /SET LASTLOG_SPILL or LASTLOG_SPILL_DIR
+ * changes.  Trims everybody's spilled entries down to the new size (and 
+ * gets rid of the file if it's been turned off, or moves it if the 
+ * directory changed).
+ */
+void	set_lastlog_spill (void *stuff)
+{
+	Window *window = NULL;
+
+	spill_failed = 0;
+	while (traverse_all_windows(&window))
+		trim_lastlog_spill(window);
+
+	if (get_int_var(LASTLOG_SPILL_VAR) <= 0 && spill_fd != -1)
+	{
+		window = NULL;
+		while (traverse_all_windows(&window))
+			drop_lastlog_spill(window);
+		if (spill_map)
+			munmap(spill_map, spill_mapped);
+		close(spill_fd);
+		spill_fd = -1;
+		spill_map = NULL;
+		spill_mapped = spill_used = spill_dead = 0;
+		spill_moving = 0;
+	}
+	else if (spill_fd != -1 && strcmp(spill_dir, lastlog_spill_dir()))
+	{
+		/* Someone is looking at the file -- do it when they're done */
+		if (spill_busy)
+			spill_moving = 1;
+		else
+			move_lastlog_spill();
+	}
+}
+
+static int	open_lastlog_spill (void)
+{
+	const char *	dir;
+	Filename	path;
+	char *		name = NULL;
+
+	if (spill_fd != -1)
+		return 0;
+	if (spill_failed)
+		return -1;
+
+	dir = lastlog_spill_dir();
+
+	if (expand_twiddle(LOCAL_COPY(dir), path))
+	{
+		yell("Can't spill the lastlog to %s: I can't find it", dir);
+		spill_failed = 1;
+		return -1;
+	}
+
+	malloc_sprintf(&name, "%s/epic-lastlog.XXXXXX", path);
+	if ((spill_fd = mkstemp(name)) == -1)
+	{
+		yell("Can't spill the lastlog to %s: %s", path, strerror(errno));
+		spill_failed = 1;
+		new_free(&name);
+		return -1;
+	}
+	unlink(name);
+	new_free(&name);
+
+	malloc_strcpy(&spill_dir, dir);
+	spill_mapped = spill_used = spill_dead = 0;
+	return 0;
+}
+
+/*
+ * grow_lastlog_spill - Make sure there's room for 'need' more bytes at
+ * the end of the spill file.  This can move spill_map!  So it must not
+ * be called while spill_busy is set, because someone is holding onto
+ * pointers into the map.
+ */
+static int	grow_lastlog_spill (size_t need)
+{
+	size_t	size;
+	char *	map;
+
+	if (spill_used + need <= spill_mapped)
+		return 0;
+
+	size = spill_mapped ? spill_mapped : LASTLOG_SPILL_GROW;
+	while (size < spill_used + need)
+		size *= 2;
+
+	if (ftruncate(spill_fd, (off_t)size) == -1 ||
+	    (map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, 
+				spill_fd, 0)) == MAP_FAILED)
+	{
+		yell("Can't make the lastlog spill file bigger: %s", 
+				strerror(errno));
+		return -1;
+	}
+
+	if (spill_map)
+		munmap(spill_map, spill_mapped);
+	spill_map = map;
+	spill_mapped = size;
+	return 0;
+}
+
+static size_t	spilled_size (LastlogSpilled *rec)
+{
+	return LASTLOG_ALIGN(sizeof(LastlogSpilled) + rec->msglen + 
+					rec->targetlen);
+}
+
+static LastlogSpilled *	spilled_at (LastlogIndex *index, intmax_t pos)
+{
+	if (pos < index->spill_first || 
+	    pos >= index->spill_first + index->spill_count)
+		return NULL;
+	return (LastlogSpilled *)(spill_map + 
+			index->spilled[pos & (index->spill_size - 1)]);
+}
+
+/*
+ * spill_lastlog_item - Append 'item' to the spill file, and remember 
+ * where it went.  The caller is about to throw 'item' away.
+ * Returns 1 if the file can't be made bigger right now (someone is
+ * looking at it), so the caller should hang onto 'item' until later
+ * (see finish_spilled_lastlog()).  Otherwise it returns 0, even if
+ * 'item' couldn't be spilled.
+ */
+static int	spill_lastlog_item (Lastlog *item)
+{
+	LastlogIndex *	index = window_lastlog_index(item->window);
+	LastlogSpilled *rec;
+	size_t		msglen, targetlen, need;
+	intmax_t	pos;
+
+	if (open_lastlog_spill())
+		return 0;
+
+	msglen = strlen(item->msg) + 1;
+	targetlen = item->target ? strlen(item->target) + 1 : 0;
+	need = LASTLOG_ALIGN(sizeof(LastlogSpilled) + msglen + targetlen);
+	if (spill_busy && spill_used + need > spill_mapped)
+		return 1;
+	if (grow_lastlog_spill(need))
+		return 0;
+
+	rec = (LastlogSpilled *)(spill_map + spill_used);
+	rec->refnum = item->refnum;
+	rec->created = item->created;
+	rec->window = item->window->refnum;
+	rec->level = item->level;
+	rec->msglen = msglen;
+	rec->targetlen = targetlen;
+	memcpy((char *)(rec + 1), item->msg, msglen);
+	if (targetlen)
+		memcpy((char *)(rec + 1) + msglen, item->target, targetlen);
+
+	if (index->spill_count == index->spill_size)
+	{
+		size_t *	spilled;
+		int		size;
+
+		size = index->spill_size ? index->spill_size * 2 : LASTLOG_BLOCK;
+		spilled = (size_t *)new_malloc(sizeof(size_t) * size);
+		for (pos = index->spill_first; 
+		     pos < index->spill_first + index->spill_count; pos++)
+			spilled[pos & (size - 1)] = 
+				index->spilled[pos & (index->spill_size - 1)];
+		new_free((char **)&index->spilled);
+		index->spilled = spilled;
+		index->spill_size = size;
+	}
+
+	pos = index->spill_first + index->spill_count++;
+	index->spilled[pos & (index->spill_size - 1)] = spill_used;
+	spill_used += need;
+
+	trim_lastlog_spill(item->window);
+	return 0;
+}
+
+/*
+ * compact_lastlog_spill - Once more than half of the spill file is stuff
+ * nobody wants, slide everything that's still wanted down to the front.
+ * Everybody's spilled entries are in the file in the order they were 
+ * spilled, so we just go through the file, and if the entry is the next
+ * one its window is expecting, it's a keeper.
+ */
+static void	compact_lastlog_spill (void)
+{
+	LastlogSpilled *rec;
+	LastlogIndex *	index;
+	Window *	window = NULL;
+	size_t		from, to, size;
+
+	if (spill_busy || spill_dead < LASTLOG_SPILL_GROW || 
+			spill_dead < spill_used / 2)
+		return;
+
+	while (traverse_all_windows(&window))
+		if ((index = window->lastlog_index))
+			index->spill_next = index->spill_first;
+
+	for (from = to = 0; from < spill_used; from += size)
+	{
+		rec = (LastlogSpilled *)(spill_map + from);
+		size = spilled_size(rec);
+
+		if (!(window = get_window_by_refnum(rec->window)) ||
+		    !(index = window->lastlog_index) ||
+		    index->spill_next >= index->spill_first + index->spill_count ||
+		    index->spilled[index->spill_next & (index->spill_size - 1)] != from)
+			continue;		/* Nobody wants this one */
+
+		if (to != from)
+			memmove(spill_map + to, spill_map + from, size);
+		index->spilled[index->spill_next++ & (index->spill_size - 1)] = to;
+		to += size;
+	}
+
+	spill_used = to;
+	spill_dead = 0;
+}
+
+/*
+ * trim_lastlog_spill - Forget about the window's oldest spilled entries 
+ * until it has no more than /SET LASTLOG_SPILL of them.
+ */
+static void	trim_lastlog_spill (Window *window)
+{
+	LastlogIndex *	index = window->lastlog_index;
+	int		max = get_int_var(LASTLOG_SPILL_VAR);
+
+	if (!index || spill_busy)
+		return;
+
+	while (index->spill_count > 0 && index->spill_count > max)
+	{
+		spill_dead += spilled_size(spilled_at(index, index->spill_first));
+		index->spill_first++;
+		index->spill_count--;
+	}
+	compact_lastlog_spill();
+}
+
+/*
+ * drop_lastlog_spill - Forget about all of the window's spilled entries.
+ */
+static void	drop_lastlog_spill (Window *window)
+{
+	LastlogIndex *	index = window->lastlog_index;
+	intmax_t	pos;
+
+	if (!index)
+		return;
+
+	for (pos = index->spill_first; 
+	     pos < index->spill_first + index->spill_count; pos++)
+		spill_dead += spilled_size(spilled_at(index, pos));
+	index->spill_first += index->spill_count;
+	index->spill_count = 0;
+	index->spill_size = 0;
+	new_free((char **)&index->spilled);
+	compact_lastlog_spill();
+}
+
+static int	lastlog_spill_count (Window *window)
+{
+	if (!window->lastlog_index)
+		return 0;
+	return window->lastlog_index->spill_count;
+}
+
+/*
+ * spilled_lastlog_entry - Fill in 'tmp' to look like the spilled entry
+ * at 'pos' for the window.  It points into the spill file, so don't hang
+ * onto it after anything else could be spilled.
+ */
+static Lastlog *spilled_lastlog_entry (Window *window, intmax_t pos, Lastlog *tmp)
+{
+	LastlogSpilled *rec;
+
+	if (!window->lastlog_index || 
+	    !(rec = spilled_at(window->lastlog_index, pos)))
+		return NULL;
+
+	memset(tmp, 0, sizeof(*tmp));
+	tmp->level = rec->level;
+	tmp->msg = (char *)(rec + 1);
+	tmp->target = rec->targetlen ? tmp->msg + rec->msglen : NULL;
+	tmp->created = rec->created;
+	tmp->refnum = rec->refnum;
+	tmp->window = window;
+	tmp->visible = 1;
+	tmp->winpos = tmp->vispos = -1;
+	return tmp;
+}
+
+/*
+ * lastlog_line_entry - Return the <line>th newest visible entry for the
+ * window, like visible_lastlog_entry(), except when we run out of entries
+ * in memory, we keep counting into the spilled ones (using 'tmp').
+ */
+static Lastlog *lastlog_line_entry (Window *window, int line, Lastlog *tmp)
+{
+	LastlogIndex *	index = window->lastlog_index;
+
+	if (!index || line < 1)
+		return NULL;
+	if (line <= index->visible.count)
+		return visible_lastlog_entry(window, line);
+
+	line -= index->visible.count;
+	return spilled_lastlog_entry(window, 
+			index->spill_first + index->spill_count - line, tmp);
+}
+
+/*
+ * next_spill_cursor - /LASTLOG -GLOBAL has to look at everybody's spilled
+ * entries in the order they were created, so pick whichever window has
+ * the oldest (newest, for 'reverse') one to look at next.
+ */
+static int	next_spill_cursor (SpillCursor *cursors, int ncursors, int reverse)
+{
+	LastlogSpilled *rec;
+	intmax_t	bestref = 0;
+	int		c, best = -1;
+
+	for (c = 0; c < ncursors; c++)
+	{
+		if (cursors[c].pos < cursors[c].first || 
+		    cursors[c].pos > cursors[c].last)
+			continue;
+
+		rec = spilled_at(cursors[c].window->lastlog_index, cursors[c].pos);
+		if (best == -1 || (reverse ? rec->refnum > bestref : 
+					     rec->refnum < bestref))
+		{
+			best = c;
+			bestref = rec->refnum;
+		}
+	}
+	return best;
+}
+
+/*
+ * lastlog_entry_counts - Is 'l' one of the entries that /LASTLOG -NUMBER
+ * counts?
+ */
+static int	lastlog_entry_counts (Lastlog *l, Window *window, int global, int this_server, Mask *level_mask)
+{
+	if (!l->visible)
+		return 0;
+	if (!(global || (this_server && l->window->server == window->server) ||
+			l->window == window))
+		return 0;
+	if (!mask_isnone(level_mask) && !mask_isset(level_mask, l->level))
+		return 0;
+	return 1;
+}
+
+/*
+ * start_spilled_lastlog - Get ready for /LASTLOG to look at the spilled
+ * entries.  With -GLOBAL (or -THIS_SERVER), some windows' spilled entries 
+ * can be newer than other windows' entries in memory, so /LASTLOG calls 
+ * show_spilled_lastlog() before each entry in memory to catch up.
+ *
+ * If there's a -NUMBER, we count back that many entries (in memory and
+ * spilled) from the newest one, and nothing older than that is looked at.
+ * walk->threshold is the refnum of the oldest one to look at.
+ */
+static void	start_spilled_lastlog (SpillWalk *walk, Window *window, Window *scope, int global, int this_server, int reverse, int number, Mask *level_mask, int before)
+{
+	LastlogSpilled *rec;
+	LastlogIndex *	index;
+	Window *	w = NULL;
+	Lastlog *	l;
+	int		c, i;
+
+	memset(walk, 0, sizeof(*walk));
+	walk->reverse = reverse;
+
+	while (traverse_all_windows(&w))
+	{
+		if (!(index = w->lastlog_index) || !index->spill_count)
+			continue;
+		if (!(global || (this_server && w->server == window->server) ||
+				w == window))
+			continue;
+
+		RESIZE(walk->cursors, SpillCursor, walk->ncursors + 1);
+		walk->cursors[walk->ncursors].window = w;
+		walk->cursors[walk->ncursors].first = index->spill_first;
+		walk->cursors[walk->ncursors].last = index->spill_first + 
+						     index->spill_count - 1;
+		walk->cursors[walk->ncursors].pos = 
+				walk->cursors[walk->ncursors].last;
+		walk->ncursors++;
+	}
+
+	if (walk->ncursors && number < INT_MAX)
+	{
+		l = newest_lastlog_for_window(scope);
+		for (i = 0; i < number; )
+		{
+			c = next_spill_cursor(walk->cursors, walk->ncursors, 1);
+			rec = c == -1 ? NULL : spilled_at(
+					walk->cursors[c].window->lastlog_index, 
+					walk->cursors[c].pos);
+
+			if (l && (!rec || l->refnum > rec->refnum))
+			{
+				if (lastlog_entry_counts(l, window, global, 
+						this_server, level_mask))
+				{
+					walk->threshold = l->refnum;
+					i++;
+				}
+				l = older_lastlog_entry(l, scope);
+			}
+			else if (rec)
+			{
+				if (mask_isnone(level_mask) || 
+					mask_isset(level_mask, rec->level))
+				{
+					walk->threshold = rec->refnum;
+					i++;
+				}
+				walk->cursors[c].pos--;
+			}
+			else
+				break;
+		}
+
+		if (i < number)
+			walk->threshold = 0;
+		else for (c = 0; c < walk->ncursors; c++)
+			walk->cursors[c].first = walk->cursors[c].pos + 1;
+	}
+
+	for (c = 0; c < walk->ncursors; c++)
+		walk->cursors[c].pos = reverse ? walk->cursors[c].last : 
+						 walk->cursors[c].first;
+
+	if (before > 0)
+		walk->context = (SpillCursor *)new_malloc(sizeof(SpillCursor) * 
+								before);
+
+	/* Nothing gets dropped out from under us while we're outputting */
+	spill_busy++;
+}
+
+/*
+ * show_spilled_lastlog - Look at the spilled entries that come before 
+ * 'until' (older than it, or newer than it for -REVERSE), or all the rest
+ * of them if 'until' is NULL.  This works just like the loops in /LASTLOG,
+ * except that the context lines (-CONTEXT) are remembered as we go, rather
+ * than going back to get them, and they don't reach into the entries in
+ * memory (or vice versa).
+ */
+static void	show_spilled_lastlog (SpillWalk *walk, Lastlog *until, Window *window, int global, int this_server, Mask *level_mask, int *skip, int *max, char *match, regex_t *rex, char *nomatch, regex_t *norex, const char *target, int mangler, const u_32int_t *trigrams, int ntrigrams, int before, int after, int *exempt_counter, int *but_not_first_time, const char *separator, char *rewrite, FILE *outfp)
+{
+	LastlogSpilled *rec;
+	SpillCursor *	cx;
+	Window *	w;
+	Lastlog		tmp, ctmp, *l;
+	int		c, k, exempt, matching, number = INT_MAX;
+	char *		result;
+	char *		str;
+
+	if (*max == 0)
+		return;
+
+	while ((c = next_spill_cursor(walk->cursors, walk->ncursors, 
+						walk->reverse)) != -1)
+	{
+		w = walk->cursors[c].window;
+		rec = spilled_at(w->lastlog_index, walk->cursors[c].pos);
+		if (until && (walk->reverse ? rec->refnum < until->refnum :
+					      rec->refnum > until->refnum))
+			break;
+
+		l = spilled_lastlog_entry(w, walk->cursors[c].pos, &tmp);
+
+		exempt = 0;
+		if (*exempt_counter > 0)
+		{
+			exempt = 1;
+			(*exempt_counter)--;
+		}
+
+		matching = show_lastlog(&l, skip, &number, level_mask, 
+					match, rex, nomatch, norex, max, target,
+					mangler, window, exempt, &result, 
+					global, this_server, trigrams, ntrigrams);
+
+		if (matching && exempt)
+			*exempt_counter = after;
+
+		/*
+		 * Show up to <before> lines that we passed over since the
+		 * last one we showed.  If there were more than that, then
+		 * this is a new context, and needs a separator.
+		 */
+		else if (matching && before > 0)
+		{
+			if (walk->unshown >= before)
+			{
+				if (*but_not_first_time)
+					*but_not_first_time = 0;
+				else
+					file_put_it(outfp, "%s", separator);
+			}
+
+			for (k = walk->unshown < before ? walk->unshown : before; 
+					k > 0; k--)
+			{
+				cx = &walk->context[(walk->unshown - k) % before];
+				spilled_lastlog_entry(cx->window, cx->pos, &ctmp);
+				if (mangler)
+					str = new_normalize_string(ctmp.msg, 1, mangler);
+				else
+					str = malloc_strdup(ctmp.msg);
+				output_lastlog_entry(outfp, rewrite, &ctmp, str);
+				new_free(&str);
+			}
+
+			*exempt_counter = after;
+		}
+		else if (matching && after != -1)
+			*exempt_counter += after;
+		else if (matching)
+			*exempt_counter = 0;
+
+		if (matching || exempt)
+		{
+			/* It could have moved if the output spilled something */
+			spilled_lastlog_entry(w, walk->cursors[c].pos, &tmp);
+			output_lastlog_entry(outfp, rewrite, &tmp, result);
+			walk->unshown = 0;
+		}
+		else if (before > 0)
+		{
+			cx = &walk->context[walk->unshown % before];
+			cx->window = w;
+			cx->pos = walk->cursors[c].pos;
+			walk->unshown++;
+		}
+		new_free(&result);
+
+		walk->cursors[c].pos += walk->reverse ? -1 : 1;
+		if (!l)			/* Already showed -MAXIMUM of them */
+		{
+			walk->ncursors = 0;
+			break;
+		}
+	}
+}
+
+static void	finish_spilled_lastlog (SpillWalk *walk)
+{
+	Window *w = NULL;
+
+	spill_busy--;
+	new_free((char **)&walk->context);
+	new_free((char **)&walk->cursors);
+	if (spill_busy)
+		return;
+
+	/* Now we can do everything we put off while they were looking */
+	if (spill_moving && spill_fd != -1)
+		move_lastlog_spill();
+	while (traverse_all_windows(&w))
+	{
+		trim_lastlog(w);
+		trim_lastlog_spill(w);
+	}
+}
@@ -234,7 +234,8 @@ void	set_logfile (void *stuff)
  */
 void 	add_to_log (int logref, FILE *fp, long winref, const unsigned char *line, int mangler, const char *rewriter)
 {
-	char	*local_line = NULL;
+const	unsigned char *local_line;
+	unsigned char	*free_me = NULL;
 	int	old_logref;
 static	int	recursive = 0;
 
@@ -263,9 +264,9 @@ static	int	recursive = 0;
 	else if (get_int_var(NO_CONTROL_LOG_VAR))
 		mangler |= STRIP_UNPRINTABLE;
 	if (mangler)
-		local_line = new_normalize_string(line, 1, mangler);
+		local_line = normalize_output_line(line, 1, mangler, &free_me);
 	else
-		local_line = malloc_strdup(line);
+		local_line = line;
 
 	if (rewriter == NULL)
 		rewriter = get_string_var(LOG_REWRITE_VAR);
@@ -276,17 +277,17 @@ static	int	recursive = 0;
 
 		/* First, create the $* list for the expando */
 		snprintf(argstuff, 10240, "%ld %s", winref, local_line);
-		new_free(&local_line);
+		new_free(&free_me);
 
 		/* Now expand the expando with the above $* */
 		prepend_exp = expand_alias(rewriter, argstuff);
-		local_line = prepend_exp;
+		local_line = free_me = prepend_exp;
 	}
 
 	fprintf(fp, "%s\n", local_line); /* XXX UTF8 XXX */
 	fflush(fp);
 
-	new_free(&local_line);
+	new_free(&free_me);
 	current_log_refnum = old_logref;
 	recursive--;
 }
@@ -34,6 +34,7 @@
  */
 
 #define NEED_SERVER_LIST
+#define __need_ci_alist_hash__
 #include "irc.h"
 #include "ircaux.h"
 #include "alist.h"
@@ -46,33 +47,62 @@
 #include "list.h"
 #include "hook.h"
 #include "parse.h"
+#include "reg.h"
 
+/*
+ * A Nick is someone's membership on one channel.  Everything about the
+ * person that doesn't depend on the channel (their nickname, userhost,
+ * and so on) is kept once, in the server's user table (see below).
+ */
 typedef struct nick_stru
 {
-	char 	*nick;		/* nickname of person on channel */
-	u_32int_t hash;		/* Hash of the nickname */
-	char	*userhost;	/* Their userhost, if we know it */
-	short	suspicious;	/* True if the nick might be truncated */
-	short	chanop;		/* True if they are a channel operator */
-	short	voice;		/* 1 if they are, 0 if theyre not, -1 if uk */
-	short	half_assed;	/* 1 if they are, 0 if theyre not, -1 if uk */
-	char	prefixes[17];	/* new-style prefixes, supporting up to
-	                         * sixteen modes, though only WiZ knows
-	                         * why you'd need THAT many unless you are on
-	                         * one of those newfangled Unreals *g*
-	                         * -- Ellenor ellenor@umbrellix.net
-	                         */
+struct	chan_user_stru *user;	/* Who this is (see below) */
+	u_32int_t hash;		/* Casemapped hash of the nickname */
+struct	nick_stru *next;	/* Next nick in the same bucket */
+struct	channel_stru *channel;	/* The channel this nick is on */
+struct	nick_stru *next_channel; /* The same person on another channel */
+	u_32int_t status;	/* Their channel prefixes (see server.h) */
+	char	suspicious;	/* True if the nick might be truncated */
+	char	voice_unknown;	/* True if we don't know if they're voiced */
 }	Nick;
 
+/*
+ * The nicks on a channel are kept in a hash table, keyed by the casemapped
+ * nickname, just like the channels are (see below).  We used to keep them
+ * in a sorted alist, but that meant every nick in a NAMES reply had to
+ * shuffle the rest of the list over to make room for itself, which is
+ * quadratic, and with a 20,000 user channel you could feel it.
+ *
+ * Some things ($chanusers(), /NAMES, etc) want the nicks in order, so
+ * there is a sorted view of the nicks that is built when someone asks for
+ * it, and is thrown away whenever the list changes.  Nobody asks for it 
+ * while the NAMES are coming in, so we only sort once.
+ */
 typedef	struct	nick_list_stru
 {
-	Nick	**list;
-	int	max;
-	int	max_alloc;
-	alist_func func;
-	hash_type hash;
+	Nick **	buckets;	/* The hash table */
+	int	size;		/* Number of buckets (a power of two) */
+	int	max;		/* Number of nicks in the table */
+	int	table;		/* The stricmp table the hashes used */
+	Nick **	sorted;		/* The nicks, sorted (valid if sorted_ok) */
+	int	sorted_alloc;	/* How big "sorted" is */
+	int	sorted_ok;	/* 1 if "sorted" is up to date */
 }	NickList;
 
+/*
+ * A lazy channel (see sync_lazy_channel()) doesn't have Nicks, but it
+ * does keep track of who is on it -- just their nicknames -- so it knows
+ * which QUITs and NICKs it has to care about, and who gets hooks for them.
+ */
+typedef struct	lazy_member_stru
+{
+struct	lazy_member_stru *next;	/* Next member in the same bucket */
+	u_32int_t	hash;		/* Casemapped hash of the nickname */
+	int		joined;		/* The deferred change that added them,
+					   if it was a JOIN, or -1 */
+	char *		nick;
+}	LazyMember;
+
 static	int	current_channel_counter = 0;
 
 /* ChannelList: structure for the list of channels you are current on */
@@ -80,6 +110,8 @@ typedef	struct	channel_stru
 {
 struct	channel_stru *	next;		/* pointer to next channel */
 struct	channel_stru *	prev;		/* pointer to previous channel */
+struct	channel_stru *	hash_next;	/* next channel in the same bucket */
+	u_32int_t	hash;		/* Casemapped hash of channel name */
 	char *		channel;	/* channel name */
 	int		server;		/* The server the channel is "on" */
 	int		winref;		/* The window the channel is "on" */
@@ -96,22 +128,638 @@ struct	channel_stru *	prev;		/* pointer to previous channel */
 	char		chop;		/* true if i'm a channel operator */
 	char		voice;		/* true if i'm a channel voice */
 	char		half_assed;	/* true if i'm a channel helper */
-	char	prefixes[17];	/* contains the modes I have.
-	                         * new-style prefixes, supporting up to
-	                         * sixteen modes, though only WiZ knows
-	                         * why you'd need THAT many unless you are on
-	                         * one of those newfangled Unreals *g*
-	                         * -- Ellenor ellenor@umbrellix.net
-	                         */
 	Timeval		join_time;	/* When we joined the channel */
+	unsigned long	serial;		/* Bigger for newer channels */
+
+	/* Lazy sync (see sync_lazy_channel()) */
+	int		lazy;		/* 1 if "nicks" hasn't been built */
+	char **		deferred;	/* What to build "nicks" from */
+	int		deferred_count;
+	int		deferred_alloc;
+	int		deferred_deltas; /* How many weren't NAMES */
+	LazyMember **	members;	/* Who's on it, until then */
+	int		members_size;	/* Number of buckets (a power of two) */
+	int		members_count;	/* Number of members */
+	int		members_table;	/* The stricmp table the hashes used */
 }	Channel;
 
+/*
+ * The user table is a per-server table of everyone on any channel we're 
+ * on.  Each person has one ChanUser, which holds their nickname, userhost,
+ * services account and away message, and links together the Nick for 
+ * that person on each channel they're on.  So a NICK or a CHGHOST only 
+ * has to change one thing, and a QUIT only has to visit the channels the
+ * person is on, instead of looking for them on every channel.
+ *
+ * A ChanUser lives as long as it is on at least one channel, and is
+ * thrown away when the last Nick pointing at it goes away.
+ *
+ * The Nicks are kept newest-channel-first, which is the same order as
+ * the channel_list, so walk_channels() sees the channels in the same
+ * order it always did.
+ */
+typedef struct	chan_user_stru
+{
+struct	chan_user_stru *next;	/* Next user in the same bucket */
+	u_32int_t	hash;		/* Casemapped hash of the nickname */
+	char *		nick;		/* Their nickname */
+	char *		userhost;	/* Their user@host, if we know it */
+	char *		account;	/* Their services account, if we know it */
+	char *		away;		/* Their away message, if they're away */
+	Nick *		channels;	/* The nick on each channel */
+}	ChanUser;
+
+/*
+ * The userhost cache remembers the user@host of everyone we've seen lately
+ * (anyone who sends us anything, or shows up in a WHO or USERHOST reply),
+ * whether they're on our channels or not.  This lets $userhost() and 
+ * /USERHOST answer for people we've heard from, without asking the server.
+ * It holds the most recently seen USERHOST_CACHE_SIZE people per server,
+ * and when it's full, the person we heard from longest ago is forgotten.
+ *
+ * When someone QUITs, they're forgotten right away, and when they change
+ * their nick, their entry follows them.
+ */
+#define USERHOST_CACHE_SIZE	1024
+#define USERHOST_CACHE_BUCKETS	1024	/* Must be a power of two */
+
+typedef struct	cached_userhost_stru
+{
+struct	cached_userhost_stru *next;	/* Next entry in the same bucket */
+struct	cached_userhost_stru *older;	/* Next least recently seen */
+struct	cached_userhost_stru *newer;	/* Next most recently seen */
+	u_32int_t	hash;		/* Casemapped hash of the nickname */
+	char *		nick;
+	char *		userhost;
+}	CachedUserhost;
+
+static	unsigned long	channel_serial = 0;
+
 
 /* channel_list: list of all the channels you are currently on */
 static	Channel *	channel_list = NULL;
 
 static	void	channel_hold_election (int winref);
+static	Nick *	add_nick_to_list (Channel *ch, Nick *new_n);
+static	Nick *	remove_nick_from_list (Channel *ch, const char *nick);
+static	Nick *	update_nick_status (Channel *chan, const char *arg, char mode, int add);
+static	void	clear_deferred (Channel *ch);
+static	void	clear_lazy_members (Channel *ch);
+static	void	sync_lazy_channel (Channel *ch);
+static	int	is_lazy_member (Channel *ch, const char *nick);
+
+/*
+ * Every server has a hash table of its channels, so find_channel() doesn't
+ * have to walk every channel on every server, which it does a lot.
+ * The channel_list is still the master list of channels -- the hash table 
+ * is just an index into it.
+ *
+ * Channel names are hashed the same way that server_stricmp() compares
+ * them, so the server's CASEMAPPING decides which channels are the same.
+ * If the CASEMAPPING changes (it's usually set from the 005 numeric, which
+ * we might not have seen when we joined the channels), the table notices
+ * and rehashes itself the next time it's used.
+ */
+typedef struct	channel_hash_stru
+{
+	Channel **	buckets;
+	int		size;		/* Number of buckets (a power of two) */
+	int		count;		/* Number of channels in the table */
+	int		table;		/* The stricmp table the hashes used */
+
+	ChanUser **	user_buckets;	/* The user table (see above) */
+	int		user_size;	/* Number of buckets (a power of two) */
+	int		user_count;	/* Number of different users */
+	int		user_table;	/* The stricmp table the hashes used */
+
+	CachedUserhost **uh_buckets;	/* The userhost cache (see above) */
+	CachedUserhost *uh_newest;	/* Most recently seen */
+	CachedUserhost *uh_oldest;	/* Least recently seen */
+	int		uh_count;	/* Number of entries */
+	int		uh_table;	/* The stricmp table the hashes used */
+	unsigned long	uh_hits;	/* Lookups that found something */
+	unsigned long	uh_misses;	/* Lookups that didn't */
+	unsigned long	uh_evictions;	/* Entries forgotten to make room */
+}	ChannelHash;
+
+static	ChannelHash *	channel_hashes = NULL;
+static	int		channel_hashes_max = 0;
+
+static u_32int_t	casemap_hash (const char *name, int table)
+{
+	const unsigned char *s = (const unsigned char *)name;
+	u_32int_t	hash = 2166136261U;
+	int		c;
+
+	/* This has to agree with server_strnicmp() */
+	if (table == 1)
+	{
+		for (; *s; s++)
+			hash = (hash ^ stricmp_tables[1][*s]) * 16777619U;
+	}
+	else
+	{
+		while ((c = next_code_point(&s, 1)))
+			hash = (hash ^ (u_32int_t)mkupper_l(c)) * 16777619U;
+	}
+	return hash;
+}
+
+static ChannelHash *	get_channel_hash (int server)
+{
+	ChannelHash *	h;
+	Channel *	chain, *ch;
+	int		table, i, old_size;
+
+	if (server < 0)
+		return NULL;
+
+	if (server >= channel_hashes_max)
+	{
+		RESIZE(channel_hashes, ChannelHash, server + 1);
+		for (i = channel_hashes_max; i <= server; i++)
+		{
+			channel_hashes[i].buckets = NULL;
+			channel_hashes[i].size = 0;
+			channel_hashes[i].count = 0;
+			channel_hashes[i].table = -1;
+			channel_hashes[i].user_buckets = NULL;
+			channel_hashes[i].user_size = 0;
+			channel_hashes[i].user_count = 0;
+			channel_hashes[i].user_table = -1;
+			channel_hashes[i].uh_buckets = NULL;
+			channel_hashes[i].uh_newest = NULL;
+			channel_hashes[i].uh_oldest = NULL;
+			channel_hashes[i].uh_count = 0;
+			channel_hashes[i].uh_table = -1;
+			channel_hashes[i].uh_hits = 0;
+			channel_hashes[i].uh_misses = 0;
+			channel_hashes[i].uh_evictions = 0;
+		}
+		channel_hashes_max = server + 1;
+	}
+
+	h = &channel_hashes[server];
+	table = get_server_stricmp_table(server);
+	old_size = h->size;
+
+	/* Grow the table when it gets too full */
+	if (h->size == 0)
+	{
+		h->size = 16;
+		h->buckets = (Channel **)new_malloc(sizeof(Channel *) * h->size);
+		for (i = 0; i < h->size; i++)
+			h->buckets[i] = NULL;
+		h->table = table;
+		return h;
+	}
+	else if (h->count > h->size)
+		h->size *= 2;
+	else if (h->table == table)
+		return h;
+
+	/* 
+	 * Rehash everything, either into the new bigger table, or because
+	 * the casemapping has changed.  First, string all the channels 
+	 * together, and then put them back where they belong.
+	 */
+	chain = NULL;
+	for (i = 0; i < old_size; i++)
+	{
+		while ((ch = h->buckets[i]))
+		{
+			h->buckets[i] = ch->hash_next;
+			ch->hash_next = chain;
+			chain = ch;
+		}
+	}
+
+	RESIZE(h->buckets, Channel *, h->size);
+	for (i = 0; i < h->size; i++)
+		h->buckets[i] = NULL;
+	h->table = table;
+
+	while ((ch = chain))
+	{
+		chain = ch->hash_next;
+		ch->hash = casemap_hash(ch->channel, table);
+		ch->hash_next = h->buckets[ch->hash & (h->size - 1)];
+		h->buckets[ch->hash & (h->size - 1)] = ch;
+	}
+
+	return h;
+}
+
+static void	hash_channel (Channel *chan)
+{
+	ChannelHash *	h;
+	int		bucket;
+
+	if (!(h = get_channel_hash(chan->server)))
+		return;
+
+	chan->hash = casemap_hash(chan->channel, h->table);
+	bucket = chan->hash & (h->size - 1);
+	chan->hash_next = h->buckets[bucket];
+	h->buckets[bucket] = chan;
+	h->count++;
+}
+
+static void	unhash_channel (Channel *chan)
+{
+	ChannelHash *	h;
+	Channel **	ptr;
+
+	if (!(h = get_channel_hash(chan->server)))
+		return;
+
+	for (ptr = &h->buckets[chan->hash & (h->size - 1)]; *ptr; 
+			ptr = &(*ptr)->hash_next)
+	{
+		if (*ptr == chan)
+		{
+			*ptr = chan->hash_next;
+			chan->hash_next = NULL;
+			h->count--;
+			return;
+		}
+	}
+}
+
+
+/*
+ * check_user_table - Make sure the server's user table is ready to use
+ * Just like check_nicklist(), this grows the table as it gets full and
+ * rehashes it when the server's CASEMAPPING changes.
+ */
+static ChannelHash *	check_user_table (int server)
+{
+	ChannelHash *	h;
+	ChanUser *	chain, *u;
+	int		table, i, old_size;
+
+	if (!(h = get_channel_hash(server)))
+		return NULL;
+
+	table = h->table;
+	old_size = h->user_size;
+
+	if (h->user_size == 0)
+	{
+		h->user_size = 64;
+		h->user_buckets = (ChanUser **)new_malloc(sizeof(ChanUser *) * h->user_size);
+		for (i = 0; i < h->user_size; i++)
+			h->user_buckets[i] = NULL;
+		h->user_table = table;
+		return h;
+	}
+	else if (h->user_count > h->user_size)
+		h->user_size *= 2;
+	else if (h->user_table == table)
+		return h;
+
+	chain = NULL;
+	for (i = 0; i < old_size; i++)
+	{
+		while ((u = h->user_buckets[i]))
+		{
+			h->user_buckets[i] = u->next;
+			u->next = chain;
+			chain = u;
+		}
+	}
+
+	RESIZE(h->user_buckets, ChanUser *, h->user_size);
+	for (i = 0; i < h->user_size; i++)
+		h->user_buckets[i] = NULL;
+	h->user_table = table;
+
+	while ((u = chain))
+	{
+		chain = u->next;
+		u->hash = casemap_hash(u->nick, table);
+		u->next = h->user_buckets[u->hash & (h->user_size - 1)];
+		h->user_buckets[u->hash & (h->user_size - 1)] = u;
+	}
+
+	return h;
+}
+
+static ChanUser *	find_chan_user (int server, const char *nick)
+{
+	ChannelHash *	h;
+	ChanUser *	u;
+	u_32int_t	hash;
+
+	if (!(h = check_user_table(server)))
+		return NULL;
+
+	hash = casemap_hash(nick, h->user_table);
+	for (u = h->user_buckets[hash & (h->user_size - 1)]; u; u = u->next)
+		if (u->hash == hash && !server_stricmp(u->nick, nick, server))
+			return u;
+
+	return NULL;
+}
+
+/* File a user in the server's user table */
+static void	hash_chan_user (int server, ChanUser *u)
+{
+	ChannelHash *	h;
+	int		bucket;
+
+	if (!(h = check_user_table(server)))
+		return;
+
+	u->hash = casemap_hash(u->nick, h->user_table);
+	bucket = u->hash & (h->user_size - 1);
+	u->next = h->user_buckets[bucket];
+	h->user_buckets[bucket] = u;
+	h->user_count++;
+}
+
+/* Unfile a user from the server's user table (but don't free it) */
+static void	unhash_chan_user (int server, ChanUser *u)
+{
+	ChannelHash *	h;
+	ChanUser **	ptr;
+
+	if (!(h = get_channel_hash(server)) || !h->user_size)
+		panic(1, "unhash_chan_user: %s has no user table", u->nick);
+
+	for (ptr = &h->user_buckets[u->hash & (h->user_size - 1)]; *ptr;
+			ptr = &(*ptr)->next)
+	{
+		if (*ptr == u)
+		{
+			*ptr = u->next;
+			u->next = NULL;
+			h->user_count--;
+			return;
+		}
+	}
+}
+
+/*
+ * get_chan_user - Find the user for 'nick', creating one if we have to.
+ * A new user isn't on any channel, so you must give it a Nick right away
+ * (with add_nick_to_list()) or it will never be cleaned up.
+ */
+static ChanUser *	get_chan_user (int server, const char *nick)
+{
+	ChanUser *	u;
+
+	if ((u = find_chan_user(server, nick)))
+	{
+		/* The server knows better how they spell it */
+		if (strcmp(u->nick, nick))
+			malloc_strcpy(&u->nick, nick);
+		return u;
+	}
+
+	u = (ChanUser *)new_malloc(sizeof(ChanUser));
+	u->nick = malloc_strdup(nick);
+	u->userhost = NULL;
+	u->account = NULL;
+	u->away = NULL;
+	u->channels = NULL;
+	hash_chan_user(server, u);
+	return u;
+}
+
+/* Link a nick on a channel to its user */
+static void	index_nick (Channel *ch, Nick *n)
+{
+	Nick **		ptr;
+
+	n->channel = ch;
+	for (ptr = &n->user->channels; *ptr; ptr = &(*ptr)->next_channel)
+		if ((*ptr)->channel->serial < ch->serial)
+			break;
+	n->next_channel = *ptr;
+	*ptr = n;
+}
+
+/* Unlink a nick on a channel from its user, who may no longer exist after */
+static void	unindex_nick (Nick *n)
+{
+	ChanUser *	u;
+	Nick **		ptr;
+
+	if (!(u = n->user))
+		return;
+
+	for (ptr = &u->channels; *ptr; ptr = &(*ptr)->next_channel)
+	{
+		if (*ptr == n)
+		{
+			*ptr = n->next_channel;
+			break;
+		}
+	}
+	n->next_channel = NULL;
+
+	if (u->channels)
+		return;
+
+	/* That was the last channel they were on, so forget them */
+	unhash_chan_user(n->channel->server, u);
+	new_free(&u->nick);
+	new_free(&u->userhost);
+	new_free(&u->account);
+	new_free(&u->away);
+	new_free((char **)&u);
+}
+
+/*
+ * Userhost cache maintainance
+ */
+static void	unlink_cached_userhost (ChannelHash *h, CachedUserhost *c)
+{
+	CachedUserhost **ptr;
+
+	for (ptr = &h->uh_buckets[c->hash & (USERHOST_CACHE_BUCKETS - 1)];
+			*ptr; ptr = &(*ptr)->next)
+	{
+		if (*ptr == c)
+		{
+			*ptr = c->next;
+			break;
+		}
+	}
+
+	if (c->older)
+		c->older->newer = c->newer;
+	else
+		h->uh_oldest = c->newer;
+	if (c->newer)
+		c->newer->older = c->older;
+	else
+		h->uh_newest = c->older;
+	h->uh_count--;
+}
+
+static void	free_cached_userhost (ChannelHash *h, CachedUserhost *c)
+{
+	unlink_cached_userhost(h, c);
+	new_free(&c->nick);
+	new_free(&c->userhost);
+	new_free((char **)&c);
+}
+
+/* Forget everything in a server's userhost cache */
+static void	flush_userhost_cache (ChannelHash *h)
+{
+	while (h->uh_oldest)
+		free_cached_userhost(h, h->uh_oldest);
+}
+
+/* File an (unlinked) entry as the most recently seen */
+static void	link_cached_userhost (ChannelHash *h, CachedUserhost *c)
+{
+	int	bucket = c->hash & (USERHOST_CACHE_BUCKETS - 1);
+
+	c->next = h->uh_buckets[bucket];
+	h->uh_buckets[bucket] = c;
+	c->older = h->uh_newest;
+	c->newer = NULL;
+	if (h->uh_newest)
+		h->uh_newest->newer = c;
+	else
+		h->uh_oldest = c;
+	h->uh_newest = c;
+	h->uh_count++;
+}
+
+/*
+ * Get the server's userhost cache ready to use.  If the CASEMAPPING has
+ * changed, we just forget everything -- it's only a cache.
+ */
+static ChannelHash *	check_userhost_cache (int server)
+{
+	ChannelHash *	h;
+	int		i;
+
+	if (!(h = get_channel_hash(server)))
+		return NULL;
+
+	if (!h->uh_buckets)
+	{
+		h->uh_buckets = (CachedUserhost **)new_malloc(
+			sizeof(CachedUserhost *) * USERHOST_CACHE_BUCKETS);
+		for (i = 0; i < USERHOST_CACHE_BUCKETS; i++)
+			h->uh_buckets[i] = NULL;
+		h->uh_table = h->table;
+	}
+	else if (h->uh_table != h->table)
+	{
+		flush_userhost_cache(h);
+		h->uh_table = h->table;
+	}
+	return h;
+}
+
+static CachedUserhost *	find_cached_userhost (ChannelHash *h, int server, const char *nick)
+{
+	CachedUserhost *c;
+	u_32int_t	hash;
+
+	hash = casemap_hash(nick, h->uh_table);
+	for (c = h->uh_buckets[hash & (USERHOST_CACHE_BUCKETS - 1)]; c; c = c->next)
+		if (c->hash == hash && !server_stricmp(c->nick, nick, server))
+			return c;
+	return NULL;
+}
+
+/*
+ * cache_userhost - We just found out that 'nick' is 'userhost'.
+ * This is called for everything we hear from anybody, so it has to be cheap
+ * when we already knew.
+ */
+void	cache_userhost (int server, const char *nick, const char *userhost)
+{
+	ChannelHash *	h;
+	CachedUserhost *c;
+
+	if (!nick || !*nick || !userhost || !*userhost)
+		return;
+	if (!(h = check_userhost_cache(server)))
+		return;
+
+	if ((c = find_cached_userhost(h, server, nick)))
+	{
+		if (strcmp(c->userhost, userhost))
+			malloc_strcpy(&c->userhost, userhost);
+		if (strcmp(c->nick, nick))
+			malloc_strcpy(&c->nick, nick);
+		if (h->uh_newest != c)
+		{
+			unlink_cached_userhost(h, c);
+			link_cached_userhost(h, c);
+		}
+		return;
+	}
+
+	if (h->uh_count >= USERHOST_CACHE_SIZE)
+	{
+		free_cached_userhost(h, h->uh_oldest);
+		h->uh_evictions++;
+	}
 
+	c = (CachedUserhost *)new_malloc(sizeof(CachedUserhost));
+	c->nick = malloc_strdup(nick);
+	c->userhost = malloc_strdup(userhost);
+	c->hash = casemap_hash(nick, h->uh_table);
+	link_cached_userhost(h, c);
+}
+
+/* 'nick' has left irc */
+static void	forget_cached_userhost (int server, const char *nick)
+{
+	ChannelHash *	h;
+	CachedUserhost *c;
+
+	if ((h = check_userhost_cache(server)) && 
+	    (c = find_cached_userhost(h, server, nick)))
+		free_cached_userhost(h, c);
+}
+
+/* 'old_nick' is now 'new_nick' */
+static void	rename_cached_userhost (int server, const char *old_nick, const char *new_nick)
+{
+	ChannelHash *	h;
+	CachedUserhost *c, *ghost;
+
+	if (!(h = check_userhost_cache(server)))
+		return;
+	if (!(c = find_cached_userhost(h, server, old_nick)))
+		return;
+
+	unlink_cached_userhost(h, c);
+	if ((ghost = find_cached_userhost(h, server, new_nick)))
+		free_cached_userhost(h, ghost);
+	malloc_strcpy(&c->nick, new_nick);
+	c->hash = casemap_hash(new_nick, h->uh_table);
+	link_cached_userhost(h, c);
+}
+
+/*
+ * userhost_cache_stats - For $serverctl(GET refnum USERHOST_CACHE)
+ * Returns "hits misses evictions entries maxentries", new_malloc()ed.
+ */
+char *	userhost_cache_stats (int server)
+{
+	ChannelHash *	h;
+	char		buffer[128];
+
+	if (!(h = check_userhost_cache(server)))
+		return NULL;
+
+	snprintf(buffer, sizeof buffer, "%lu %lu %lu %d %d",
+		h->uh_hits, h->uh_misses, h->uh_evictions,
+		h->uh_count, USERHOST_CACHE_SIZE);
+	return malloc_strdup(buffer);
+}
 
 /*
  * This isnt strictly neccesary, its more of a cosmetic function.
@@ -148,6 +796,8 @@ static int	traverse_all_channels (Channel **ptr, int server, int only_this_serve
 static Channel *find_channel (const char *channel, int server)
 {
 	Channel *ch = NULL;
+	ChannelHash *h;
+	u_32int_t hash;
 
 	if (server == NOSERV)
 		server = primary_server;
@@ -157,8 +807,12 @@ static Channel *find_channel (const char *channel, int server)
 		if (!(channel = get_echannel_by_refnum(0)))
 			return NULL;		/* sb colten */
 
-	while (traverse_all_channels(&ch, server, 1))
-	    if (!server_stricmp(ch->channel, channel, server))
+	if (!(h = get_channel_hash(server)))
+		return NULL;
+
+	hash = casemap_hash(channel, h->table);
+	for (ch = h->buckets[hash & (h->size - 1)]; ch; ch = ch->hash_next)
+	    if (ch->hash == hash && !server_stricmp(ch->channel, channel, server))
 		return ch;
 
 	return NULL;
@@ -170,17 +824,18 @@ static Channel *create_channel (const char *name, int server)
 	Channel *new_c = (Channel *)new_malloc(sizeof(Channel));
 
 	new_c->prev = new_c->next = NULL;
+	new_c->hash_next = NULL;
 	new_c->channel = malloc_strdup(name);
 	new_c->server = server;
+	new_c->serial = ++channel_serial;
 	new_c->waiting = 0;
 	new_c->winref = -1;
-	new_c->nicks.max_alloc = new_c->nicks.max = 0;
-	new_c->nicks.list = NULL;
-	if (get_server_stricmp_table(server) == 0)
-		new_c->nicks.func = (alist_func) ascii_strnicmp;
-	else
-		new_c->nicks.func = (alist_func) rfc1459_strnicmp;
-	new_c->nicks.hash = HASH_INSENSITIVE;
+	new_c->nicks.buckets = NULL;
+	new_c->nicks.size = new_c->nicks.max = 0;
+	new_c->nicks.table = -1;
+	new_c->nicks.sorted = NULL;
+	new_c->nicks.sorted_alloc = 0;
+	new_c->nicks.sorted_ok = 0;
 
 	new_c->base_modes[0] = 0;
 	new_c->modestr = NULL;
@@ -189,11 +844,19 @@ static Channel *create_channel (const char *name, int server)
 	new_c->chop = 0;
 	new_c->voice = 0;
 	new_c->half_assed = 0;
+	new_c->lazy = 0;
+	new_c->deferred = NULL;
+	new_c->deferred_count = new_c->deferred_alloc = 0;
+	new_c->deferred_deltas = 0;
+	new_c->members = NULL;
+	new_c->members_size = new_c->members_count = 0;
+	new_c->members_table = -1;
 
 	new_c->next = channel_list;
 	if (channel_list)
 		channel_list->prev = new_c;
 	channel_list = new_c;
+	hash_channel(new_c);
 	return new_c;
 }
 
@@ -201,16 +864,22 @@ static Channel *create_channel (const char *name, int server)
 static void 	clear_channel (Channel *chan)
 {
 	NickList *list = &chan->nicks;
+	Nick	*n;
 	int	i;
 
-	for (i = 0; i < list->max; i++)
+	for (i = 0; i < list->size; i++)
 	{
-		new_free(&list->list[i]->nick);
-		new_free(&list->list[i]->userhost);
-		new_free(&list->list[i]);
+		while ((n = list->buckets[i]))
+		{
+			list->buckets[i] = n->next;
+			unindex_nick(n);
+			new_free(&n);
+		}
 	}
-	new_free((void **)&list->list);
-	list->max = list->max_alloc = 0;
+	new_free((void **)&list->buckets);
+	new_free((void **)&list->sorted);
+	list->size = list->max = list->sorted_alloc = list->sorted_ok = 0;
+	list->table = -1;
 }
 
 /* Channel destructor -- caller must free "chan". */
@@ -236,6 +905,7 @@ static void 	destroy_channel (Channel *chan)
 
 	if (chan->next)
 		chan->next->prev = chan->prev;
+	unhash_channel(chan);
 
 	/*
 	 * If we are a current window, then we will no longer be so;
@@ -252,13 +922,16 @@ static void 	destroy_channel (Channel *chan)
 			chan->winref, chan->channel, new_current_channel);
 	}
 
+	/* This has to be done before we forget what server it's on */
+	if (chan->nicks.size)
+		clear_channel(chan);
+	clear_deferred(chan);
+	clear_lazy_members(chan);
+
 	new_free(&chan->channel);
 	chan->server = NOSERV;
 	chan->winref = -1;
 
-	if (chan->nicks.max_alloc)
-		clear_channel(chan);
-
 	new_free(&chan->modestr);
 	chan->limit = 0;
 	new_free(&chan->key); 
@@ -266,6 +939,376 @@ static void 	destroy_channel (Channel *chan)
 	chan->voice = 0;
 }
 
+/*
+ * Lazy sync
+ *
+ * When you join a channel, the server sends you everyone on it (NAMES),
+ * and we build a Nick for each of them.  On a 50,000 person channel 
+ * where you just want to talk, that's a lot of work and memory for 
+ * nothing.  So channels that match /SET LAZY_SYNC_CHANNELS are "lazy":
+ * we just hang onto the NAMES replies, and every JOIN, PART, KICK, QUIT,
+ * NICK, and +o/+v (etc) that happens after that, as a list of strings.
+ * The first time anybody asks who is on the channel ($chanusers(), 
+ * $ischanop(), /NAMES, etc), sync_lazy_channel() replays the list to
+ * build the nicks, and from then on it's a normal channel.
+ *
+ * Each deferred change is one string.  The first character says what:
+ *	+nick nick ...	These nicks (with their prefixes) joined
+ *	-nick		This nick left
+ *	>old new	This nick changed their nickname
+ *	*+o nick	This nick got (or lost, for "*-o") a mode
+ *
+ * We also keep the nicknames of everyone on the channel (the "members"),
+ * so we only hang onto changes for people who are actually there, and 
+ * so QUITs and NICKs can be shown in the channel's window and throw the
+ * channel hooks without building anything.  Someone who JOINs and then
+ * leaves before we build the nicks just has their JOIN thrown away.
+ * If the list gets too long anyways, we give up and build the nicks.
+ */
+#define LAZY_SYNC_MAX_CHANGES	4096
+static int	wants_lazy_sync (const char *name)
+{
+	const char *	patterns;
+	char *		copy;
+	char *		pattern;
+
+	if (!(patterns = get_string_var(LAZY_SYNC_CHANNELS_VAR)))
+		return 0;
+
+	copy = LOCAL_COPY(patterns);
+	while ((pattern = next_arg(copy, &copy)))
+		if (wild_match(pattern, name))
+			return 1;
+	return 0;
+}
+
+static void	defer_change (Channel *ch, int op, const char *arg, const char *arg2)
+{
+	if (ch->deferred_count >= ch->deferred_alloc)
+	{
+		ch->deferred_alloc = ch->deferred_alloc ? ch->deferred_alloc * 2 : 16;
+		RESIZE(ch->deferred, char *, ch->deferred_alloc);
+	}
+
+	ch->deferred[ch->deferred_count] = NULL;
+	malloc_sprintf(&ch->deferred[ch->deferred_count], "%c%s%s%s", 
+			op, arg, arg2 ? space : empty_string, 
+			arg2 ? arg2 : empty_string);
+	ch->deferred_count++;
+}
+
+/* Like defer_change(), for everything other than a NAMES reply */
+static void	defer_delta (Channel *ch, int op, const char *arg, const char *arg2)
+{
+	defer_change(ch, op, arg, arg2);
+	if (++ch->deferred_deltas > LAZY_SYNC_MAX_CHANGES)
+		sync_lazy_channel(ch);
+}
+
+static void	clear_deferred (Channel *ch)
+{
+	int	i;
+
+	for (i = 0; i < ch->deferred_count; i++)
+		new_free(&ch->deferred[i]);
+	new_free((char **)&ch->deferred);
+	ch->deferred_count = ch->deferred_alloc = 0;
+	ch->deferred_deltas = 0;
+}
+
+/*
+ * check_lazy_members - Make sure a lazy channel's member table is ready
+ * to use.  This works just like check_nicklist().
+ */
+static void	check_lazy_members (Channel *ch)
+{
+	LazyMember	*chain, *m;
+	int		table, i, old_size;
+
+	table = get_server_stricmp_table(ch->server);
+	old_size = ch->members_size;
+
+	if (ch->members_size == 0)
+	{
+		ch->members_size = 64;
+		ch->members = (LazyMember **)new_malloc(sizeof(LazyMember *) * ch->members_size);
+		for (i = 0; i < ch->members_size; i++)
+			ch->members[i] = NULL;
+		ch->members_table = table;
+		return;
+	}
+	else if (ch->members_count > ch->members_size)
+	{
+		while (ch->members_count > ch->members_size)
+			ch->members_size *= 2;
+	}
+	else if (ch->members_table == table)
+		return;
+
+	chain = NULL;
+	for (i = 0; i < old_size; i++)
+	{
+		while ((m = ch->members[i]))
+		{
+			ch->members[i] = m->next;
+			m->next = chain;
+			chain = m;
+		}
+	}
+
+	RESIZE(ch->members, LazyMember *, ch->members_size);
+	for (i = 0; i < ch->members_size; i++)
+		ch->members[i] = NULL;
+	ch->members_table = table;
+
+	while ((m = chain))
+	{
+		chain = m->next;
+		m->hash = casemap_hash(m->nick, table);
+		m->next = ch->members[m->hash & (ch->members_size - 1)];
+		ch->members[m->hash & (ch->members_size - 1)] = m;
+	}
+}
+
+/* Returns where 'nick' is linked in, so you can unlink them */
+static LazyMember **	find_lazy_member (Channel *ch, const char *nick)
+{
+	LazyMember **	ptr;
+	u_32int_t	hash;
+
+	if (ch->members_count == 0)
+		return NULL;
+
+	check_lazy_members(ch);
+	hash = casemap_hash(nick, ch->members_table);
+	for (ptr = &ch->members[hash & (ch->members_size - 1)]; *ptr; 
+			ptr = &(*ptr)->next)
+		if ((*ptr)->hash == hash && 
+				!server_stricmp((*ptr)->nick, nick, ch->server))
+			return ptr;
+
+	return NULL;
+}
+
+static int	is_lazy_member (Channel *ch, const char *nick)
+{
+	return (ch->lazy && find_lazy_member(ch, nick)) ? 1 : 0;
+}
+
+/*
+ * add_lazy_member - 'nick' is on the channel.  'joined' is the deferred
+ * change that has their JOIN (or -1 if they came from NAMES).
+ */
+static void	add_lazy_member (Channel *ch, const char *nick, int joined)
+{
+	LazyMember **	ptr;
+	LazyMember *	m;
+
+	/* 
+	 * If we already have them, the server has told us twice, and we 
+	 * can't throw away one JOIN without leaving the other behind.
+	 */
+	if ((ptr = find_lazy_member(ch, nick)))
+	{
+		(*ptr)->joined = -1;
+		return;
+	}
+
+	ch->members_count++;
+	check_lazy_members(ch);
+
+	m = (LazyMember *)new_malloc(sizeof(LazyMember));
+	m->nick = malloc_strdup(nick);
+	m->joined = joined;
+	m->hash = casemap_hash(nick, ch->members_table);
+	m->next = ch->members[m->hash & (ch->members_size - 1)];
+	ch->members[m->hash & (ch->members_size - 1)] = m;
+}
+
+/*
+ * remove_lazy_member - 'nick' left the channel.  Returns 0 if they 
+ * weren't on it.  Otherwise, it returns 1, and if 'joined' isn't NULL,
+ * that's set to the deferred change with their JOIN (or -1).
+ */
+static int	remove_lazy_member (Channel *ch, const char *nick, int *joined)
+{
+	LazyMember **	ptr;
+	LazyMember *	m;
+
+	if (!(ptr = find_lazy_member(ch, nick)))
+		return 0;
+
+	m = *ptr;
+	*ptr = m->next;
+	ch->members_count--;
+	if (joined)
+		*joined = m->joined;
+	new_free(&m->nick);
+	new_free((char **)&m);
+	return 1;
+}
+
+static void	clear_lazy_members (Channel *ch)
+{
+	LazyMember *	m;
+	int		i;
+
+	for (i = 0; i < ch->members_size; i++)
+	{
+		while ((m = ch->members[i]))
+		{
+			ch->members[i] = m->next;
+			new_free(&m->nick);
+			new_free((char **)&m);
+		}
+	}
+	new_free((char **)&ch->members);
+	ch->members_size = ch->members_count = 0;
+	ch->members_table = -1;
+}
+
+/* Someone left a lazy channel (PART, KICK, QUIT) */
+static void	lazy_part (Channel *ch, const char *nick)
+{
+	int	joined;
+
+	if (!remove_lazy_member(ch, nick, &joined))
+		return;
+
+	/* If we still have their JOIN, it's like they were never here */
+	if (joined >= 0)
+	{
+		new_free(&ch->deferred[joined]);
+		if (joined == ch->deferred_count - 1)
+		{
+			ch->deferred_count--;
+			ch->deferred_deltas--;
+		}
+	}
+	else
+		defer_delta(ch, '-', nick, NULL);
+}
+
+/* Someone on a lazy channel changed their nickname */
+static void	lazy_rename (Channel *ch, const char *old_nick, const char *new_nick)
+{
+	int	joined;
+
+	if (!remove_lazy_member(ch, old_nick, &joined))
+		return;
+
+	add_lazy_member(ch, new_nick, joined);
+	defer_delta(ch, '>', old_nick, new_nick);
+}
+
+/*
+ * sync_lazy_channel - Build the nicks for a lazy channel, because someone
+ * wants to know.  It's not lazy after this.
+ */
+static void	sync_lazy_channel (Channel *ch)
+{
+	Nick *	n;
+	Nick *	old;
+	char *	change;
+	char *	word;
+	int	i;
+
+	if (!ch->lazy)
+		return;
+
+	if (x_debug & DEBUG_CHANNELS)
+		yell("Syncing lazy channel [%s] on server [%d] from [%d] "
+			"changes", ch->channel, ch->server, ch->deferred_count);
+
+	ch->lazy = 0;		/* So add_to_channel() does it for real */
+	for (i = 0; i < ch->deferred_count; i++)
+	{
+	    /* Someone who came and went (see lazy_part()) */
+	    if (!(change = ch->deferred[i]))
+		continue;
+
+	    switch (*change++)
+	    {
+		case '+':
+			while ((word = next_arg(change, &change)))
+				add_to_channel(ch->channel, word, ch->server, 
+						0, 0, 0, 0);
+			break;
+		case '-':
+			if ((n = remove_nick_from_list(ch, change)))
+				new_free((char **)&n);
+			break;
+		case '>':
+			word = next_arg(change, &change);
+			if ((n = remove_nick_from_list(ch, word)))
+			{
+				n->user = get_chan_user(ch->server, change);
+				if ((old = add_nick_to_list(ch, n)))
+					new_free((char **)&old);
+			}
+			break;
+		case '*':
+			word = next_arg(change, &change);
+			update_nick_status(ch, change, word[1], *word == '+');
+			break;
+	    }
+	}
+	clear_deferred(ch);
+	clear_lazy_members(ch);
+}
+
+/*
+ * is_channel_lazy - Returns 1 if we haven't built the nicks for a channel
+ * yet.  You can use this to avoid asking questions that would make us.
+ */
+int	is_channel_lazy (const char *channel, int server)
+{
+	Channel *ch;
+
+	if ((ch = find_channel(channel, server)))
+		return ch->lazy;
+	return 0;
+}
+
+/*
+ * defer_names - Hang onto a NAMES reply for a lazy channel.
+ * Returns 1 if the channel is lazy (and we took it), 0 if you need to 
+ * add the nicks yourself.
+ */
+int	defer_names (const char *channel, const char *names, int server)
+{
+	Channel *ch;
+	Server *srv;
+	char *	copy;
+	char *	nick;
+
+	if (!(ch = find_channel(channel, server)) || !ch->lazy)
+		return 0;
+	if (!(srv = get_server(server)))
+		return 0;
+
+	/* But we always want to know about ourselves (and who's there) */
+	copy = LOCAL_COPY(names);
+	while ((nick = next_arg(copy, &copy)))
+	{
+		const char *p;
+		u_32int_t status = 0;
+
+		for (p = nick; srv->prefix_rank[(unsigned char)*p]; p++)
+			status |= 1U << (srv->prefix_rank[(unsigned char)*p] - 1);
+		if (is_me(server, p))
+		{
+			if (status & srv->op_status) ch->chop = 1;
+			if (status & srv->halfop_status) ch->half_assed = 1;
+			if (status & srv->voice_status) ch->voice = 1;
+		}
+		add_lazy_member(ch, p, -1);
+	}
+
+	defer_change(ch, '+', names, NULL);
+	return 1;
+}
+
 /*
  * add_channel: adds the named channel to the channel list.
  * The added channel becomes the current channel as well.
@@ -281,11 +1324,21 @@ void 	add_channel (const char *name, int server)
 		destroy_channel(new_c);
 		malloc_strcpy(&(new_c->channel), name);
 		new_c->server = server;
+		new_c->serial = ++channel_serial;
+
+		/* destroy_channel() unlinked it, so put it back */
+		new_c->prev = NULL;
+		new_c->next = channel_list;
+		if (channel_list)
+			channel_list->prev = new_c;
+		channel_list = new_c;
+		hash_channel(new_c);
 	}
 	else
 		new_c = create_channel(name, server);
 
 	new_c->waiting = 1;		/* This channel is "syncing" */
+	new_c->lazy = wants_lazy_sync(name);
 	get_time(&new_c->join_time);
 
 	if (was_window == -1)
@@ -345,23 +1398,210 @@ void 	remove_channel (const char *channel, int server)
  * Nickname maintainance
  *
  */
+/*
+ * check_nicklist - Make sure the nicklist's hash table is ready to use
+ * This grows the table when it gets full, and rehashes it if the server's
+ * CASEMAPPING has changed since we hashed the nicks.
+ */
+static void	check_nicklist (Channel *ch)
+{
+	NickList *list = &ch->nicks;
+	Nick	*chain, *n;
+	int	table, i, old_size;
+
+	table = get_server_stricmp_table(ch->server);
+	old_size = list->size;
+
+	if (list->size == 0)
+	{
+		list->size = 16;
+		list->buckets = (Nick **)new_malloc(sizeof(Nick *) * list->size);
+		for (i = 0; i < list->size; i++)
+			list->buckets[i] = NULL;
+		list->table = table;
+		return;
+	}
+	else if (list->max > list->size)
+	{
+		while (list->max > list->size)
+			list->size *= 2;
+	}
+	else if (list->table == table)
+		return;
+
+	chain = NULL;
+	for (i = 0; i < old_size; i++)
+	{
+		while ((n = list->buckets[i]))
+		{
+			list->buckets[i] = n->next;
+			n->next = chain;
+			chain = n;
+		}
+	}
+
+	RESIZE(list->buckets, Nick *, list->size);
+	for (i = 0; i < list->size; i++)
+		list->buckets[i] = NULL;
+	list->table = table;
+
+	while ((n = chain))
+	{
+		chain = n->next;
+		n->hash = casemap_hash(n->user->nick, table);
+		n->next = list->buckets[n->hash & (list->size - 1)];
+		list->buckets[n->hash & (list->size - 1)] = n;
+	}
+}
+
 static Nick *	find_nick_on_channel (Channel *ch, const char *nick)
 {
-	int cnt, loc;
-	Nick *new_n = (Nick *)find_array_item((array *)&ch->nicks,
-						nick, &cnt, &loc);
+	NickList *list = &ch->nicks;
+	Nick	*n;
+	u_32int_t hash;
+
+	if (list->max == 0)
+		return NULL;
+
+	check_nicklist(ch);
+	hash = casemap_hash(nick, list->table);
+	for (n = list->buckets[hash & (list->size - 1)]; n; n = n->next)
+		if (n->hash == hash && !server_stricmp(n->user->nick, nick, ch->server))
+			return n;
+
+	return NULL;
+}
+
+/* Put a nick in a channel's hash table */
+static void	link_nick (Channel *ch, Nick *n)
+{
+	NickList *list = &ch->nicks;
+
+	check_nicklist(ch);
+	n->hash = casemap_hash(n->user->nick, list->table);
+	n->next = list->buckets[n->hash & (list->size - 1)];
+	list->buckets[n->hash & (list->size - 1)] = n;
+	list->max++;
+	list->sorted_ok = 0;
+}
+
+/* Take a nick out of a channel's hash table */
+static void	unlink_nick (Channel *ch, Nick *n)
+{
+	NickList *list = &ch->nicks;
+	Nick	**ptr;
+
+	for (ptr = &list->buckets[n->hash & (list->size - 1)]; *ptr; 
+			ptr = &(*ptr)->next)
+	{
+		if (*ptr == n)
+		{
+			*ptr = n->next;
+			n->next = NULL;
+			list->max--;
+			list->sorted_ok = 0;
+			return;
+		}
+	}
+}
+
+/*
+ * add_nick_to_list - File a nick on a channel
+ * The nick's user must already be set (see get_chan_user()).
+ * If there is already a nick by that name, it is removed from the list 
+ * and returned so you can get rid of it.
+ */
+static Nick *	add_nick_to_list (Channel *ch, Nick *new_n)
+{
+	Nick	*old;
 
-	if (cnt >= 0 || !new_n)
+	/* 
+	 * File the new one before we get rid of the old one, so if they
+	 * are the same person, the user doesn't go away in between.
+	 */
+	old = find_nick_on_channel(ch, new_n->user->nick);
+	link_nick(ch, new_n);
+	index_nick(ch, new_n);
+	if (old)
+	{
+		unlink_nick(ch, old);
+		unindex_nick(old);
+	}
+	return old;
+}
+
+/*
+ * remove_nick_from_list - Unfile a nick from a channel.
+ * The nick is returned so you can get rid of it (or re-file it).
+ * If this was the last channel they were on, their user is gone now.
+ */
+static Nick *	remove_nick_from_list (Channel *ch, const char *nick)
+{
+	Nick	*n;
+
+	if (!(n = find_nick_on_channel(ch, nick)))
 		return NULL;
 
-	return new_n;
+	unlink_nick(ch, n);
+	unindex_nick(n);
+	n->user = NULL;
+	return n;
+}
+
+static	int	sorted_nicks_table;
+
+static int	compare_nicks (const void *a, const void *b)
+{
+	const Nick *na = *(const Nick * const *)a;
+	const Nick *nb = *(const Nick * const *)b;
+
+	if (sorted_nicks_table == 1)
+		return rfc1459_stricmp(na->user->nick, nb->user->nick);
+	else
+		return ascii_stricmp(na->user->nick, nb->user->nick);
+}
+
+/*
+ * sorted_nicks - Return the nicks on a channel in alphabetical order
+ * The return value is an array of ch->nicks.max nicks.  It belongs to 
+ * the channel, and is only good until the next time the nicklist changes.
+ */
+static Nick **	sorted_nicks (Channel *ch)
+{
+	NickList *list = &ch->nicks;
+	Nick	*n;
+	int	i, j;
+
+	sync_lazy_channel(ch);
+	if (list->sorted_ok)
+		return list->sorted;
+
+	if (list->sorted_alloc < list->max)
+	{
+		list->sorted_alloc = list->max;
+		RESIZE(list->sorted, Nick *, list->sorted_alloc);
+	}
+
+	for (i = 0, j = 0; i < list->size; i++)
+		for (n = list->buckets[i]; n; n = n->next)
+			list->sorted[j++] = n;
+
+	sorted_nicks_table = list->table;
+	if (list->max > 1)
+		qsort(list->sorted, list->max, sizeof(Nick *), compare_nicks);
+
+	list->sorted_ok = 1;
+	return list->sorted;
 }
 
 static Nick *	find_nick (int server, const char *channel, const char *nick)
 {
 	Channel *ch;
 	if ((ch = find_channel(channel, server)))
+	{
+		sync_lazy_channel(ch);
 		return find_nick_on_channel(ch, nick);
+	}
 
 	return NULL;
 }
@@ -375,22 +1615,24 @@ static Nick *	find_nick (int server, const char *channel, const char *nick)
  */
 static Nick *	find_suspicious_on_channel (Channel *ch, const char *nick)
 {
+	Nick **	list;
 	int	pos;
 
 	/*
 	 * Efficiency here isn't terribly important, but correctness IS.
 	 */
+	list = sorted_nicks(ch);
 	for (pos = 0; pos < ch->nicks.max; pos++)
 	{
-		Nick *	n = ch->nicks.list[pos];
-		char *	s = n->nick;
+		Nick *	n = list[pos];
+		char *	s = n->user->nick;
 		size_t	siz = strlen(s);
 
 		/* 
 		 * Is the nick in the list (s) a subset of 'nick'? 
 		 * If not, keep going.
 		 */
-		if (ch->nicks.func(s, nick, siz))
+		if (server_strnicmp(s, nick, siz, ch->server))
 			continue;
 
 		/*
@@ -408,72 +1650,113 @@ static Nick *	find_suspicious_on_channel (Channel *ch, const char *nick)
 }
 
 /*
- * !!! - This function should be called only once per reconnection attempt,
- * but is currently called every time a channel nicklist has to be rehashed.
- * This is inefficient, and produces half a kilobyte of crud.
+ * rebuild_prefix_list - Figure out a server's channel prefixes
+ *
+ * This is called whenever the server's 005 PREFIX changes (and when we
+ * connect, so there's always something reasonable there).  It sets up 
+ * the tables that map prefixes (like "@") and modes (like "o") to a rank,
+ * so nobody else has to look at the PREFIX string ever again.
+ *
+ * A nick's (or your own) channel status is a bitmask of ranks; rank 1
+ * (the highest) is bit 0.  Anything ranked at or above +o counts as a 
+ * chanop, anything between +o and +v counts as a halfop.
  */
-
 void	rebuild_prefix_list (int server)
 {
-	const char *prefix = get_server_005(server, "PREFIX");
-	const char *namesprefixes = strchr(prefix, ')');
-	int pfxlen = (strlen(namesprefixes) - 1);
-	int i, kibosh = 0, reachedop = 0, reachedhalf = 0;
-	Server *srv = get_server(server);
-	memset(&(srv->prefixmodes), 0, sizeof(srv->prefixmodes));
-	if (!prefix || !*prefix || namesprefixes == NULL) {
-		/*
-		 * Sigh, can't always get valid data out of a server
-		 */
-		srv->prefixmodes['@'] = 'o';
-		srv->prefixmodes['%'] = 'h';
-		srv->prefixmodes['+'] = 'v';
-		srv->prefixmodes['o'] = '@';
-		srv->prefixmodes['h'] = '%';
-		srv->prefixmodes['v'] = '+';
+	Server *srv;
+	const char *prefix, *namesprefixes;
+	int	i, kibosh, rank, reachedop = 0, reachedhalf = 0;
+	unsigned char	m, p;
+
+	if (!(srv = get_server(server)))
 		return;
+
+	memset(srv->prefix_rank, 0, sizeof(srv->prefix_rank));
+	memset(srv->mode_rank, 0, sizeof(srv->mode_rank));
+	srv->prefix_count = 0;
+	srv->op_status = srv->halfop_status = srv->voice_status = 0;
+
+	/*
+	 * Sigh, can't always get valid data out of a server
+	 */
+	prefix = get_server_005(server, "PREFIX");
+	if (!prefix || *prefix != '(' || !(namesprefixes = strchr(prefix, ')')))
+	{
+		prefix = "(ohv)@%+";
+		namesprefixes = prefix + 4;
 	}
-	// + 1 means skip 1. since 0 + 1 = 1, this could be
-	// optimised, but isn't because it's pretty good already
-	// and is autodidactic as to what it's doing
+
 	//        PREFIX= (ohv)@%+
 	//        prefix  01234567
 	// namesprefixes  ****0123
 	// if a server has silly chars in the namesprefixes, like
 	// letters that should be modes... we'll pretend it's valid
-	// for i = 1, and strlen of namesprefixes is 3
-	// namesprefixes are the prefixes
-	for (i = 0 + 1; i < pfxlen + 1; i++) {
-		if (prefix[i] == namesprefixes[i]
+	for (i = 1; prefix[i] && prefix[i] != ')' && namesprefixes[i]; i++)
+	{
+		m = (unsigned char)prefix[i];
+		p = (unsigned char)namesprefixes[i];
+
 		// if it fails basic sanity checks
-		    || (!(prefix[i]) || !(namesprefixes[i]))
-		// or, if the prefix in NAMES is a capital
-		    || ( ((namesprefixes[i] > 64) && (namesprefixes[i] < 91))
-		//    or the prefix is a lower
-		    || ((namesprefixes[i] > 96) && (namesprefixes[i] < 123)) )
-		// and the mode for the prefix is none of:
-		    && !(
-		//  - an upper (rare but happens, irc.umbrellix.net has +W)
-		        ((prefix[i] > 64) && (prefix[i] < 91))
-		//  - or a lower
-		        || ((prefix[i] > 96) && (prefix[i] < 123))
-		//  - or a numeral
-		        || ((prefix[i] > 47) && (prefix[i] < 58))
-		       )
-		    ) kibosh = 1; // Kibosh the whole thing.
-		else kibosh = 0;
-		//say("Channel prefix mode %c has prefix %c. %s the mode %s.", prefix[i], namesprefixes[i], kibosh ? "Kiboshing" : "Adding", kibosh ? "due to probable invalidity" : "to the prefix list");
-		if (kibosh) continue;
-		srv->prefixmodes[namesprefixes[i]] = prefix[i];
-		srv->prefixes[namesprefixes[i]] = prefix[i]; // needed because of things
-		srv->prefixmodes[prefix[i]] = namesprefixes[i];
-		if (prefix[i] == 'v') reachedhalf = 1;
-		//say("Channel prefix mode %c is %san op mode, and %sa halfassed op mode.", prefix[i], reachedop ? "not " : "", reachedhalf ? "not " : "");
-		srv->isopprefix[namesprefixes[i]] = (!reachedop) ? 2 : (!reachedhalf) ? 1 : 0;
-		srv->isopprefix[prefix[i]] = (!reachedop) ? 2 : (!reachedhalf) ? 1 : 0;
-		if (prefix[i] == 'o') reachedop = 1;
-		if (prefix[i] == 'h') reachedhalf = 1;
+		if (m == p)
+			kibosh = 1;
+		// or, if the prefix in NAMES is a letter,
+		// and the mode for the prefix is not a letter or numeral
+		else if (isalpha(p) && !isalnum(m))
+			kibosh = 1;
+		else
+			kibosh = 0;
+
+		if (kibosh)
+			continue;
+		if (srv->prefix_count >= 32)
+			break;		/* Nobody needs that many */
+
+		rank = ++srv->prefix_count;
+		srv->prefix_chars[rank - 1] = p;
+		srv->prefix_rank[p] = rank;
+		srv->mode_rank[m] = rank;
+
+		if (m == 'v')
+			reachedhalf = 1;
+		if (!reachedop)
+			srv->op_status |= 1U << (rank - 1);
+		else if (!reachedhalf)
+			srv->halfop_status |= 1U << (rank - 1);
+		if (m == 'v' || p == '+')
+			srv->voice_status |= 1U << (rank - 1);
+		if (m == 'o')
+			reachedop = 1;
+		if (m == 'h')
+			reachedhalf = 1;
+	}
+	srv->prefix_chars[srv->prefix_count] = 0;
+}
+
+/*
+ * status_to_prefixes - Spell out a channel status mask the way NAMES does
+ * ("@+"), highest rank first.  Nobody keeps these strings around; they're
+ * made up from the mask whenever someone wants to look at one.
+ * 'buf' should have room for 33 chars.
+ */
+const char *	status_to_prefixes (int server, u_32int_t status, char *buf, size_t bufsize)
+{
+	Server *srv;
+	size_t	n = 0;
+	int	rank;
+
+	if ((srv = get_server(server)))
+	{
+		for (rank = 1; rank <= srv->prefix_count; rank++)
+		{
+			if (!(status & (1U << (rank - 1))))
+				continue;
+			if (n + 1 >= bufsize)
+				break;
+			buf[n++] = srv->prefix_chars[rank - 1];
+		}
 	}
+	buf[n] = 0;
+	return buf;
 }
 
 /*
@@ -484,24 +1767,16 @@ void	rebuild_prefix_list (int server)
  */
 void 	add_to_channel (const char *channel, const char *nick, int server, int suspicious, int oper, int voice, int ha)
 {
+	const char *orig_nick = nick;
 	Nick 	*new_n, *old;
 	Channel *chan;
-	int	ischop = oper;
-	int	isvoice = voice;
-	int	half_assed = ha;
-	int	isus = 0, j = 0, i = 0;
-const	char	*prefix;
-	Server *srv = get_server(server);
+	Server *srv;
+	u_32int_t status = 0;
 
 	if (!(chan = find_channel(channel, server)))
 		return;
-
-	prefix = get_server_005(from_server, "PREFIX");
-	rebuild_prefix_list(server);
-	if (prefix && *prefix == '(' && (prefix = strchr(prefix, ')')))
-		prefix++;
-	if (!prefix || !*prefix)
-		prefix = "@%+";
+	if (!(srv = get_server(server)))
+		return;
 
 	/* 
 	 * This is defensive just in case someone in the future
@@ -511,57 +1786,34 @@ const	char	*prefix;
 	 * thing. Welcome to 2017, ircv3 exists. And prefix= is also true.
 	 */
 
-	new_n = (Nick *)new_malloc(sizeof(Nick));
-
 	// You aren't until you are
-	half_assed = isvoice = ischop = 0;
-	for (/* noop */; srv->prefixes[*nick] != 0; nick++)
-	{
-		//say("prefix mode %c processing for %s", *nick, nick);
-		if (i == 15) {
-			// brakes!
-			new_n->prefixes[i++] = *nick;
-			new_n->prefixes[16] = '\0';
-		} else new_n->prefixes[i++] = *nick;
-		switch (srv->isopprefix[*nick]) {
-			case 2:
-				ischop = 1;
-				break;
-			case 1:
-				half_assed = 1;
-				break;
-			case 0:
-				// Well it is a prefix character, so if it's +, they're voice.
-				if (*nick == '+') isvoice = 1;
-				break;
-		}
-	}
-	new_n->prefixes[i] = '\0'; // cap the prefixes quite nicely with a null
+	for (/* noop */; srv->prefix_rank[(unsigned char)*nick]; nick++)
+		status |= 1U << (srv->prefix_rank[(unsigned char)*nick] - 1);
+
 	// Is it us?!
-	if (is_me(server, nick))	{
-		// YES!
-		// Now let's see what we are after all that!
-		if (ischop) chan->chop = 1;
-		if (half_assed) chan->half_assed = 1;
-		if (isvoice) chan->voice = 1;
-		if (i != 0) {
-			for (j = 0; j < i; j++) chan->prefixes[j] = new_n->prefixes[j];
-		}
+	if (is_me(server, nick))
+	{
+		if (status & srv->op_status) chan->chop = 1;
+		if (status & srv->halfop_status) chan->half_assed = 1;
+		if (status & srv->voice_status) chan->voice = 1;
 	}
 
-	new_n->nick = malloc_strdup(nick);
+	if (chan->lazy)
+	{
+		/* This has to go first, in case defer_delta() syncs */
+		add_lazy_member(chan, nick, chan->deferred_count);
+		defer_delta(chan, '+', orig_nick, NULL);
+		return;
+	}
 
-	new_n->userhost = NULL;
+	new_n = (Nick *)new_malloc(sizeof(Nick));
+	new_n->user = get_chan_user(server, nick);
 	new_n->suspicious = suspicious;
-	new_n->chanop = ischop;
-	new_n->voice = isvoice;
-	new_n->half_assed = half_assed;
+	new_n->status = status;
+	new_n->voice_unknown = (voice == -1) ? 1 : 0;
 
-	if ((old = (Nick *)add_to_array((array *)&chan->nicks, (array_item *)new_n)))
-	{
-		new_free(&old->nick);
-		new_free(&old->userhost);
-	}
+	if ((old = add_nick_to_list(chan, new_n)))
+		new_free(&old);
 }
 
 void 	add_userhost_to_channel (const char *channel, const char *nick, int server, const char *uh)
@@ -580,6 +1832,12 @@ void 	add_userhost_to_channel (const char *channel, const char *nick, int server
 	if (!(chan = find_channel(channel, server)))
 		return;		/* Oh well.  Time to punt. */
 
+	if (chan->lazy)
+	{
+		cache_userhost(server, nick, uh);
+		return;
+	}
+
 	while (!(new_n = find_nick_on_channel(chan, nick)))
 	{
 		if (!(new_n = find_suspicious_on_channel(chan, nick)))
@@ -587,7 +1845,8 @@ void 	add_userhost_to_channel (const char *channel, const char *nick, int server
 			yell("User [%s!%s] was not on the names list for "
 				"channel [%s] on server [%d] -- adding them",
 				nick, uh, channel, server);
-			add_to_channel(channel, nick, server, 0, 0, 0, 0);
+			/* We don't know what their status is. */
+			add_to_channel(channel, nick, server, 0, 0, -1, 0);
 		}
 
 		/*
@@ -596,9 +1855,9 @@ void 	add_userhost_to_channel (const char *channel, const char *nick, int server
 		 */
 		else
 		{
-		    remove_from_array((array *)&chan->nicks, new_n->nick);
-		    malloc_strcpy(&new_n->nick, nick);
-		    add_to_array((array *)&chan->nicks, (array_item *)new_n);
+		    remove_nick_from_list(chan, new_n->user->nick);
+		    new_n->user = get_chan_user(server, nick);
+		    add_nick_to_list(chan, new_n);
 		    if (x_debug & DEBUG_CHANNELS)
 		    {
 			yell("Detected and corrected a nickname mangled by "
@@ -615,7 +1874,8 @@ void 	add_userhost_to_channel (const char *channel, const char *nick, int server
 		}
 	}
 
-	malloc_strcpy(&new_n->userhost, uh);
+	malloc_strcpy(&new_n->user->userhost, uh);
+	cache_userhost(server, nick, uh);
 }
 
 
@@ -627,22 +1887,35 @@ void 	add_userhost_to_channel (const char *channel, const char *nick, int server
 void 	remove_from_channel (const char *channel, const char *nick, int server)
 {
 	Channel *chan = NULL;
+	ChanUser *u;
 	Nick	*tmp;
 
 	if (server == NOSERV) return;
 
-	while (traverse_all_channels(&chan, server, 1))
+	/* Just one channel (PART, KICK) */
+	if (channel)
 	{
-		/* This is correct, dont change it! */
-		if (channel && server_stricmp(channel, chan->channel, server))
-			continue;
-
-		if ((tmp = (Nick *)remove_from_array((array *)&chan->nicks, nick)))
-		{
-			new_free(&tmp->nick);
-			new_free(&tmp->userhost); /* Da5id reported mf here */
+		if (!(chan = find_channel(channel, server)))
+			return;
+		if (chan->lazy)
+			lazy_part(chan, nick);
+		else if ((tmp = remove_nick_from_list(chan, nick)))
 			new_free((char **)&tmp);
-		}
+		return;
+	}
+
+	/* Every channel they're on (QUIT) */
+	forget_cached_userhost(server, nick);
+	for (chan = channel_list; chan; chan = chan->next)
+		if (chan->server == server && chan->lazy)
+			lazy_part(chan, nick);
+
+	while ((u = find_chan_user(server, nick)))
+	{
+		chan = u->channels->channel;
+		if (!(tmp = remove_nick_from_list(chan, nick)))
+			panic(1, "remove_from_channel: %s is indexed on %s but isn't there", nick, chan->channel);
+		new_free((char **)&tmp);
 	}
 }
 
@@ -653,22 +1926,110 @@ void 	remove_from_channel (const char *channel, const char *nick, int server)
  */
 void 	rename_nick (const char *old_nick, const char *new_nick, int server)
 {
-	Channel *chan = NULL;
-	Nick	*tmp;
+	ChanUser *u, *ghost;
+	Channel	*tmp_c;
+	Nick	**nicks;
+	Nick	*tmp, *old;
+	int	count, i;
 
 	if (server == NOSERV) return;		/* Sanity check */
 
-	while (traverse_all_channels(&chan, server, 1))
+	rename_cached_userhost(server, old_nick, new_nick);
+	for (tmp_c = channel_list; tmp_c; tmp_c = tmp_c->next)
+		if (tmp_c->server == server && tmp_c->lazy)
+			lazy_rename(tmp_c, old_nick, new_nick);
+
+	if (!(u = find_chan_user(server, old_nick)))
+		return;
+
+	/*
+	 * Take them out of everything that is keyed by their nickname,
+	 * change their nickname, and then put them back.
+	 */
+	for (count = 0, tmp = u->channels; tmp; tmp = tmp->next_channel)
+		count++;
+	nicks = alloca(sizeof(Nick *) * count);
+	for (i = 0, tmp = u->channels; tmp; tmp = tmp->next_channel)
+		nicks[i++] = tmp;
+
+	unhash_chan_user(server, u);
+	for (i = 0; i < count; i++)
+		unlink_nick(nicks[i]->channel, nicks[i]);
+
+	/*
+	 * If we think someone is already using the new nick, they're 
+	 * obviously not any more.  Get rid of them where they're in our way,
+	 * and anywhere else they are, they must be this person.
+	 */
+	for (i = 0; i < count; i++)
+		if ((old = remove_nick_from_list(nicks[i]->channel, new_nick)))
+			new_free(&old);
+	if ((ghost = find_chan_user(server, new_nick)))
 	{
-		if ((tmp = (Nick *)remove_from_array((array *)&chan->nicks, old_nick)))
+		while ((tmp = ghost->channels))
 		{
-			malloc_strcpy(&tmp->nick, new_nick);
-			malloc_strcpy(&tmp->userhost, FromUserHost);
-			add_to_array((array *)&chan->nicks, (array_item *)tmp);
+			ghost->channels = tmp->next_channel;
+			tmp->user = u;
+			index_nick(tmp->channel, tmp);
 		}
+		unhash_chan_user(server, ghost);
+		new_free(&ghost->nick);
+		new_free(&ghost->userhost);
+		new_free(&ghost->account);
+		new_free(&ghost->away);
+		new_free((char **)&ghost);
 	}
+
+	malloc_strcpy(&u->nick, new_nick);
+	malloc_strcpy(&u->userhost, FromUserHost);
+	hash_chan_user(server, u);
+	for (i = 0; i < count; i++)
+		link_nick(nicks[i]->channel, nicks[i]);
+}
+
+/*
+ * set_user_userhost - Someone changed their user@host (CHGHOST)
+ * set_user_account - Someone logged in or out of services (ACCOUNT)
+ * set_user_away - Someone went away or came back (AWAY)
+ * These are just remembered for people on your channels.  A NULL or
+ * empty value means they don't have one any more (and for an ACCOUNT,
+ * so does "*").
+ */
+void	set_user_userhost (int server, const char *nick, const char *userhost)
+{
+	ChanUser *u;
+
+	if (!(u = find_chan_user(server, nick)))
+		return;
+	if (userhost && *userhost)
+		malloc_strcpy(&u->userhost, userhost);
+	else
+		new_free(&u->userhost);
+}
+
+void	set_user_account (int server, const char *nick, const char *account)
+{
+	ChanUser *u;
+
+	if (!(u = find_chan_user(server, nick)))
+		return;
+	if (account && *account && strcmp(account, "*"))
+		malloc_strcpy(&u->account, account);
+	else
+		new_free(&u->account);
 }
 
+void	set_user_away (int server, const char *nick, const char *away)
+{
+	ChanUser *u;
+
+	if (!(u = find_chan_user(server, nick)))
+		return;
+	if (away && *away)
+		malloc_strcpy(&u->away, away);
+	else
+		new_free(&u->away);
+}
 
 /*
  * check_channel_type: checks if the given channel is a normal #channel
@@ -688,6 +2049,12 @@ int 	im_on_channel (const char *channel, int refnum)
 
 int 	is_on_channel (const char *channel, const char *nick)
 {
+	Channel *ch;
+
+	/* We can answer this for a lazy channel without building it */
+	if ((ch = find_channel(channel, from_server)) && ch->lazy)
+		return is_lazy_member(ch, nick);
+
 	if (find_nick(from_server, channel, nick))
 		return 1;
 	else
@@ -699,7 +2066,7 @@ int 	is_chanop (const char *channel, const char *nick)
 	Nick *n;
 
 	if ((n = find_nick(from_server, channel, nick)))
-		return n->chanop;
+		return (n->status & get_server(from_server)->op_status) ? 1 : 0;
 	else
 		return 0;
 }
@@ -709,7 +2076,7 @@ int	is_chanvoice (const char *channel, const char *nick)
 	Nick *n;
 
 	if ((n = find_nick(from_server, channel, nick)))
-		return n->voice;
+		return (n->status & get_server(from_server)->voice_status) ? 1 : 0;
 	else
 		return 0;
 }
@@ -719,7 +2086,7 @@ int	is_halfop (const char *channel, const char *nick)
 	Nick *n;
 
 	if ((n = find_nick(from_server, channel, nick)))
-		return n->half_assed;
+		return (n->status & get_server(from_server)->halfop_status) ? 1 : 0;
 	else
 		return 0;
 }
@@ -729,7 +2096,10 @@ int	number_on_channel (const char *name, int server)
 	Channel *channel = find_channel(name, server);
 
 	if (channel)
+	{
+		sync_lazy_channel(channel);
 		return channel->nicks.max;
+	}
 	else
 		return 0;
 }
@@ -737,6 +2107,7 @@ int	number_on_channel (const char *name, int server)
 char	*create_nick_list (const char *name, int server)
 {
 	Channel *channel = find_channel(name, server);
+	Nick	**list;
 	char 	*str = NULL;
 	int 	i;
 	size_t	clue = 0;
@@ -744,8 +2115,9 @@ char	*create_nick_list (const char *name, int server)
 	if (!channel)
 		return NULL;
 
+	list = sorted_nicks(channel);
 	for (i = 0; i < channel->nicks.max; i++)
-		malloc_strcat_word_c(&str, space, channel->nicks.list[i]->nick, DWORD_NO, &clue);
+		malloc_strcat_word_c(&str, space, list[i]->user->nick, DWORD_NO, &clue);
 
 	return str;
 }
@@ -753,6 +2125,8 @@ char	*create_nick_list (const char *name, int server)
 char	*create_chops_list (const char *name, int server)
 {
 	Channel *channel = find_channel(name, server);
+	Nick	**list;
+	u_32int_t ops;
 	char 	*str = NULL;
 	int 	i;
 	size_t	clue = 0;
@@ -760,9 +2134,11 @@ char	*create_chops_list (const char *name, int server)
 	if (!channel)
 		return malloc_strdup(empty_string);
 
+	ops = get_server(server)->op_status;
+	list = sorted_nicks(channel);
 	for (i = 0; i < channel->nicks.max; i++)
-	    if (channel->nicks.list[i]->chanop)
-		malloc_strcat_word_c(&str, space, channel->nicks.list[i]->nick, DWORD_NO, &clue);
+	    if (list[i]->status & ops)
+		malloc_strcat_word_c(&str, space, list[i]->user->nick, DWORD_NO, &clue);
 
 	if (!str)
 		return malloc_strdup(empty_string);
@@ -772,6 +2148,8 @@ char	*create_chops_list (const char *name, int server)
 char	*create_nochops_list (const char *name, int server)
 {
 	Channel *channel = find_channel(name, server);
+	Nick	**list;
+	u_32int_t ops;
 	char 	*str = NULL;
 	int 	i;
 	size_t	clue = 0;
@@ -779,9 +2157,11 @@ char	*create_nochops_list (const char *name, int server)
 	if (!channel)
 		return malloc_strdup(empty_string);
 
+	ops = get_server(server)->op_status;
+	list = sorted_nicks(channel);
 	for (i = 0; i < channel->nicks.max; i++)
-	    if (!channel->nicks.list[i]->chanop)
-		malloc_strcat_word_c(&str, space, channel->nicks.list[i]->nick, DWORD_NO, &clue);
+	    if (!(list[i]->status & ops))
+		malloc_strcat_word_c(&str, space, list[i]->user->nick, DWORD_NO, &clue);
 
 	if (!str)
 		return malloc_strdup(empty_string);
@@ -825,18 +2205,20 @@ static const char *	get_cmode (Channel *chan)
  */
 int	chanmodetype (char mode)
 {
-const	char	*chanmodes, *prefix;
+const	char	*chanmodes;
 	char	modetype = 3;
+	Server	*srv;
 
 	if (strchr("+-", mode))
 		return 1;
 
-	prefix = get_server_005(from_server, "PREFIX");
-	if (!prefix || *prefix++ != '(')
-		prefix = "ohv";
-	for (; *prefix && *prefix != ')'; prefix++)
-		if (*prefix == mode)
+	if ((srv = get_server(from_server)))
+	{
+		if (srv->mode_rank[(unsigned char)mode])
 			return 2;
+	}
+	else if (strchr("ohv", mode))
+		return 2;
 
 	chanmodes = get_server_005(from_server, "CHANMODES");
 	if (!chanmodes)
@@ -850,6 +2232,40 @@ const	char	*chanmodes, *prefix;
 	return 0;
 }
 
+/*
+ * update_nick_status: Someone on 'chan' got a prefix mode (like +o) set
+ * or unset.  Returns the nick, if we know about them.
+ */
+static Nick *	update_nick_status (Channel *chan, const char *arg, char mode, int add)
+{
+	Server *	srv;
+	Nick *		nick;
+	int		rank;
+
+	if (!(srv = get_server(chan->server)))
+		return NULL;
+	if (!(rank = srv->mode_rank[(unsigned char)mode]))
+		return NULL;
+	if (chan->lazy)
+	{
+		char	change[3] = { add ? '+' : '-', mode, 0 };
+
+		if (is_lazy_member(chan, arg))
+			defer_delta(chan, '*', change, arg);
+		return NULL;
+	}
+	if (!(nick = find_nick_on_channel(chan, arg)))
+		return NULL;
+
+	if (add)
+		nick->status |= 1U << (rank - 1);
+	else
+		nick->status &= ~(1U << (rank - 1));
+	if (srv->voice_status & (1U << (rank - 1)))
+		nick->voice_unknown = 0;
+	return nick;
+}
+
 /*
  * decifer_mode: This will figure out the mode string as returned by mode
  * commands and convert that mode string into a one byte bit map of modes 
@@ -951,19 +2367,9 @@ static void	decifer_mode (const char *modes, Channel *chan)
 			if (!arg)
 			    arg = get_server_nickname(from_server);
 
-			// Sigh, since we're doing things the right way now for not-quite-IRC servers like Unreal...
-			// Rebuild the prefix list (work out if we're represented already, if we are, and adding,
-			// do nout, if we aren't, and deleting, do nout...)
-
 			if (is_me(from_server, arg))
 				chan->chop = add;
-			if ((nick = find_nick_on_channel(chan, arg))) {
-				if (add)
-					add_mode_to_str(nick->prefixes, 17, srv->prefixmodes[*mode_str]);
-				else
-					remove_mode_from_str(nick->prefixes, 17, srv->prefixmodes[*mode_str]);
-				nick->chanop = add;
-			}
+			update_nick_status(chan, arg, *mode_str, add);
 			continue;
 		}
 		// jimbus crip... gotta move at least +h outta this establishment.
@@ -980,13 +2386,7 @@ static void	decifer_mode (const char *modes, Channel *chan)
 
 			if (is_me(from_server, arg))
 				chan->voice = add;
-			if ((nick = find_nick_on_channel(chan, arg))) {
-				if (add)
-					add_mode_to_str(nick->prefixes, 17, srv->prefixmodes[*mode_str]);
-				else
-					remove_mode_from_str(nick->prefixes, 17, srv->prefixmodes[*mode_str]);
-				nick->voice = add;
-			}
+			update_nick_status(chan, arg, *mode_str, add);
 			continue;
 		}
 		case 'h': /* erfnet's borked 'half-assed oper' mode */
@@ -1002,18 +2402,28 @@ static void	decifer_mode (const char *modes, Channel *chan)
 
 			if (is_me(from_server, arg))
 				chan->half_assed = add;
-			if ((nick = find_nick_on_channel(chan, arg))) {
-				if (add)
-					add_mode_to_str(nick->prefixes, 17, srv->prefixmodes[*mode_str]);
-				else
-					remove_mode_from_str(nick->prefixes, 17, srv->prefixmodes[*mode_str]);
-				nick->half_assed = add;
-			}
+			update_nick_status(chan, arg, *mode_str, add);
 			continue;
 		}
 
 		default:
 		{
+		    /* 
+		     * Tricky ircd specific prefix modes (+q, +a, and so on).
+		     * If it's you, your chanop-ness follows your new prefixes.
+		     */
+		    if (arg && srv && srv->mode_rank[(unsigned char)*mode_str])
+		    {
+			if ((nick = update_nick_status(chan, arg, *mode_str, add))
+					&& is_me(from_server, arg))
+			{
+			    chan->chop = (nick->status & srv->op_status) ? 1 : 0;
+			    chan->half_assed = (nick->status & srv->halfop_status) ? 1 : 0;
+			    chan->voice = (nick->status & srv->voice_status) ? 1 : 0;
+			}
+			continue;
+		    }
+
 		    if (type == 2 || type == 3 || type == 4)
 			continue;	/* Skip modes with args */
 
@@ -1021,13 +2431,6 @@ static void	decifer_mode (const char *modes, Channel *chan)
 			add_mode_to_str(chan->base_modes, 54, *mode_str);
 		    else
 			remove_mode_from_str(chan->base_modes, 54, *mode_str);
-	            if (srv->prefixmodes[*mode_str] != 0) {
-			// tricky ircd specific modes that we have to support
-			if (add)
-				add_mode_to_str(nick->prefixes, 17, srv->prefixmodes[*mode_str]);
-			else
-				remove_mode_from_str(nick->prefixes, 17, srv->prefixmodes[*mode_str]);
-	            }
 		}
 	    }
 	}
@@ -1152,7 +2555,7 @@ int	is_channel_anonymous (const char *channel, int server_index)
  */
 static void 	show_channel (Channel *chan)
 {
-	NickList 	*tmp = &chan->nicks;
+	Nick		**list;
 	char		local_buf[BIG_BUFFER_SIZE * 10 + 1];
 	char		*ptr;
 	int		nick_len;
@@ -1163,13 +2566,14 @@ static void 	show_channel (Channel *chan)
 	*ptr = 0;
 	nick_len = BIG_BUFFER_SIZE * 10;
 
-	for (i = 0; i < tmp->max; i++)
+	list = sorted_nicks(chan);
+	for (i = 0; i < chan->nicks.max; i++)
 	{
-		strlcpy(ptr, tmp->list[i]->nick, nick_len);
-		if (tmp->list[i]->userhost)
+		strlcpy(ptr, list[i]->user->nick, nick_len);
+		if (list[i]->user->userhost)
 		{
 			strlcat(ptr, "!", nick_len);
-			strlcat(ptr, tmp->list[i]->userhost, nick_len);
+			strlcat(ptr, list[i]->user->userhost, nick_len);
 		}
 		strlcat(ptr, space, nick_len);
 
@@ -1192,33 +2596,34 @@ static void 	show_channel (Channel *chan)
 char	*scan_channel (char *cname)
 {
 	Channel 	*wc = find_channel(cname, from_server);
-	NickList 	*nicks;
+	Server		*srv;
+	Nick		**list;
 	char		buffer[NICKNAME_LEN + 5];
 	char		*retval = NULL;
 	int		i;
 	size_t	clue = 0;
 
-	if (!wc)
+	if (!wc || !(srv = get_server(wc->server)))
 		return malloc_strdup(empty_string);
 
-	nicks = &wc->nicks;
-	for (i = 0; i < nicks->max; i++)
+	list = sorted_nicks(wc);
+	for (i = 0; i < wc->nicks.max; i++)
 	{
-		if (nicks->list[i]->chanop)
+		if (list[i]->status & srv->op_status)
 			buffer[0] = '@';
-		else if (nicks->list[i]->half_assed == 1)
+		else if (list[i]->status & srv->halfop_status)
 			buffer[0] = '%';
 		else
 			buffer[0] = '.';
 
-		if (nicks->list[i]->voice == 1)
+		if (list[i]->status & srv->voice_status)
 			buffer[1] = '+';
-		else if (nicks->list[i]->voice == -1)
+		else if (list[i]->voice_unknown)
 			buffer[1] = '?';
 		else
 			buffer[1] = '.';
 
-		strlcpy(buffer + 2, nicks->list[i]->nick, sizeof(buffer) - 2);
+		strlcpy(buffer + 2, list[i]->user->nick, sizeof(buffer) - 2);
 		malloc_strcat_word_c(&retval, space, buffer, DWORD_NO, &clue);
 	}
 
@@ -1386,6 +2791,7 @@ int     is_current_channel (const char *channel, int server)
 void 	destroy_server_channels (int server)
 {
 	Channel	*tmp = NULL;
+	ChannelHash *h;
 	int	reset = 0;
 
 	if (server == NOSERV)
@@ -1410,53 +2816,135 @@ void 	destroy_server_channels (int server)
 		reset = 1;
 	}
 	window_check_channels();
+
+	if ((h = get_channel_hash(server)))
+		flush_userhost_cache(h);
 }
 
 
 const char *	what_channel (const char *nick, int servref)
 {
-	Channel *tmp = NULL;
+	ChanUser *u;
+	Channel	*ch;
+	Channel *best = NULL;
 
-	while (traverse_all_channels(&tmp, servref, 1))
+	if ((u = find_chan_user(servref, nick)))
+		best = u->channels->channel;
+
+	/* Lazy channels don't have Nicks, but they know who's on them */
+	for (ch = channel_list; ch; ch = ch->next)
 	{
-		if (find_nick_on_channel(tmp, nick))
-			return tmp->channel;
+		if (best && ch->serial < best->serial)
+			break;
+		if (ch->server == servref && is_lazy_member(ch, nick))
+		{
+			best = ch;
+			break;
+		}
 	}
 
-	return NULL;
+	return best ? best->channel : NULL;
 }
 
+/*
+ * walk_channels - Return each channel "nick" is on, one at a time.
+ * Call it with init == 1 for the first channel, and init == 0 for the
+ * rest.  The caller runs hooks between calls, which could do anything
+ * to the channels, so we only remember how far we got, not where.
+ */
 const char *	walk_channels (int init, const char *nick)
 {
-	static	Channel *tmp = (Channel *) 0;
+	static	unsigned long	last_serial = 0;
+	ChanUser *u;
+	Nick	*tmp;
+	Channel	*ch;
+	Channel	*best = NULL;
 
-	if (init)
-		tmp = NULL;
+	if ((u = find_chan_user(from_server, nick)))
+	{
+		for (tmp = u->channels; tmp; tmp = tmp->next_channel)
+		{
+			if (init || tmp->channel->serial < last_serial)
+			{
+				best = tmp->channel;
+				break;
+			}
+		}
+	}
 
-	while (traverse_all_channels(&tmp, from_server, 1))
+	/* 
+	 * Lazy channels aren't on the user's list, so look at them too.
+	 * The channel_list is newest first, just like the user's list.
+	 */
+	for (ch = channel_list; ch; ch = ch->next)
 	{
-		if (find_nick_on_channel(tmp, nick))
-			return (tmp->channel);
+		if (best && ch->serial < best->serial)
+			break;
+		if (!init && ch->serial >= last_serial)
+			continue;
+		if (ch->server == from_server && is_lazy_member(ch, nick))
+		{
+			best = ch;
+			break;
+		}
 	}
 
-	return NULL;
+	if (!best)
+		return NULL;
+	last_serial = best->serial;
+	return best->channel;
 }
 
 const char *	fetch_userhost (int server, const char *chan, const char *nick)
 {
 	Channel *tmp = NULL;
-	Nick *user = NULL;
+	Nick *n = NULL;
+	ChanUser *u;
+	ChannelHash *h;
+	CachedUserhost *c;
 
 	if (server == NOSERV) return NULL;		/* Sanity check */
 
-	if (chan && (tmp = find_channel(chan, server)) &&
-			(user = find_nick_on_channel(tmp, nick)))
-		return user->userhost;
-	else while (traverse_all_channels(&tmp, server, 1))
-		if ((user = find_nick_on_channel(tmp, nick)) && 
-				user->userhost)
-			return user->userhost;
+	if (chan && (tmp = find_channel(chan, server)))
+		sync_lazy_channel(tmp);
+	if (tmp && (n = find_nick_on_channel(tmp, nick)) && 
+			n->user->userhost)
+		return n->user->userhost;
+	if ((u = find_chan_user(server, nick)) && u->userhost)
+		return u->userhost;
+
+	/* Maybe we've heard from them somewhere else */
+	if (!(h = check_userhost_cache(server)))
+		return NULL;
+	if ((c = find_cached_userhost(h, server, nick)))
+	{
+		h->uh_hits++;
+		return c->userhost;
+	}
+	h->uh_misses++;
+	return NULL;
+}
+
+/*
+ * fetch_account - Return the services account of someone on your channels
+ * fetch_away - Return the away message of someone on your channels
+ * Both of these return NULL if we don't know (or they don't have one).
+ */
+const char *	fetch_account (int server, const char *nick)
+{
+	ChanUser *u;
+
+	if ((u = find_chan_user(server, nick)))
+		return u->account;
+	return NULL;
+}
+
+const char *	fetch_away (int server, const char *nick)
+{
+	ChanUser *u;
 
+	if ((u = find_chan_user(server, nick)))
+		return u->away;
 	return NULL;
 }
 
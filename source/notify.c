@@ -39,6 +39,20 @@
  * Mostly rewritten in Dec 1997.
  */
 
+/*
+ * How notify finds out about people:
+ *
+ * If the server supports MONITOR or WATCH (it says so in its 005), we give
+ * it the whole notify list when we connect, and it tells us whenever anyone
+ * on the list signs on or off.  We never have to ask.
+ *
+ * Otherwise, we ask with ISON every /SET NOTIFY_INTERVAL seconds, like we
+ * always have.  But if nobody has signed on or off for a while, we slow
+ * down (every other time, every fourth time, ... up to every eighth time),
+ * and go back to full speed as soon as anyone does.
+ */
+#define NOTIFY_MAX_BACKOFF	8
+
 #define NEED_SERVER_LIST
 #include "irc.h"
 #include "alist.h"
@@ -83,6 +97,7 @@ typedef struct	notify_alist
 
 static 	void	ison_notify (int refnum, char *AskedFor, char *AreOn);
 static 	void	rebuild_notify_ison 	(int server);
+static	void	send_watch_list		(int refnum, int op, const char *nicks);
 
 
 #define NOTIFY_LIST(s)		(&(s->notify_list))
@@ -191,6 +206,7 @@ BUILT_IN_COMMAND(notify)
 			    {
 				new_free(&(new_n->nick));
 				new_free((char **)&new_n);
+				send_watch_list(refnum, '-', nick);
 
 				if (!shown)
 				{
@@ -221,6 +237,7 @@ BUILT_IN_COMMAND(notify)
 				new_free(&new_n->nick);
 				new_free((char **)&new_n);
 			    }
+			    send_watch_list(refnum, 'C', NULL);
 			}
 			say("Notify list cleared");
 		    }
@@ -259,6 +276,8 @@ BUILT_IN_COMMAND(notify)
 			new_n->flag = 0;
 			add_to_array((array *)NOTIFY_LIST(s), 
 					(array_item *)new_n);
+			NOTIFY_LIST(s)->poll_every = 1;
+			NOTIFY_LIST(s)->poll_countdown = 1;
 			added = 1;
 		     }
 
@@ -273,14 +292,18 @@ BUILT_IN_COMMAND(notify)
 	    } /* End of for */
 	} /* End of while */
 
-	if (do_ison && get_int_var(DO_NOTIFY_IMMEDIATELY_VAR))
+	if (do_ison)
 	{
 	    for (refnum = first; refnum < last; refnum++)
 	    {
 		if (!(s = get_server(refnum)))
 		    continue;
 
-		if (is_server_registered(refnum) && list && *list)
+		/* MONITOR and WATCH servers always tell us right away */
+		if (NOTIFY_LIST(s)->mode != NOTIFY_ISON)
+			send_watch_list(refnum, '+', list);
+		else if (get_int_var(DO_NOTIFY_IMMEDIATELY_VAR) &&
+			  is_server_registered(refnum) && list && *list)
 			isonbase(refnum, list, ison_notify);
 	    }
 	}
@@ -292,6 +315,28 @@ BUILT_IN_COMMAND(notify)
 	    show_notify_list(1);
 }
 
+/*
+ * ison_backoff - After each ISON, decide how long to wait for the next one.
+ * If nobody signed on or off since the last one, wait twice as long.
+ */
+static void	ison_backoff (int refnum)
+{
+	Server *s;
+
+	if (!(s = get_server(refnum)))
+		return;
+
+	if (NOTIFY_LIST(s)->changes)
+		NOTIFY_LIST(s)->poll_every = 1;
+	else if (NOTIFY_LIST(s)->poll_every < NOTIFY_MAX_BACKOFF)
+		NOTIFY_LIST(s)->poll_every *= 2;
+	NOTIFY_LIST(s)->changes = 0;
+
+	if (x_debug & DEBUG_NOTIFY)
+		yell("Server [%d] will ISON every [%d] notify intervals",
+			refnum, NOTIFY_LIST(s)->poll_every);
+}
+
 static void	ison_notify (int refnum, char *AskedFor, char *AreOn)
 {
 	char	*NextAsked;
@@ -327,6 +372,7 @@ static void	ison_notify (int refnum, char *AskedFor, char *AreOn)
 			yell("Hrm.  There's stuff left in AreOn, and there shouldn't be. [%s]", AreOn);
 
 	dispatch_notify_userhosts(refnum);
+	ison_backoff(refnum);
 }
 
 /*
@@ -359,6 +405,24 @@ void 	do_notify (void)
 		    continue;
 		}
 
+		if (NOTIFY_LIST(s)->mode != NOTIFY_ISON)
+		{
+		    if (x_debug & DEBUG_NOTIFY)
+			yell("Server [%d] tells us about signons and "
+			     "signoffs, so we will not ISON it.", servnum);
+		    continue;
+		}
+
+		if (--NOTIFY_LIST(s)->poll_countdown > 0)
+		{
+		    if (x_debug & DEBUG_NOTIFY)
+			yell("Server [%d] is not due for an ISON for [%d] "
+			     "more intervals", servnum, 
+				NOTIFY_LIST(s)->poll_countdown);
+		    continue;
+		}
+		NOTIFY_LIST(s)->poll_countdown = NOTIFY_LIST(s)->poll_every;
+
 		from_server = servnum;
 		if (NOTIFY_LIST(s)->ison && *NOTIFY_LIST(s)->ison
 				&& !s->ison_wait)
@@ -421,6 +485,7 @@ void 	notify_mark (int refnum, const char *nick, int flag, int doit)
 		{
 			if (tmp->flag != 1)
 			{
+			    NOTIFY_LIST(s)->changes++;
 			    if (get_int_var(NOTIFY_USERHOST_AUTOMATIC_VAR))
 			        batch_notify_userhost(nick);
 			    else
@@ -435,6 +500,7 @@ void 	notify_mark (int refnum, const char *nick, int flag, int doit)
 		{
 			if (tmp->flag == 1)
 			{
+			    NOTIFY_LIST(s)->changes++;
 			    if (do_hook(NOTIFY_SIGNOFF_LIST, "%s", nick))
 				say("Signoff by %s detected", nick);
 			}
@@ -513,8 +579,9 @@ void 	make_notify_list (int refnum)
 {
 	Server *s, *sp = NULL;
 	NotifyItem *tmp;
+	array_item **items;
 	char *list = NULL;
-	int i;
+	int i, count;
 	size_t clue = 0;
 
 	if (!(s = get_server(refnum)))
@@ -526,6 +593,10 @@ void 	make_notify_list (int refnum)
 	s->notify_list.func = (alist_func)my_stricmp;
 	s->notify_list.hash = HASH_INSENSITIVE;
 	s->notify_list.ison = NULL;
+	s->notify_list.mode = NOTIFY_ISON;
+	s->notify_list.changes = 0;
+	s->notify_list.poll_every = 1;
+	s->notify_list.poll_countdown = 1;
 
 	for (i = 0; i < number_of_servers; i++)
 		if ((sp = get_server(i)) && NOTIFY_MAX(sp))
@@ -533,16 +604,22 @@ void 	make_notify_list (int refnum)
 	if (!sp)
 		return;			/* No notify list to copy. */
 
-	for (i = 0; i < NOTIFY_MAX(sp); i++)
+	count = NOTIFY_MAX(sp);
+	items = (array_item **)new_malloc(sizeof(array_item *) * count * 2);
+	for (i = 0; i < count; i++)
 	{
 		tmp = (NotifyItem *)new_malloc(sizeof(NotifyItem));
 		tmp->nick = malloc_strdup(NOTIFY_ITEM(sp, i)->nick);
 		tmp->flag = 0;
 
-		add_to_array ((array *)NOTIFY_LIST(s), (array_item *)tmp);
+		items[i] = (array_item *)tmp;
 		malloc_strcat_wordlist_c(&list, space, tmp->nick, &clue);
 	}
 
+	/* They're all different, so nothing will be displaced */
+	add_to_array_bulk((array *)NOTIFY_LIST(s), items, count, items + count);
+	new_free((char **)&items);
+
 	if (list && !s->ison_wait)
 	{
 		isonbase(refnum, list, ison_notify);
@@ -569,6 +646,238 @@ void	destroy_notify_list (int refnum)
 	new_free(NOTIFY_LIST(s));
 }
 
+/*
+ * send_watch_list - Tell a MONITOR or WATCH server about notify list changes
+ *	op	'+' to add the 'nicks', '-' to remove them, 'C' to clear the
+ *		whole list ('nicks' is ignored)
+ *	nicks	A space separated list of nicks.
+ * This does nothing if we're using ISON for this server.
+ */
+static void	send_watch_list (int refnum, int op, const char *nicks)
+{
+	Server *s;
+	const char *	cmd;
+	char *	copy;
+	char *	nick;
+	char *	list = NULL;
+	char *	word;
+	size_t	clue = 0;
+
+	if (!(s = get_server(refnum)) || !is_server_registered(refnum))
+		return;
+
+	if (NOTIFY_LIST(s)->mode == NOTIFY_MONITOR)
+		cmd = "MONITOR";
+	else if (NOTIFY_LIST(s)->mode == NOTIFY_WATCH)
+		cmd = "WATCH";
+	else
+		return;
+
+	if (op == 'C')
+	{
+		send_to_aserver(refnum, "%s C", cmd);
+		return;
+	}
+
+	/* Keep each line well under the 512 byte limit */
+	copy = LOCAL_COPY(nicks);
+	while ((nick = next_arg(copy, &copy)))
+	{
+		if (NOTIFY_LIST(s)->mode == NOTIFY_MONITOR)
+			malloc_strcat_wordlist_c(&list, ",", nick, &clue);
+		else
+		{
+			word = alloca(strlen(nick) + 2);
+			sprintf(word, "%c%s", op, nick);
+			malloc_strcat_wordlist_c(&list, space, word, &clue);
+		}
+
+		if (clue > 400)
+		{
+			if (NOTIFY_LIST(s)->mode == NOTIFY_MONITOR)
+				send_to_aserver(refnum, "%s %c %s", cmd, op, list);
+			else
+				send_to_aserver(refnum, "%s %s", cmd, list);
+			new_free(&list);
+			clue = 0;
+		}
+	}
+
+	if (list)
+	{
+		if (NOTIFY_LIST(s)->mode == NOTIFY_MONITOR)
+			send_to_aserver(refnum, "%s %c %s", cmd, op, list);
+		else
+			send_to_aserver(refnum, "%s %s", cmd, list);
+		new_free(&list);
+	}
+}
+
+/*
+ * notify_check_005 - The server sent us an 005.  If it supports MONITOR
+ * or WATCH, and our notify list fits, we switch over to it.
+ */
+void	notify_check_005 (int refnum)
+{
+	Server *s;
+	const char *	limit;
+	int	mode;
+
+	if (!(s = get_server(refnum)))
+		return;
+
+	if (NOTIFY_LIST(s)->mode != NOTIFY_ISON)
+		return;
+
+	if ((limit = get_server_005(refnum, "MONITOR")))
+		mode = NOTIFY_MONITOR;
+	else if ((limit = get_server_005(refnum, "WATCH")))
+		mode = NOTIFY_WATCH;
+	else
+		return;
+
+	if (atol(limit) > 0 && NOTIFY_MAX(s) > atol(limit))
+	{
+		if (x_debug & DEBUG_NOTIFY)
+			yell("Server [%d]'s %s limit is [%s], but the "
+			     "notify list has [%d] nicks.  Using ISON.",
+				refnum, mode == NOTIFY_MONITOR ? "MONITOR" :
+					"WATCH", limit, NOTIFY_MAX(s));
+		return;
+	}
+
+	NOTIFY_LIST(s)->mode = mode;
+	rebuild_notify_ison(refnum);
+	if (NOTIFY_LIST(s)->ison && *NOTIFY_LIST(s)->ison)
+		send_watch_list(refnum, '+', NOTIFY_LIST(s)->ison);
+}
+
+/*
+ * notify_server_reset - We've lost our connection to the server, so when
+ * we reconnect we'll have to see if it does MONITOR or WATCH all over.
+ */
+void	notify_server_reset (int refnum)
+{
+	Server *s;
+
+	if (!(s = get_server(refnum)))
+		return;
+
+	NOTIFY_LIST(s)->mode = NOTIFY_ISON;
+	NOTIFY_LIST(s)->changes = 0;
+	NOTIFY_LIST(s)->poll_every = 1;
+	NOTIFY_LIST(s)->poll_countdown = 1;
+}
+
+/*
+ * notify_signon - A MONITOR or WATCH server says someone is on irc.
+ * It tells us their userhost too, so we don't have to go ask for it.
+ */
+static void	notify_signon (int refnum, const char *nick, const char *uh)
+{
+	Server *s;
+	NotifyItem *tmp;
+
+	if (!(s = get_server(refnum)))
+		return;
+
+	if (!(tmp = (NotifyItem *)array_lookup((array *)NOTIFY_LIST(s), 
+							nick, 0, 0)))
+		return;
+
+	if (tmp->flag != 1)
+	{
+		tmp->flag = 1;
+		NOTIFY_LIST(s)->changes++;
+		notify_userhost_reply(refnum, nick, uh);
+	}
+}
+
+/*
+ * notify_monitor_reply - Handle the MONITOR and WATCH numerics.
+ * Returns 1 if the numeric was for us, and 0 if it wasn't (we're not 
+ * using MONITOR/WATCH on this server, so the user must have asked for it).
+ *
+ *	730 RPL_MONONLINE	nick!user@host[,nick!user@host...]
+ *	731 RPL_MONOFFLINE	nick[,nick...]
+ *	734 ERR_MONLISTFULL	limit nicks :Monitor list is full
+ *	600 RPL_LOGON		nick user host ts :logged online
+ *	601 RPL_LOGOFF		nick user host ts :logged offline
+ *	604 RPL_NOWON		nick user host ts :is online
+ *	605 RPL_NOWOFF		nick * * 0 :is offline
+ *	512 ERR_TOOMANYWATCH	nick :Maximum size for WATCH-list is N entries
+ */
+int	notify_monitor_reply (int refnum, int numeric, const char **ArgList)
+{
+	Server *s;
+	char *	list;
+	char *	nick;
+	char *	uh;
+	int	mode;
+
+	if (!(s = get_server(refnum)))
+		return 0;
+
+	mode = NOTIFY_LIST(s)->mode;
+	if (numeric >= 730 && numeric <= 734 && mode != NOTIFY_MONITOR)
+		return 0;
+	if ((numeric < 730 || numeric > 734) && mode != NOTIFY_WATCH)
+		return 0;
+
+	if (!ArgList[0])
+		return 0;
+
+	switch (numeric)
+	{
+	    case 730:
+	    case 731:
+		list = LOCAL_COPY(ArgList[0]);
+		while ((nick = next_in_comma_list(list, &list)) && *nick)
+		{
+			if ((uh = strchr(nick, '!')))
+				*uh++ = 0;
+
+			if (numeric == 730)
+				notify_signon(refnum, nick, uh);
+			else
+				notify_mark(refnum, nick, 0, 1);
+		}
+		break;
+
+	    case 600:
+	    case 604:
+		if (!ArgList[1] || !ArgList[2])
+			return 0;
+		uh = alloca(strlen(ArgList[1]) + strlen(ArgList[2]) + 2);
+		sprintf(uh, "%s@%s", ArgList[1], ArgList[2]);
+		notify_signon(refnum, ArgList[0], uh);
+		break;
+
+	    case 601:
+	    case 605:
+		notify_mark(refnum, ArgList[0], 0, 1);
+		break;
+
+	    /* The list didn't fit after all.  Go back to ISON. */
+	    case 512:
+	    case 734:
+		if (x_debug & DEBUG_NOTIFY)
+			yell("Server [%d]'s notify list is full.  Using ISON.",
+				refnum);
+		send_watch_list(refnum, 'C', NULL);
+		notify_server_reset(refnum);
+		rebuild_notify_ison(refnum);
+		if (NOTIFY_LIST(s)->ison && *NOTIFY_LIST(s)->ison)
+			isonbase(refnum, NOTIFY_LIST(s)->ison, ison_notify);
+		break;
+
+	    default:
+		return 0;
+	}
+
+	return 1;
+}
+
 char *	get_notify_nicks (int refnum, int showon)
 {
 	Server *s;
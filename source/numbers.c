@@ -309,6 +309,7 @@ void 	numbered_command (const char *from, const char *comm, char const **ArgList
 			else
 				set_server_005(from_server, set, space);
 		}
+		notify_check_005(from_server);
 		break;
 	}
 
@@ -563,7 +564,8 @@ void 	numbered_command (const char *from, const char *comm, char const **ArgList
 		    update_channel_mode(channel, mode);
 		    update_all_status();
 
-		    if (is_channel_anonymous(copy, from_server))
+		    if (is_channel_anonymous(copy, from_server) ||
+				is_channel_lazy(copy, from_server))
 			channel_not_waiting(copy, from_server);
 		    else
 		    {
@@ -617,7 +619,10 @@ void 	numbered_command (const char *from, const char *comm, char const **ArgList
 		if (!(line = ArgList[2]))
 			{ line = empty_string; }
 
-		if (channel_is_syncing(channel, from_server))
+		if (channel_is_syncing(channel, from_server) &&
+				defer_names(channel, line, from_server))
+			break;
+		else if (channel_is_syncing(channel, from_server))
 		{
 		    char *line_copy = LOCAL_COPY(line);
 		    char *nick;
@@ -688,6 +693,18 @@ void 	numbered_command (const char *from, const char *comm, char const **ArgList
 		xwhoreply(from_server, NULL, comm, ArgList);
 		goto END;
 
+	case 512:		/* #define ERR_TOOMANYWATCH	512 */
+	case 600:		/* #define RPL_LOGON		600 */
+	case 601:		/* #define RPL_LOGOFF		601 */
+	case 604:		/* #define RPL_NOWON		604 */
+	case 605:		/* #define RPL_NOWOFF		605 */
+	case 730:		/* #define RPL_MONONLINE	730 */
+	case 731:		/* #define RPL_MONOFFLINE	731 */
+	case 734:		/* #define ERR_MONLISTFULL	734 */
+		if (notify_monitor_reply(from_server, numeric, ArgList))
+			goto END;
+		break;
+
 	/* XXX Yea yea, these are out of order. so shoot me. */
 	case 346:               /* #define RPL_INVITELIST (+I for erf) */
 	case 348:               /* #define RPL_EXCEPTLIST (+e for erf) */
@@ -540,16 +540,218 @@ static void	p_privmsg (const char *from, const char *comm, const char **ArgList)
 	notify_mark(from_server, from, 1, 0);
 }
 
+/*
+ * Netsplits
+ *
+ * When a server splits from the network, we get a QUIT for everybody on
+ * the other side, all at once, with "server1 server2" as the reason.  
+ * Rather than handle each one by itself as it comes in, we save them up
+ * until something else comes along (or we run out of things to read) and
+ * then handle them all together.
+ *
+ * If you hook /ON ^NETSPLIT, it is thrown once for the whole batch, as
+ *	$0 $1	The two servers
+ *	$2	How many people split
+ *	$3-	Who split (unless you're ignoring their QUITs)
+ * and then everybody is removed without a SIGNOFF for each of them.
+ * Otherwise, each QUIT is handled the same as always.
+ */
+typedef struct
+{
+	int	server;		/* The server this happened on */
+	char *	reason;		/* The "server1 server2" */
+	int	count;		/* How many people have split */
+	int	size;		/* How many people we have room for */
+	char **	nicks;		/* Who split */
+	char **	userhosts;	/* Who split (the rest of it) */
+} NetsplitBatch;
+
+static	NetsplitBatch	netsplit = { NOSERV, NULL, 0, 0, NULL, NULL };
+
+static	int	quit_is_quiet (const char *from, const char *quit_message);
+static	void	quit_one (const char *from, const char *quit_message, int quiet);
+
+/* 
+ * Does this QUIT message look like the reason for a netsplit? 
+ * That's two server names (they have dots in them) and nothing else.
+ */
+static int	is_netsplit_reason (const char *reason)
+{
+	const char *	gap;
+	const char *	p;
+
+	if (!(gap = strchr(reason, ' ')) || gap == reason || !gap[1])
+		return 0;
+	if (strchr(gap + 1, ' '))
+		return 0;
+	if (!strncmp(reason, gap + 1, gap - reason) && 
+			!gap[1 + (gap - reason)])
+		return 0;		/* Same server twice?  I don't think so */
+
+	for (p = reason; *p; p++)
+	{
+		if (*p == '.')
+		{
+			if (p == reason || p[-1] == ' ' || p[-1] == '.' || 
+					!p[1] || p[1] == ' ')
+				return 0;
+		}
+		else if (*p == ':' || *p == '/' || *p == '(' || *p == '!' ||
+				*p == '@')
+			return 0;
+	}
+
+	/* There has to be at least one dot in each name */
+	return (memchr(reason, '.', gap - reason) && strchr(gap, '.'));
+}
+
+/* Is this line from the server a QUIT? */
+static int	is_quit_line (const char *line)
+{
+	if (*line == ':')
+	{
+		if (!(line = strchr(line, ' ')))
+			return 0;
+		while (*line == ' ')
+			line++;
+	}
+	return !strncmp(line, "QUIT ", 5);
+}
+
+/*
+ * flush_netsplit - Handle the QUITs we've been saving up, if any.
+ * This is called when something other than a QUIT comes in, or when
+ * the client is done reading from the servers (see io()), or when the
+ * server connection is closed.
+ */
+void	flush_netsplit (void)
+{
+	NetsplitBatch	batch;
+	const char *	old_from_user_host = FromUserHost;
+	int		old_from_server = from_server;
+	char *		nicks = NULL;
+	char *		quiet;
+	size_t		clue = 0;
+	int		i, l, shown = 0, summarized = 0;
+
+	if (!netsplit.count)
+		return;
+
+	/* 
+	 * The hooks below can do anything, including reading from the
+	 * server, so take the batch for ourselves before starting.
+	 */
+	batch = netsplit;
+	netsplit.server = NOSERV;
+	netsplit.reason = NULL;
+	netsplit.count = netsplit.size = 0;
+	netsplit.nicks = netsplit.userhosts = NULL;
+
+	/*
+	 * Each QUIT is checked against /IGNORE and /FLOOD exactly once,
+	 * here, whether it ends up in the summary or is shown by itself,
+	 * so a netsplit still counts towards the QUIT flood.
+	 */
+	from_server = batch.server;
+	quiet = new_malloc(batch.count);
+	for (i = 0; i < batch.count; i++)
+	{
+		FromUserHost = batch.userhosts[i];
+		if ((quiet[i] = quit_is_quiet(batch.nicks[i], batch.reason)))
+			continue;
+		malloc_strcat_word_c(&nicks, " ", batch.nicks[i], DWORD_NO, &clue);
+		shown++;
+	}
+
+	/* If there's no one left to tell the user about, don't bother. */
+	if (shown > 0)
+	{
+		l = message_from(NULL, LEVEL_QUIT);
+		summarized = !do_hook(NETSPLIT_LIST, "%s %d %s", 
+				batch.reason, shown, nicks);
+		pop_message_from(l);
+	}
+
+	for (i = 0; i < batch.count; i++)
+	{
+		FromUserHost = batch.userhosts[i];
+		if (!summarized)
+			quit_one(batch.nicks[i], batch.reason, quiet[i]);
+		else
+		{
+			if (!quiet[i])
+				notify_mark(batch.server, batch.nicks[i], 0, 0);
+			remove_from_channel(NULL, batch.nicks[i], batch.server);
+		}
+		new_free(&batch.nicks[i]);
+		new_free(&batch.userhosts[i]);
+	}
+
+	new_free(&quiet);
+	new_free(&nicks);
+	new_free(&batch.nicks);
+	new_free(&batch.userhosts);
+	new_free(&batch.reason);
+	FromUserHost = old_from_user_host;
+	from_server = old_from_server;
+}
+
 static void	p_quit (const char *from, const char *comm, const char **ArgList)
 {
 	const char *	quit_message;
-	int		one_prints = 1;
-	const char *	chan;
-	int		l;
 
 	if (!(quit_message = ArgList[0]))
 		{ rfc1459_odd(from, comm, ArgList); return; }
 
+	if (!is_netsplit_reason(quit_message))
+	{
+		flush_netsplit();
+		quit_one(from, quit_message, 
+				quit_is_quiet(from, quit_message));
+		return;
+	}
+
+	/* A different netsplit is a different batch */
+	if (netsplit.count && (netsplit.server != from_server || 
+				strcmp(netsplit.reason, quit_message)))
+		flush_netsplit();
+
+	if (netsplit.count == netsplit.size)
+	{
+		netsplit.size = netsplit.size ? netsplit.size * 2 : 64;
+		RESIZE(netsplit.nicks, char *, netsplit.size);
+		RESIZE(netsplit.userhosts, char *, netsplit.size);
+	}
+	if (!netsplit.count)
+	{
+		netsplit.server = from_server;
+		malloc_strcpy(&netsplit.reason, quit_message);
+	}
+	netsplit.nicks[netsplit.count] = malloc_strdup(from);
+	netsplit.userhosts[netsplit.count] = malloc_strdup(FromUserHost);
+	netsplit.count++;
+}
+
+/* Is this QUIT ignored or flooding?  (This counts it for /FLOOD) */
+static int	quit_is_quiet (const char *from, const char *quit_message)
+{
+	if (check_ignore(from, FromUserHost, LEVEL_QUIT) == IGNORED)
+		return 1;
+	if (check_flooding(from, FromUserHost, LEVEL_QUIT, quit_message))
+		return 1;
+	return 0;
+}
+
+/* 
+ * Handle one QUIT (maybe as part of a netsplit).  If 'quiet' is set,
+ * the user doesn't get told about it (see quit_is_quiet()).
+ */
+static void	quit_one (const char *from, const char *quit_message, int quiet)
+{
+	int		one_prints = 1;
+	const char *	chan;
+	int		l;
+
 	/*
 	 * Normally, we do not throw the user a hook until after we
 	 * have taken care of administrative details.  But in this case,
@@ -557,10 +759,7 @@ static void	p_quit (const char *from, const char *comm, const char **ArgList)
 	 * so we cannot remove them from the channel until after we have
 	 * thrown the hook.  That is the only reason this is out of order.
 	 */
-	if (check_ignore(from, FromUserHost, LEVEL_QUIT) == IGNORED)
-		goto remove_quitter;
-
-	if (check_flooding(from, FromUserHost, LEVEL_QUIT, quit_message))
+	if (quiet)
 		goto remove_quitter;
 
 	for (chan = walk_channels(1, from); chan; chan = walk_channels(0, from))
@@ -687,6 +886,10 @@ static void	p_channel (const char *from, const char *comm, const char **ArgList)
 	{
 		add_to_channel(channel, from, from_server, 0, op, vo, ha);
 		add_userhost_to_channel(channel, from, from_server, FromUserHost);
+
+		/* extended-join tells us their account, too */
+		if (ArgList[1] && ArgList[2])
+			set_user_account(from_server, from, ArgList[1]);
 	}
 
 	if (check_ignore_channel(from, FromUserHost, 
@@ -1206,6 +1409,38 @@ static void	p_rpong (const char *from, const char *comm, const char **ArgList)
 		from, target_server, millisecs, delay);
 }
 
+/*
+ * AWAY, ACCOUNT, and CHGHOST are sent to tell you about changes to people
+ * on your channels (if you asked for the away-notify, account-notify, and
+ * chghost capabilities).  We remember what they say, and then let them 
+ * through to the scripts the same way they always were.
+ */
+static void	p_away (const char *from, const char *comm, const char **ArgList)
+{
+	set_user_away(from_server, from, ArgList[0]);
+	rfc1459_odd(from, comm, ArgList);
+}
+
+static void	p_account (const char *from, const char *comm, const char **ArgList)
+{
+	if (ArgList[0])
+		set_user_account(from_server, from, ArgList[0]);
+	rfc1459_odd(from, comm, ArgList);
+}
+
+static void	p_chghost (const char *from, const char *comm, const char **ArgList)
+{
+	char *	userhost;
+
+	if (ArgList[0] && ArgList[1])
+	{
+		userhost = alloca(strlen(ArgList[0]) + strlen(ArgList[1]) + 2);
+		sprintf(userhost, "%s@%s", ArgList[0], ArgList[1]);
+		set_user_userhost(from_server, from, userhost);
+	}
+	rfc1459_odd(from, comm, ArgList);
+}
+
 /* 
  * This is a special subset of server (OPER) notice.
  */
@@ -1460,8 +1695,10 @@ void	rfc1459_odd (const char *from, const char *comm, const char **ArgList)
 }
 
 protocol_command rfc1459[] = {
+{	"ACCOUNT",	p_account,	0		},
 {	"ADMIN",	NULL,		0		},
-{	"AWAY",		NULL,		0		},
+{	"AWAY",		p_away,		0		},
+{	"CHGHOST",	p_chghost,	0		},
 { 	"CONNECT",	NULL,		0		},
 {	"ERROR",	p_error,	0		},
 {	"ERROR:",	p_error,	0		},
@@ -1533,6 +1770,11 @@ void 	parse_server (const char *orig_line, size_t orig_line_size)
 	if (!orig_line || !*orig_line)
 		return;		/* empty line from server -- bye bye */
 
+	/* Anything but another QUIT means the netsplit is over */
+	if (netsplit.count && (netsplit.server != from_server || 
+				!is_quit_line(orig_line)))
+		flush_netsplit();
+
 	if (*orig_line == ':')
 	{
 		if (!do_hook(RAW_IRC_LIST, "%s", orig_line + 1))
@@ -1558,6 +1800,9 @@ void 	parse_server (const char *orig_line, size_t orig_line_size)
 
 	if ((!(comm = *ArgList++)) || !from || !*ArgList)
 	{ 
+		/* An AWAY without a message is away-notify saying "i'm back" */
+		if (comm && from && !strcmp(comm, "AWAY"))
+			set_user_away(from_server, from, NULL);
 		rfc1459_odd(from, comm, ArgList);
 		return;		/* Serious protocol violation -- ByeBye */
 	}
@@ -1568,6 +1813,10 @@ void 	parse_server (const char *orig_line, size_t orig_line_size)
 		return;		
 	}
 
+	/* Remember everyone's userhost as we see it go by */
+	if (*FromUserHost)
+		cache_userhost(from_server, from, FromUserHost);
+
 	/* Some day all this needs to be replaced with an alist. */
 	if (is_number(comm))
 		numbered_command(from, comm, ArgList);
@@ -174,8 +174,7 @@ struct RecodeRule {
 	char *	target_part;
 	ServerInfo si;
 
-	iconv_t	inbound_handle;
-	iconv_t outbound_handle;
+	char *	translit;	/* encoding + "//TRANSLIT", for outbound */
 	int	magic;		/* 0 - can be deleted; 1 - cannot be deleted */
 	int	source;		/* See ENCODING_* below */
 };
@@ -252,8 +251,7 @@ static RecodeRule *	create_recoding_rule (const char *target, const char *encodi
 	r->server_part = NULL;
 	r->target_part = NULL;
 	clear_serverinfo(&r->si);
-	r->inbound_handle = 0;
-	r->outbound_handle = 0;
+	r->translit = NULL;
 	r->source = source;
 	r->magic = magic;
 
@@ -332,13 +330,10 @@ static RecodeRule *	create_recoding_rule (const char *target, const char *encodi
 /* Call this to blow away an encoding. */
 static	int	remove_encoding (int refnum)
 {
-	if (recode_rules[refnum]->inbound_handle != 0)
-		iconv_close(recode_rules[refnum]->inbound_handle);
-	recode_rules[refnum]->inbound_handle = 0;
-	if (recode_rules[refnum]->outbound_handle != 0)
-		iconv_close(recode_rules[refnum]->outbound_handle);
-	recode_rules[refnum]->outbound_handle = 0;
+	invalidate_recode_decisions();
+	flush_iconv_pool();
 
+	new_free(&recode_rules[refnum]->translit);
 	new_free(&recode_rules[refnum]->encoding);
 	new_free(&recode_rules[refnum]->target);
 	new_free((char **)&recode_rules[refnum]);
@@ -377,17 +372,12 @@ static int	update_recoding_encoding (RecodeRule *r, const char *encodingx)
 	/* Indicate the user changed it */
 	r->source = ENCODING_FROM_USER;
 
-	/* Invalidate prior iconv handles */
-	if (r->inbound_handle != 0)
-	{
-		iconv_close(r->inbound_handle);
-		r->inbound_handle = 0;
-	}
-	if (r->outbound_handle != 0)
-	{
-		iconv_close(r->outbound_handle);
-		r->outbound_handle = 0;
-	}
+	/* Whatever we decided before might not be right any more */
+	invalidate_recode_decisions();
+	flush_iconv_pool();
+
+	/* The outbound encoding is derived from the encoding */
+	new_free(&r->translit);
 
 	return 0;
 }
@@ -408,34 +398,45 @@ static int	update_recoding_encoding (RecodeRule *r, const char *encodingx)
  */
 static const char *	check_recoding_iconv (RecodeRule *r, iconv_t *inbound, iconv_t *outbound)
 {
+	iconv_t	handle;
+
+	/*
+	 * The (iconv_t)s come from the iconv pool, which means they are
+	 * only good until the next time somebody asks the pool for one.
+	 * That's ok, because everybody who calls us uses it right away.
+	 */
+
 	/* If requested, provide an (iconv_t) used for messages FROM person */
 	if (inbound)
 	{
-		if (r->inbound_handle == 0)
-			r->inbound_handle = iconv_open("UTF-8", r->encoding);
+		handle = get_iconv_handle("UTF-8", r->encoding);
 
-		if (r->inbound_handle == (iconv_t)-1)
+		if (handle == (iconv_t)-1)
 			say("The inbound encoding %s is not valid", r->encoding);
 		else
-			*inbound = r->inbound_handle;
+			*inbound = handle;
 	}
 
 	/* If requested, provide an (iconv_t) used for messages TO person */
 	if (outbound)
 	{
-	    if (r->outbound_handle == 0)
-	    {
-		char *str;
-
-		str = malloc_strdup2(r->encoding, "//TRANSLIT");
-		if ((r->outbound_handle = iconv_open(str, "UTF-8")) == (iconv_t)-1)
-		    r->outbound_handle = iconv_open(r->encoding, "UTF-8");
-
-		if (r->outbound_handle == (iconv_t)-1)
-			say("The outbound encoding %s is not valid", str);
-		new_free(&str);
-	    }
-	    *outbound = r->outbound_handle;
+		if (!r->translit)
+			r->translit = malloc_strdup2(r->encoding, "//TRANSLIT");
+
+		/*
+		 * If your iconv doesn't do //TRANSLIT for this encoding, 
+		 * then remember that, so we don't try it every time.
+		 */
+		if ((handle = get_iconv_handle(r->translit, "UTF-8")) == (iconv_t)-1)
+		{
+			if ((handle = get_iconv_handle(r->encoding, "UTF-8")) 
+								!= (iconv_t)-1)
+				malloc_strcpy(&r->translit, r->encoding);
+		}
+
+		if (handle == (iconv_t)-1)
+			say("The outbound encoding %s is not valid", r->translit);
+		*outbound = handle;
 	}
 
 	return r->encoding;
@@ -548,6 +549,8 @@ void	init_recodings (void)
  *		  use to translate messages FROM this target.
  *	outbound - If not NULL, filled in with an (iconv_t *) you can
  *		  use to translate messages TO this target.
+ *	Both of these come from the iconv pool -- don't iconv_close() them,
+ *	and don't use them after the next call to get_iconv_handle().
  *
  * Return value:
  *	The encoding we think 'target' is using.  The details of this will
@@ -575,17 +578,16 @@ const char *	find_recoding (const char *target, iconv_t *inbound, iconv_t *outbo
 }
 
 /*
- * decide_encoding - Check recode rules and return the most appropriate one
+ * evaluate_recoding_rules - Check recode rules and pick the most appropriate
  *
  * Arguments:
  *	from	 - Who sent the message.  If we're sending it, should be NULL.
  *	target	 - Who will receive message.  our nick/another nick/channel.
  *	server	 - What server sent to/received from
- *	code	 - A pointer where we can stash the (iconv_t) to use.
  *
  * Return Value:
- *	Returns the "encoding" of most appropriate rule.
- *	Stores into *code an (iconv_t) for the translation you want to do.
+ *	Returns the index into recode_rules of the most appropriate rule,
+ *	or -1 if no rule applies.  Use decide_encoding() instead of this.
  *
  * Notes:
  *	Recode rules are evaluated for the "best match", given this priority.
@@ -610,7 +612,7 @@ const char *	find_recoding (const char *target, iconv_t *inbound, iconv_t *outbo
  *	be used, and I don't want to make it complicated to figure that out.
  *
  */
-static const char *	decide_encoding (const unsigned char *from, const unsigned char *target, int server, iconv_t *code)
+static int	evaluate_recoding_rules (const unsigned char *from, const unsigned char *target, int server)
 {
 	int	i = 0;
 	int	winner = -1;
@@ -807,6 +809,108 @@ target_ok:
 	}
 
 
+	return winner;
+}
+
+/*
+ * The recode decision cache.
+ *
+ * evaluate_recoding_rules() has to look at every rule (and wildcard match
+ * the server part of each rule against all of the server's names) for 
+ * every message.  But the winner for any given (server, sender, target)
+ * only changes when the /ENCODING rules change, or when a server changes
+ * what it is called.  So we remember the winners in a little hash table.
+ *
+ * Rather than clear out the table, invalidate_recode_decisions() bumps
+ * the generation number, and any entry from an older generation is just
+ * treated as a miss.  The keys are compared case sensitively, which is
+ * stricter than the rules are, so the worst that can happen is we have 
+ * more than one entry for somebody.
+ */
+#define RECODE_CACHE_SIZE	256	/* Must be a power of two */
+
+typedef struct RecodeDecisionStru
+{
+	int	generation;	/* 0 means "never used" */
+	int	server;
+	char *	from;		/* NULL for outbound messages */
+	char *	target;
+	int	winner;		/* Index into recode_rules, or -1 */
+} RecodeDecision;
+
+static	RecodeDecision	recode_cache[RECODE_CACHE_SIZE];
+static	int		recode_cache_generation = 1;
+
+void	invalidate_recode_decisions (void)
+{
+	recode_cache_generation++;
+}
+
+static u_32int_t	recode_cache_hash (const unsigned char *from, const unsigned char *target, int server)
+{
+	u_32int_t	hash = 2166136261U;
+
+	hash = (hash ^ (u_32int_t)server) * 16777619U;
+	hash = (hash ^ (from ? 1 : 0)) * 16777619U;
+	for (; from && *from; from++)
+		hash = (hash ^ *from) * 16777619U;
+	hash = (hash ^ (target ? 1 : 0)) * 16777619U;
+	for (; target && *target; target++)
+		hash = (hash ^ *target) * 16777619U;
+	return hash;
+}
+
+static int	same_key (const char *x, const unsigned char *y)
+{
+	if (!x || !y)
+		return x == (const char *)y;
+	return !strcmp(x, (const char *)y);
+}
+
+/*
+ * decide_encoding - Check recode rules and return the most appropriate one
+ *
+ * Arguments:
+ *	from	 - Who sent the message.  If we're sending it, should be NULL.
+ *	target	 - Who will receive message.  our nick/another nick/channel.
+ *	server	 - What server sent to/received from
+ *	code	 - A pointer where we can stash the (iconv_t) to use.
+ *
+ * Return Value:
+ *	Returns the "encoding" of most appropriate rule.
+ *	Stores into *code an (iconv_t) for the translation you want to do.
+ *
+ * Notes:
+ *	See evaluate_recoding_rules() for how the rule is chosen.  The
+ *	choice is remembered until the rules (or the server) change, 
+ *	unless you're debugging (/XDEBUG RECODE), in which case you
+ *	probably want to watch the rules being evaluated every time.
+ */
+static const char *	decide_encoding (const unsigned char *from, const unsigned char *target, int server, iconv_t *code)
+{
+	RecodeDecision *d;
+	int	winner;
+
+	d = &recode_cache[recode_cache_hash(from, target, server) & 
+				(RECODE_CACHE_SIZE - 1)];
+
+	if (!(x_debug & DEBUG_RECODE) && 
+			d->generation == recode_cache_generation &&
+			d->server == server && 
+			same_key(d->from, from) && 
+			same_key(d->target, target))
+		winner = d->winner;
+	else
+	{
+		winner = evaluate_recoding_rules(from, target, server);
+
+		d->generation = recode_cache_generation;
+		d->server = server;
+		malloc_strcpy(&d->from, (const char *)from);
+		malloc_strcpy(&d->target, (const char *)target);
+		d->winner = winner;
+	}
+
 	/*
 	 * If there is no winner (which should only happen if we're
 	 * sending an outbound message), then UTF-8 it is!
@@ -863,10 +967,12 @@ const char *	outbound_recode (const char *to, int server, const char *message, c
 	char *copy;
 
 	/* XXX Creating a copy just to avoid const is bogus */
-	/* XXX Should there be an invalid_utf8str_notrim? */
-	copy = LOCAL_COPY(message);
-	if (invalid_utf8str(copy))
-		yell("WARNING - recoding outbound message, but it is not UTF8.  This will surely do the wrong thing.");
+	if (!valid_utf8str(message))
+	{
+		copy = LOCAL_COPY(message);
+		if (invalid_utf8str(copy))
+			yell("WARNING - recoding outbound message, but it is not UTF8.  This will surely do the wrong thing.");
+	}
 
 	/* If there is no place to put the retval, don't do anything */
 	if (!extra)
@@ -876,7 +982,11 @@ const char *	outbound_recode (const char *to, int server, const char *message, c
 		return message;
 	}
 
-	/* If no recoding is necessary, then we're done. */
+	/* 
+	 * If no recoding is necessary, then we're done. 
+	 * 'i' belongs to the iconv pool, and is only good until the next
+	 * get_iconv_handle(), so use it right away and don't close it.
+	 */
 	if (!(encodingx = decide_encoding(NULL, to, server, &i)))
 	{
 		if (x_debug & DEBUG_RECODE)
@@ -943,7 +1053,17 @@ const char *	inbound_recode (const char *from, int server, const char *to, const
 	 * message to decide what encoding it is
 	 */
 
-	/* The easiest thing is to accept it if it's valid UTF-8 */
+	/* 
+	 * The easiest thing is to accept it if it's valid UTF-8.
+	 * Nearly everything is, so check that without making a copy.
+	 */
+	if (valid_utf8str(message) && !is_iso2022_jp(message))
+	{
+		if (x_debug & DEBUG_RECODE)
+			yell("ib: This message is valid UTF-8, so it's fine.");
+		return message;
+	}
+
 	msg = LOCAL_COPY(message);
 	if (!is_iso2022_jp(msg) && !invalid_utf8str(msg))
 	{
@@ -963,6 +1083,8 @@ const char *	inbound_recode (const char *from, int server, const char *to, const
 	/* If no recoding is necessary, then we're done. */
 	/*
 	 * XXX TODO -- This should be impossible.  A panic is probably better.
+	 * 'i' belongs to the iconv pool, and is only good until the next
+	 * get_iconv_handle(), so use it right away and don't close it.
 	 */
 	if (!(encodingx = decide_encoding(from, to, server, &i)))
 	{
@@ -1013,6 +1135,7 @@ int     ucs_to_console (u_32int_t codepoint, unsigned char *deststr, size_t dest
 	utf8strsiz = ucs_to_utf8(codepoint, utf8str, 16) + 1;
 	source = utf8str;
 
+	/* 'xlat' belongs to the iconv pool -- use it now, don't close it */
 	find_recoding("console", NULL, &xlat);
 	/* XXX What to do is 'xlat' is (iconv_t)-1? */
 	if (xlat == (iconv_t)-1)
@@ -1281,8 +1404,8 @@ int	sanity_check_encoding (const char *encodingx)
 	}
 	iconv_close(ti);
 
-	/* 2b. and can be converted to UTF-8 */
-	ti = iconv_open("UTF-8", encodingx);
+	/* 2b. and can be converted to UTF-8 (this 'ti' belongs to the pool) */
+	ti = get_iconv_handle("UTF-8", encodingx);
 	if (ti == (iconv_t)-1)
 	{
 		say("Unfortunately, your system does not know how to convert the encoding %s to UTF-8", encodingx);
@@ -1306,8 +1429,6 @@ int	sanity_check_encoding (const char *encodingx)
 		}
 	}
 
-	iconv_close(ti);
-
 	if (errors >= 24)
 		return -3;		/* Too many. */
 
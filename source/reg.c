@@ -506,14 +506,10 @@ static int new_match (const unsigned char *pattern, const unsigned char *string)
 }
 
 /*
- * wild_match: calculate the "value" of str when matched against pattern.
- * The "value" of a string is always zero if it is not matched by the pattern.
- * In all cases where the string is matched by the pattern, then the "value"
- * of the match is 1 plus the number of non-wildcard characters in "str".
- *
- * \\[ and \\] handling is an epic extension.
+ * wild_match_uncached: This is the pattern matcher without the pattern 
+ * cache.  It handles the \\[ \\] sets and then interprets the pattern. 
  */
-int wild_match (const char *p, const char *str)
+static int wild_match_uncached (const char *p, const char *str)
 {
 	total_explicit = 0;
 
@@ -593,7 +589,7 @@ int wild_match (const char *p, const char *str)
 				 * The total_explicit we return is whatever
 				 * sub-pattern has the highest total_explicit
 				 */
-				if ((tmpval = wild_match(my_buff, str)))
+				if ((tmpval = wild_match_uncached(my_buff, str)))
 				{
 					if (tmpval > best_total)
 						best_total = tmpval;
@@ -639,6 +635,398 @@ int wild_match (const char *p, const char *str)
 }
 
 
+/*
+ * The pattern cache.
+ *
+ * The same few hundred patterns (ignores, hooks, logfiles, $match(), 
+ * $filter(), $pattern() and so forth) get matched against strings millions
+ * of times, and wild_match_uncached() interprets the pattern from scratch 
+ * on every call, including tearing apart any \[ \] sets.  So instead we
+ * compile each pattern the first time we see it:
+ *
+ *  1. Every \[ \] set is expanded up front into a list of simple "leaf" 
+ *     patterns.  The value of the match is the best value of any leaf,
+ *     which is exactly what the recursive expansion does.
+ *  2. Each leaf is split into its anchored "head" (everything before the
+ *     first * or %) and its literal "tail" (the plain characters after 
+ *     the last * or %).
+ *  3. Leaves with a trivial shape ("literal", "head*", "head%") are
+ *     matched directly.  Everything else has its head and tail checked
+ *     as a cheap prefilter before being handed to new_match().
+ *
+ * The prefilters only reject strings that new_match() would reject, and
+ * the trivial shapes return exactly what new_match() would return.  All
+ * of the backtracking (and all of the bug-for-bug compatability) is still
+ * left up to new_match().  If you change new_match(), revisit this!
+ *
+ * The cache is a small set-associative table, so it never grows without
+ * bound.  /XDEBUG NO_PATTERN_CACHE turns all of this off.
+ */
+#define PATTERN_CACHE_SETS	256	/* Must be a power of two */
+#define PATTERN_CACHE_WAYS	4
+#define PATTERN_MAX_LENGTH	1024	/* Longer patterns aren't cached */
+#define PATTERN_MAX_LEAVES	64	/* Give up on huge \[ \] expansions */
+#define PATTERN_MAX_SCAN	50000	/* Stay well under new_match's sanity */
+
+#define LEAF_NEVER		0	/* Always fails (lone \ at the end) */
+#define LEAF_LITERAL		1	/* No * or % at all */
+#define LEAF_HEAD_STAR		2	/* head* */
+#define LEAF_HEAD_PERCENT	3	/* head% */
+#define LEAF_GENERAL		4	/* Anything else -- use new_match() */
+
+#define HEAD_ANY		(-1)	/* A ? in the head */
+
+typedef struct PatternLeafStru
+{
+	char *	pattern;	/* The leaf pattern, after \[ \] expansion */
+	int	type;		/* One of the LEAF_* values */
+	int *	head;		/* tolower()ed chars before the first wildcard */
+	int	head_len;
+	int	head_value;	/* What new_match() returns after the head */
+	char *	tail;		/* tolower()ed chars after the last wildcard */
+	size_t	tail_len;
+} PatternLeaf;
+
+typedef struct PatternStru
+{
+	char *		pattern;	/* The pattern as given to wild_match */
+	int		nleaves;	/* -1 if this can't be compiled */
+	PatternLeaf *	leaves;
+	int		busy;		/* Being matched right now */
+} Pattern;
+
+static	Pattern *pattern_cache[PATTERN_CACHE_SETS][PATTERN_CACHE_WAYS];
+
+static void	compile_leaf (PatternLeaf *leaf, const char *pattern)
+{
+	const unsigned char *p;
+	int	in_head = 1,
+		runs = 0,
+		percents = 0,
+		lone_backslash = 0,
+		quirky = 0,
+		run_has_star = 0,
+		ends_in_wildcard = 0;
+	size_t	size;
+
+	size = strlen(pattern) + 1;
+	leaf->pattern = malloc_strdup(pattern);
+	leaf->head = new_malloc(sizeof(int) * size);
+	leaf->head_len = 0;
+	leaf->head_value = 1;
+	leaf->tail = new_malloc(size);
+	leaf->tail_len = 0;
+
+	for (p = (const unsigned char *)pattern; *p; )
+	{
+		if (*p == '*' || *p == '%')
+		{
+			in_head = 0;
+			runs++;
+			run_has_star = 0;
+			leaf->tail_len = 0;
+			do
+			{
+				if (*p == '*')
+					run_has_star = 1;
+				else
+					percents++;
+				p++;
+			}
+			while (*p == '*' || *p == '%');
+
+			/*
+			 * new_match() spins until its sanity check fires
+			 * if a %\x runs into a space.  Don't prefilter those,
+			 * so it still gets the chance to complain about it.
+			 */
+			if (!run_has_star && *p == '\\')
+				quirky = 1;
+			ends_in_wildcard = 1;
+			continue;
+		}
+
+		ends_in_wildcard = 0;
+
+		if (*p == '\\')
+		{
+			if (!p[1])
+			{
+				lone_backslash = 1;
+				break;
+			}
+			if (in_head)
+			{
+				leaf->head[leaf->head_len++] = tolower(p[1]);
+				leaf->head_value++;
+			}
+			leaf->tail_len = 0;
+			p += 2;
+		}
+		else if (*p == '?')
+		{
+			if (in_head)
+				leaf->head[leaf->head_len++] = HEAD_ANY;
+			leaf->tail_len = 0;
+			p++;
+		}
+		else
+		{
+			if (in_head)
+			{
+				leaf->head[leaf->head_len++] = tolower(*p);
+				leaf->head_value++;
+			}
+			else
+				leaf->tail[leaf->tail_len++] = tolower(*p);
+			p++;
+		}
+	}
+
+	if (lone_backslash)
+	{
+		leaf->type = percents ? LEAF_GENERAL : LEAF_NEVER;
+		leaf->tail_len = 0;
+	}
+	else if (runs == 0)
+		leaf->type = LEAF_LITERAL;
+	else if (runs == 1 && ends_in_wildcard)
+		leaf->type = run_has_star ? LEAF_HEAD_STAR : LEAF_HEAD_PERCENT;
+	else
+		leaf->type = LEAF_GENERAL;
+
+	if (quirky)
+		leaf->tail_len = 0;
+}
+
+static void	destroy_leaf (PatternLeaf *leaf)
+{
+	new_free(&leaf->pattern);
+	new_free(&leaf->head);
+	new_free(&leaf->tail);
+}
+
+/*
+ * Expand the \[ \] sets the same way wild_match_uncached() does, except
+ * instead of matching each sub-pattern, we compile it into a leaf.
+ */
+static int	expand_pattern (Pattern *pat, const char *p)
+{
+	if (strstr(p, "\\["))
+	{
+		char *pattern, *ptr, *ptr2, *arg, *placeholder;
+		int nest = 0;
+
+		pattern = LOCAL_COPY(p);
+		placeholder = ptr = ptr2 = strstr(pattern, "\\[");
+		do
+		{
+			switch (ptr[1]) 
+			{
+				case '[' :  ptr2 = ptr + 2 ;
+					    nest++;
+					    break;
+				case ']' :  ptr2 = ptr + 2;
+					    nest--;
+					    break;
+				default:
+					    ptr2 = ptr + 2;
+					    break;
+			}
+		}
+		while (nest && (ptr = strchr(ptr2, '\\')));
+
+		if (ptr)
+		{
+			*ptr = 0;
+			ptr += 2;
+			*placeholder = 0;
+			placeholder += 2;
+
+			while ((arg = new_next_arg(placeholder, &placeholder)))
+			{
+				char my_buff[BIG_BUFFER_SIZE + 1];
+
+				strlcpy(my_buff, pattern, sizeof my_buff);
+				strlcat(my_buff, arg, sizeof my_buff);
+				strlcat(my_buff, ptr, sizeof my_buff);
+
+				if (expand_pattern(pat, my_buff) < 0)
+					return -1;
+			}
+			return 0;
+		}
+	}
+
+	if (pat->nleaves >= PATTERN_MAX_LEAVES)
+		return -1;
+
+	RESIZE(pat->leaves, PatternLeaf, pat->nleaves + 1);
+	compile_leaf(&pat->leaves[pat->nleaves++], p);
+	return 0;
+}
+
+static void	destroy_pattern (Pattern **pat)
+{
+	int	i;
+
+	for (i = 0; i < (*pat)->nleaves; i++)
+		destroy_leaf(&(*pat)->leaves[i]);
+	new_free(&(*pat)->leaves);
+	new_free(&(*pat)->pattern);
+	new_free(pat);
+}
+
+/*
+ * Returns the compiled version of 'p', compiling it if neccesary,
+ * or NULL if it can't (or shouldn't) be compiled.  
+ */
+static Pattern *	get_pattern (const char *p)
+{
+	Pattern **	set;
+	Pattern *	pat;
+	u_32int_t	hash = 2166136261U;
+	const unsigned char *s;
+	int		i;
+
+	for (s = (const unsigned char *)p; *s; s++)
+		hash = (hash ^ *s) * 16777619U;
+	set = pattern_cache[hash & (PATTERN_CACHE_SETS - 1)];
+
+	for (i = 0; i < PATTERN_CACHE_WAYS; i++)
+	{
+		if (!set[i])
+			break;
+		if (!strcmp(set[i]->pattern, p))
+		{
+			/* Move it to the front of the set */
+			pat = set[i];
+			for (; i > 0; i--)
+				set[i] = set[i - 1];
+			set[0] = pat;
+			return pat->nleaves < 0 ? NULL : pat;
+		}
+	}
+
+	/* 
+	 * Evict the least recently used entry, unless it's in the middle
+	 * of being matched (new_match() can yell, and yells can be hooked).
+	 */
+	if (i == PATTERN_CACHE_WAYS)
+	{
+		if (set[--i]->busy)
+			return NULL;
+		destroy_pattern(&set[i]);
+	}
+	for (; i > 0; i--)
+		set[i] = set[i - 1];
+
+	pat = set[0] = new_malloc(sizeof(Pattern));
+	pat->pattern = malloc_strdup(p);
+	pat->nleaves = 0;
+	pat->leaves = NULL;
+	pat->busy = 0;
+
+	if (expand_pattern(pat, p) < 0)
+	{
+		for (i = 0; i < pat->nleaves; i++)
+			destroy_leaf(&pat->leaves[i]);
+		new_free(&pat->leaves);
+		pat->nleaves = -1;
+		return NULL;
+	}
+	return pat;
+}
+
+/*
+ * Walk the head of 'leaf' against 'str'.  Returns the rest of the string,
+ * or NULL if the head doesn't match (which means new_match() would fail).
+ */
+static const unsigned char *	match_head (PatternLeaf *leaf, const unsigned char *str)
+{
+	int	i;
+
+	for (i = 0; i < leaf->head_len; i++, str++)
+	{
+		if (!*str)
+			return NULL;
+		if (leaf->head[i] != HEAD_ANY && leaf->head[i] != tolower(*str))
+			return NULL;
+	}
+	return str;
+}
+
+static int	match_leaf (PatternLeaf *leaf, const char *string)
+{
+	const unsigned char *s;
+	size_t	len, i;
+
+	if (leaf->type == LEAF_NEVER)
+		return 0;
+	if (!(s = match_head(leaf, (const unsigned char *)string)))
+		return 0;
+
+	switch (leaf->type)
+	{
+		case LEAF_LITERAL:
+			return *s ? 0 : leaf->head_value;
+
+		case LEAF_HEAD_STAR:
+			return leaf->head_value;
+
+		case LEAF_HEAD_PERCENT:
+			for (i = 0; s[i]; i++)
+			{
+				if (isspace(s[i]))
+					return 0;
+				if (i > PATTERN_MAX_SCAN)
+					return new_match(leaf->pattern, string);
+			}
+			return leaf->head_value;
+
+		default:
+			if (leaf->tail_len)
+			{
+				len = strlen(s);
+				if (len < leaf->tail_len)
+					return 0;
+				s += len - leaf->tail_len;
+				for (i = 0; i < leaf->tail_len; i++)
+					if ((char)tolower(s[i]) != leaf->tail[i])
+						return 0;
+			}
+			return new_match(leaf->pattern, string);
+	}
+}
+
+/*
+ * wild_match: calculate the "value" of str when matched against pattern.
+ * The "value" of a string is always zero if it is not matched by the pattern.
+ * In all cases where the string is matched by the pattern, then the "value"
+ * of the match is 1 plus the number of non-wildcard characters in "str".
+ *
+ * \\[ and \\] handling is an epic extension.
+ */
+int wild_match (const char *p, const char *str)
+{
+	Pattern *	pat;
+	int		i, value, best_total = 0;
+
+	/* The debugging modes want to see the interpreter do its thing */
+	if (x_debug & (DEBUG_REGEX | DEBUG_REGEX_DEBUG | DEBUG_NO_PATTERN_CACHE))
+		return wild_match_uncached(p, str);
+	if (strlen(p) > PATTERN_MAX_LENGTH || !(pat = get_pattern(p)))
+		return wild_match_uncached(p, str);
+
+	pat->busy++;
+	for (i = 0; i < pat->nleaves; i++)
+		if ((value = match_leaf(&pat->leaves[i], str)) > best_total)
+			best_total = value;
+	pat->busy--;
+
+	return best_total;
+}
+
 /*
  * Hrm.  Here's the plan -- can we convert ircII patterns to normal
  * regexes?  Well, the syntax should be pretty simple, right?
@@ -767,3 +1155,239 @@ char *	pattern2regex (const char *pattern, int *weight)
 	return retval;
 }
 
+
+/*
+ * TRIGRAM SIGNATURES
+ *
+ * When you search a big lastlog or scrollback, almost every line fails to
+ * match, and we can usually tell that without running wild_match() or 
+ * regexec().  Almost every pattern has some text in it that the line must
+ * contain ("*foobar*" needs "foo", "oob", "oba", and "bar"), so if we keep
+ * a bitmap of the 3 character sequences that show up in some lines, we can
+ * skip those lines when one of the ones we need isn't in the bitmap.
+ * Sometimes a bit is on for some other 3 characters, so this can only tell
+ * you that a line *can't* match -- it never tells you it *does* match.
+ *
+ * Everything is folded with tolower(), the same way wild_match() and 
+ * REG_ICASE do.  Patterns never ask for anything with a non-ascii byte in
+ * it, because REG_ICASE folds those in ways that tolower() does not.
+ * 'nbits' must always be a power of two.
+ */
+static u_32int_t	trigram_hash (const unsigned char *p)
+{
+	u_32int_t	h;
+
+	h = ((u_32int_t)tolower(p[0]) << 16) | 
+	    ((u_32int_t)tolower(p[1]) << 8) | 
+	     (u_32int_t)tolower(p[2]);
+	h *= 2654435761U;
+	return h ^ (h >> 15);
+}
+
+/* Turn on the bits for every 3 character sequence in 'str' */
+void	trigram_signature_add (unsigned char *bits, size_t nbits, const char *str)
+{
+	const unsigned char *p = (const unsigned char *)str;
+	u_32int_t	h;
+
+	if (!p || !p[0] || !p[1])
+		return;
+
+	for (; p[2]; p++)
+	{
+		h = trigram_hash(p) & (nbits - 1);
+		bits[h >> 3] |= 1 << (h & 7);
+	}
+}
+
+/* Could something with this signature contain all of the 'keys'? */
+int	trigram_signature_test (const unsigned char *bits, size_t nbits, const u_32int_t *keys, int nkeys)
+{
+	u_32int_t	h;
+	int		i;
+
+	for (i = 0; i < nkeys; i++)
+	{
+		h = keys[i] & (nbits - 1);
+		if (!(bits[h >> 3] & (1 << (h & 7))))
+			return 0;
+	}
+	return 1;
+}
+
+static int	trigram_run (const unsigned char *run, size_t len, u_32int_t *keys, int nkeys, int max)
+{
+	size_t	i;
+
+	for (i = 0; i + 3 <= len && nkeys < max; i++)
+	{
+		if (run[i] >= 0x80 || run[i+1] >= 0x80 || run[i+2] >= 0x80)
+			continue;
+		keys[nkeys++] = trigram_hash(run + i);
+	}
+	return nkeys;
+}
+
+/*
+ * wild_match_trigrams - Which trigrams must a string have if it is going
+ * to be matched by the wild_match() pattern 'pattern'?  Up to 'max' of
+ * them are put into 'keys', and the return value is how many there are.
+ * A return value of 0 means it can't tell you anything.
+ */
+int	wild_match_trigrams (const char *pattern, u_32int_t *keys, int max)
+{
+	const unsigned char *p = (const unsigned char *)pattern;
+	const unsigned char *run;
+	int	nkeys = 0;
+
+	/* Don't try to figure out \[...\] and friends */
+	if (!p || strchr(pattern, '\\'))
+		return 0;
+
+	while (*p)
+	{
+		while (*p == '*' || *p == '%' || *p == '?')
+			p++;
+		for (run = p; *p && *p != '*' && *p != '%' && *p != '?'; p++)
+			;
+		nkeys = trigram_run(run, p - run, keys, nkeys, max);
+	}
+	return nkeys;
+}
+
+/*
+ * Skip the [bracket expression] at 'p', and return whatever comes after
+ * the ].  []abc] and [[:alpha:]] are tricky, and a \ is just a \ in there.
+ */
+static const unsigned char *	skip_bracket (const unsigned char *p)
+{
+	p++;
+	if (*p == '^')
+		p++;
+	if (*p == ']')
+		p++;
+	for (; *p && *p != ']'; p++)
+	{
+		if (*p == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '='))
+		{
+			const unsigned char *end;
+			char	close[3] = { p[1], ']', 0 };
+
+			if ((end = (const unsigned char *)strstr((const char *)p + 2, close)))
+				p = end + 1;
+		}
+	}
+	if (*p)
+		p++;
+	return p;
+}
+
+/*
+ * regex_trigrams - Like wild_match_trigrams(), but for an extended
+ * regex.  This only looks at the plain text outside of any (groups) 
+ * or [brackets], and gives up entirely if there is a | anywhere outside
+ * of a group, so it's pretty conservative.
+ */
+int	regex_trigrams (const char *regex, u_32int_t *keys, int max)
+{
+	const unsigned char *p = (const unsigned char *)regex;
+	const unsigned char *q;
+	unsigned char	run[BIG_BUFFER_SIZE];
+	size_t	len = 0;
+	int	nkeys = 0;
+	int	c, depth;
+
+	if (!p)
+		return 0;
+
+	while (*p)
+	{
+		if (*p == '|')
+			return 0;
+
+		/* Groups are skipped entirely */
+		if (*p == '(')
+		{
+			nkeys = trigram_run(run, len, keys, nkeys, max);
+			len = 0;
+			for (depth = 0; *p; p++)
+			{
+				/* A ) in [brackets] doesn't end the group */
+				while (*p == '[')
+					p = skip_bracket(p);
+				if (!*p)
+					break;
+
+				if (*p == '\\' && p[1])
+					p++;
+				else if (*p == '(')
+					depth++;
+				else if (*p == ')' && --depth == 0)
+					break;
+			}
+			if (*p)
+				p++;
+			continue;
+		}
+
+		/* So are brackets */
+		if (*p == '[')
+		{
+			nkeys = trigram_run(run, len, keys, nkeys, max);
+			len = 0;
+			p = skip_bracket(p);
+			continue;
+		}
+
+		if (*p == '.' || *p == '^' || *p == '$' || *p == ')' ||
+		    *p == '*' || *p == '+' || *p == '?' || *p == '{')
+		{
+			nkeys = trigram_run(run, len, keys, nkeys, max);
+			len = 0;
+			if (*p == '{' && strchr((const char *)p, '}'))
+				p = (const unsigned char *)strchr((const char *)p, '}');
+			p++;
+			continue;
+		}
+
+		/* 
+		 * \. is a literal dot, but \w and \1 and \< (and whatever
+		 * else regcomp() likes to think \something means) aren't.
+		 */
+		if (*p == '\\')
+		{
+			if (!p[1] || !strchr(".[]()*+?{}|^$\\", p[1]))
+			{
+				nkeys = trigram_run(run, len, keys, nkeys, max);
+				len = 0;
+				p += p[1] ? 2 : 1;
+				continue;
+			}
+			p++;
+		}
+
+		c = *p++;
+
+		/* a* and a? and a{0,1} (and a+*) mean 'a' might not be there. */
+		for (q = p; *q == '+'; q++)
+			;
+		if (*q == '*' || *q == '?' || *q == '{')
+		{
+			nkeys = trigram_run(run, len, keys, nkeys, max);
+			len = 0;
+			continue;
+		}
+
+		if (len < sizeof(run))
+			run[len++] = c;
+
+		/* a+ means there's at least one 'a', but then who knows */
+		if (*p == '+')
+		{
+			nkeys = trigram_run(run, len, keys, nkeys, max);
+			len = 0;
+		}
+	}
+
+	return trigram_run(run, len, keys, nkeys, max);
+}
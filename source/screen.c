@@ -2736,6 +2736,177 @@ void 	add_to_screen (const unsigned char *buffer)
 	return;
 }
 
+/*
+ * Every line that goes to a window gets normalized by everybody who
+ * touches it -- the display wants it marshalled, and the window's log and
+ * each /LOG watching it want it un-normalized with their own mangler.
+ * So add_to_window() marshalls the line for the display first, and keeps
+ * each form it has made here while it's working on the line.  After that,
+ * normalize_output_line() hands back a form that was already done, or
+ * makes the un-normalized form out of the display's copy (which is just
+ * a matter of turning the attribute markers back into ^B's and ^C's)
+ * instead of going over the original line again.  These nest, because 
+ * putting out one line can cause other lines to be put out.
+ */
+#define MAX_LINE_VIEWS	4
+typedef struct LineViewsStru {
+	const unsigned char *	line;
+	int			count;
+	struct {
+		int		logical;
+		int		mangler;
+		unsigned char *	result;
+	}			view[MAX_LINE_VIEWS];
+	struct LineViewsStru *	prev;
+} LineViews;
+
+static	LineViews *	line_views = NULL;
+
+/*
+ * These manglers only ever take attributes away, so if a log wants more
+ * of them than the display does, it can take them out of the display's
+ * copy.  STRIP_REVERSE isn't one of them, because unprintable chars are
+ * shown in reverse even when you strip reverse.
+ */
+#define ATTRIBUTE_STRIPS	(STRIP_COLOR | STRIP_UNDERLINE | STRIP_BOLD | \
+				 STRIP_BLINK | STRIP_ALT_CHAR | STRIP_ITALIC)
+
+/*
+ * Can new_normalize_string(str, 1, to) be made out of 
+ * new_normalize_string(str, 0, from)?  Only if they agree on everything
+ * except which attributes to strip, and 'to' strips everything 'from' 
+ * does.  Without NORMALIZE, STRIP_COLOR decides whether ^C is even read
+ * as a color, so then they have to agree on that too.
+ */
+static int	can_derive_view (int from, int to)
+{
+	if ((from ^ to) & ~ATTRIBUTE_STRIPS)
+		return 0;
+	if (from & ~to & ATTRIBUTE_STRIPS)
+		return 0;
+	if (!(from & NORMALIZE) && ((from ^ to) & STRIP_COLOR))
+		return 0;
+	return 1;
+}
+
+/*
+ * derive_logical_view -- denormalize_string() for a display line
+ * Arguments:
+ *   str	A string returned by new_normalize_string() with logical == 0
+ *   mangle	A mangler that can_derive_view() says is ok.
+ * Return Value:
+ *	The same thing new_normalize_string(<orig>, 1, mangle) would have
+ *	returned.  The attributes 'mangle' strips are taken out, and the 
+ *	"all off" that's always at the end of a display line is left off.
+ */
+static unsigned char *	derive_logical_view (const unsigned char *str, int mangle)
+{
+	unsigned char *	output;
+const	unsigned char *	end;
+	size_t		maxpos;
+	size_t		pos;
+	Attribute	olda, a;
+
+	a.bold = a.underline = a.reverse = a.blink = a.altchar = 0;
+	a.italic = 0;
+	a.color_fg = a.color_bg = a.fg_color = a.bg_color = 0;
+	olda = a;
+
+	maxpos = strlen(str);
+	end = str + maxpos;
+	if (maxpos >= 5 && end[-5] == '\006')
+		end -= 5;
+
+	output = (unsigned char *)new_malloc(maxpos + 192);
+	pos = 0;
+
+	while (str < end)
+	{
+		if (pos > maxpos)
+		{
+			maxpos += 192; /* Extend 192 chars at a time */
+			RESIZE(output, unsigned char, maxpos + 192);
+		}
+
+		if (*str == '\006' && read_attributes(str, &a) == 0)
+		{
+			str += 5;
+			if (mangle & STRIP_UNDERLINE)	a.underline = 0;
+			if (mangle & STRIP_BOLD)	a.bold = 0;
+			if (mangle & STRIP_BLINK)	a.blink = 0;
+			if (mangle & STRIP_ALT_CHAR)	a.altchar = 0;
+			if (mangle & STRIP_ITALIC)	a.italic = 0;
+			if (mangle & STRIP_COLOR)
+			{
+				a.color_fg = a.color_bg = 0;
+				a.fg_color = a.bg_color = 0;
+			}
+			pos += logic_attributes(output + pos, &olda, &a);
+		}
+		else
+			output[pos++] = *str++;
+	}
+	output[pos] = output[pos + 1] = 0;
+	return output;
+}
+
+/*
+ * normalize_output_line -- new_normalize_string(), but only once per line
+ * Arguments:
+ *   str	The line to be normalized
+ *   logical	Same as new_normalize_string()
+ *   mangler	Same as new_normalize_string()
+ *   free_me	Set to the return value if you have to new_free() it,
+ *		or NULL if it's shared with everybody else.
+ * Return Value:
+ *	The normalized string.  Don't write into it!
+ */
+const unsigned char *	normalize_output_line (const unsigned char *str, int logical, int mangler, unsigned char **free_me)
+{
+	LineViews *	v;
+	unsigned char *	result;
+	int		i;
+
+	*free_me = NULL;
+	if ((v = line_views) && v->line != str)
+		v = NULL;
+
+	if (v)
+	{
+		for (i = 0; i < v->count; i++)
+			if (v->view[i].logical == logical && 
+			    v->view[i].mangler == mangler)
+				return v->view[i].result;
+	}
+
+	result = NULL;
+	if (v && logical == 1)
+	{
+		for (i = 0; i < v->count; i++)
+		{
+			if (v->view[i].logical == 0 && 
+			    can_derive_view(v->view[i].mangler, mangler))
+			{
+				result = derive_logical_view(v->view[i].result, mangler);
+				break;
+			}
+		}
+	}
+	if (!result)
+		result = new_normalize_string(str, logical, mangler);
+
+	if (v && v->count < MAX_LINE_VIEWS)
+	{
+		v->view[v->count].logical = logical;
+		v->view[v->count].mangler = mangler;
+		v->view[v->count].result = result;
+		v->count++;
+	}
+	else
+		*free_me = result;
+	return result;
+}
+
 /*
  * add_to_window: Given a window and a line to display, this handles all
  * of the window-level stuff like the logfile, the lastlog, splitting
@@ -2753,8 +2924,11 @@ void 	add_to_screen (const unsigned char *buffer)
 static void 	add_to_window (Window *window, const unsigned char *str)
 {
 	char *		pend;
-	unsigned char *	strval;
+const	unsigned char *	strval;
+	unsigned char *	free_strval;
 	unsigned char *	free_me = NULL;
+	LineViews	views;
+	int		i;
         unsigned char **       my_lines;
         int             cols;
 	int		numl = 0;
@@ -2794,6 +2968,16 @@ static void 	add_to_window (Window *window, const unsigned char *str)
 	    recursion--;
 	}
 
+	/* 
+	 * Everybody below shares the normalized forms of this line, and 
+	 * the logs make theirs out of the display's, so do that one first.
+	 */
+	views.line = str;
+	views.count = 0;
+	views.prev = line_views;
+	line_views = &views;
+	strval = normalize_output_line(str, 0, display_line_mangler, &free_strval);
+
 	/* Add to logs + lastlog... */
 	if (window->log_rewrite)
 		rewriter = window->log_rewrite;
@@ -2805,14 +2989,17 @@ static void 	add_to_window (Window *window, const unsigned char *str)
 
 	/* Add to scrollback + display... */
 	cols = window->my_columns;	/* Don't -1 this! already -1'd */
-	strval = new_normalize_string(str, 0, display_line_mangler);
         for (my_lines = prepare_display(window->refnum, strval, cols, &numl, 0); *my_lines; my_lines++)
 	{
 		if (add_to_scrollback(window, *my_lines, refnum))
 		    if (ok_to_output(window))
 			rite(window, *my_lines);
 	}
-	new_free(&strval);
+	new_free(&free_strval);
+
+	line_views = views.prev;
+	for (i = 0; i < views.count; i++)
+		new_free(&views.view[i].result);
 
 	/* Check the status of the window and scrollback */
 	check_window_cursor(window);
@@ -2882,6 +3069,31 @@ void 	add_to_window_scrollback (Window *window, const unsigned char *str, intmax
 	new_free(&strval);
 }
 
+/*
+ * prepend_to_window_scrollback: The same thing, but the line goes in at
+ * the top of the scrollback (above everything else) instead of at the 
+ * bottom.  This is how a resized window gets its older lines back.  If 
+ * we still have this line broken up at this width, we use that instead.
+ * Returns the number of rows that were added.
+ */
+int	prepend_to_window_scrollback (Window *window, const unsigned char *str, intmax_t refnum)
+{
+	unsigned char *	strval;
+        unsigned char **       my_lines;
+        int             cols;
+	int		numl = 0;
+
+	if ((numl = reuse_scrollback_rows(window, refnum)) > 0)
+		return numl;
+
+	cols = window->my_columns;	/* Don't -1 this! Already -1'd! */
+	strval = new_normalize_string(str, 0, display_line_mangler);
+	my_lines = prepare_display(window->refnum, strval, cols, &numl, 0);
+	numl = prepend_to_scrollback(window, my_lines, refnum);
+	new_free(&strval);
+	return numl;
+}
+
 /*
  * This returns 1 if the window does not need to scroll for new output.
  * This returns 0 if the window does need to scroll for new output.
@@ -3108,7 +3320,7 @@ void 	repaint_window_body (Window *window)
 			break;
 		}
 
-		curr_line = curr_line->next;
+		curr_line = window_display_line(window, curr_line->count + 1);
 	}
 
 	global_beep_ok = 1;		/* Suppress beeps */
@@ -3768,6 +3980,7 @@ static	int		never_warn_again = 0;
 	out = dest_ptr;
 	outlen = sizeof dest_ptr - 1;
 
+	/* 'xlat' belongs to the iconv pool -- use it now, don't close it */
 	enc = find_recoding("console", &xlat, NULL);
 
 	/* Very crude, ad-hoc check for UTF8 type things */
@@ -133,6 +133,8 @@ static	void	free_serverinfo (ServerInfo *s);
 static	int	serverinfo_to_servref (ServerInfo *s);
 static	int	serverinfo_to_newserv (ServerInfo *s);
 static 	void 	remove_from_server_list (int i);
+static	void	server_names_changed (int refnum);
+static	int	serverinfo_to_servref_by_name (ServerInfo *si);
 static	char *	shortname (const char *oname);
 static void	set_server_uh_addr (int refnum);
 
@@ -644,6 +646,10 @@ static	int	serverinfo_to_servref (ServerInfo *si)
 	if (!si->host)
 		return NOSERV;
 
+	/* Without any wildcards, we don't have to look at every server */
+	if (!strpbrk(si->host, "*?%\\"))
+		return serverinfo_to_servref_by_name(si);
+
 	for (opened = 1; opened >= 0; opened--)
 	{
 	    for (i = 0; i < number_of_servers; i++)
@@ -667,6 +673,7 @@ static	void	update_refnum_serverinfo (int refnum, ServerInfo *new_si)
 		return;
 
 	update_serverinfo(s->info, new_si);
+	server_names_changed(refnum);
 
 	/* If the user asked for a specific nick, use it as the default */
 	if (!empty(new_si->nick))
@@ -793,11 +800,170 @@ static	int	serverinfo_to_newserv (ServerInfo *si)
 
 	make_notify_list(i);
 	make_005(i);
+	rebuild_prefix_list(i);
+	server_names_changed(i);
 
 	set_server_status(i, SERVER_RECONNECT);
 	return i;
 }
 
+/*
+ * The server name index
+ *
+ * Scripts look up servers by name all the time ($serverctl(), /msg -server,
+ * /window server, etc) and almost always they use the exact name of the
+ * server, not a wildcard pattern.  Rather than wild_match() that against
+ * every name of every server, we keep a hash table of every name (ourname,
+ * itsname, group, 005 NETWORK, and altnames) of every server, which tells
+ * us which servers could possibly match.
+ *
+ * The index is thrown away whenever any server's names change (see 
+ * server_names_changed()), and rebuilt the next time someone looks.
+ * Names are hashed the way wild_match() compares them (with tolower()).
+ */
+typedef struct	server_name_stru
+{
+struct	server_name_stru *next;
+	u_32int_t	hash;
+	char *		name;
+	int		refnum;
+}	ServerName;
+
+static	ServerName **	server_name_index = NULL;
+static	int		server_name_index_size = 0;
+static	int		server_name_index_dirty = 1;
+
+/*
+ * server_names_changed - Called whenever a server's identity changes
+ *
+ * Anything that remembers which server an "ourname", "itsname", group,
+ * altname, or 005 NETWORK referred to needs to forget about it when
+ * any of those change, or when a server is created or deleted.
+ */
+static	void	server_names_changed (int refnum)
+{
+	invalidate_recode_decisions();
+	server_name_index_dirty = 1;
+}
+
+static u_32int_t	server_name_hash (const char *name)
+{
+	const unsigned char *s = (const unsigned char *)name;
+	u_32int_t	hash = 2166136261U;
+
+	for (; *s; s++)
+		hash = (hash ^ (u_32int_t)tolower(*s)) * 16777619U;
+	return hash;
+}
+
+static void	index_server_name (int refnum, const char *name)
+{
+	ServerName *	n;
+	int		bucket;
+
+	if (empty(name))
+		return;
+
+	n = (ServerName *)new_malloc(sizeof(ServerName));
+	n->hash = server_name_hash(name);
+	n->name = malloc_strdup(name);
+	n->refnum = refnum;
+	bucket = n->hash & (server_name_index_size - 1);
+	n->next = server_name_index[bucket];
+	server_name_index[bucket] = n;
+}
+
+static void	rebuild_server_name_index (void)
+{
+	ServerName *	n;
+	Server *	s;
+	int		i, j, count;
+
+	for (i = 0; i < server_name_index_size; i++)
+	{
+		while ((n = server_name_index[i]))
+		{
+			server_name_index[i] = n->next;
+			new_free(&n->name);
+			new_free((char **)&n);
+		}
+	}
+
+	for (count = 0, i = 0; i < number_of_servers; i++)
+		if ((s = get_server(i)))
+			count += 4 + s->altnames->numitems;
+
+	if (server_name_index_size < count || !server_name_index_size)
+	{
+		for (server_name_index_size = 64; 
+		     server_name_index_size < count; 
+		     server_name_index_size *= 2)
+			;
+		RESIZE(server_name_index, ServerName *, server_name_index_size);
+		for (i = 0; i < server_name_index_size; i++)
+			server_name_index[i] = NULL;
+	}
+
+	for (i = 0; i < number_of_servers; i++)
+	{
+		if (!(s = get_server(i)) || !s->info || !s->info->host)
+			continue;
+
+		index_server_name(i, s->info->host);
+		index_server_name(i, s->itsname);
+		index_server_name(i, s->info->group);
+		index_server_name(i, get_server_005(i, "NETWORK"));
+		for (j = 0; j < s->altnames->numitems; j++)
+			index_server_name(i, s->altnames->list[j].name);
+	}
+
+	server_name_index_dirty = 0;
+}
+
+/*
+ * serverinfo_to_servref_by_name - The fast version of serverinfo_to_servref
+ * for when 'si' names a server without using any wildcards.  This gives
+ * the same answer as the slow version: an open server before a closed one,
+ * and the lowest refnum of those.
+ */
+static	int	serverinfo_to_servref_by_name (ServerInfo *si)
+{
+	ServerName *	n;
+	u_32int_t	hash;
+	int		best[2] = { NOSERV, NOSERV };
+	int		opened;
+
+	if (server_name_index_dirty)
+		rebuild_server_name_index();
+
+	hash = server_name_hash(si->host);
+	for (n = server_name_index[hash & (server_name_index_size - 1)]; n; 
+			n = n->next)
+	{
+		if (n->hash != hash || my_stricmp(n->name, si->host))
+			continue;
+		if (!serverinfo_matches_servref(si, n->refnum))
+			continue;
+		opened = is_server_open(n->refnum) ? 1 : 0;
+		if (best[opened] == NOSERV || n->refnum < best[opened])
+			best[opened] = n->refnum;
+	}
+
+	/* The "hostname" might be a refnum, too */
+	if (is_number(si->host) && serverinfo_matches_servref(si, atol(si->host)))
+	{
+		int refnum = atol(si->host);
+
+		opened = is_server_open(refnum) ? 1 : 0;
+		if (best[opened] == NOSERV || refnum < best[opened])
+			best[opened] = refnum;
+	}
+
+	if (best[1] != NOSERV)
+		return best[1];
+	return best[0];
+}
+
 /***************************************************************************/
 int	str_to_servref (const char *desc)
 {
@@ -876,6 +1042,7 @@ static 	void 	remove_from_server_list (int i)
 
 	say("Deleting server [%d]", i);
 	set_server_status(i, SERVER_DELETED);
+	server_names_changed(i);
 
 	clean_server_queues(i);
 	new_free(&s->itsname);
@@ -2281,6 +2448,9 @@ void	close_server (int refnum, const char *message)
 		return;
 	}
 
+	/* Finish off any netsplit before the channels go away */
+	flush_netsplit();
+
 	*final_message = 0;
 	if (!message)
 	    if (!(message = get_server_quit_message(refnum)))
@@ -2779,6 +2949,8 @@ void	server_is_unregistered (int refnum)
 		return;
 
 	destroy_005(refnum);
+	rebuild_prefix_list(refnum);
+	notify_server_reset(refnum);
 	set_server_status(refnum, SERVER_EOF);
 }
 
@@ -3369,6 +3541,7 @@ void	set_server_name (int servref, const char * param )
 
 	s->info->host = param;
 	preserve_serverinfo(s->info);
+	server_names_changed(servref);
 }
 
 const char *	get_server_name (int servref )
@@ -3396,6 +3569,7 @@ void	set_server_group (int servref, const char * param )
 
 	s->info->group = param;
 	preserve_serverinfo(s->info);
+	server_names_changed(servref);
 }
 
 const char *	get_server_group (int servref)
@@ -3469,7 +3643,17 @@ const char *	get_server_vhost (int servref )
 /* 
  * Getter and setter for "itsname"
  */
-SET_SATTRIBUTE(name, itsname)
+void	set_server_itsname (int servref, const char * name)
+{
+	Server *s;
+
+	if (!(s = get_server(servref)))
+		return;
+
+	malloc_strcpy(&s->itsname, name);
+	server_names_changed(servref);
+}
+
 const char	*get_server_itsname (int refnum)
 {
 	Server *s;
@@ -3778,6 +3962,7 @@ static void	add_server_altname (int refnum, char *altname)
 
 	v = malloc_strdup(altname);
 	add_to_bucket(s->altnames, v, NULL);
+	server_names_changed(refnum);
 }
 
 /*
@@ -3813,6 +3998,7 @@ static void	reset_server_altnames (int refnum, char *new_altnames)
 		new_free((char **)(intptr_t)&s->altnames->list[i].name);	
 
 	s->altnames->numitems = 0;
+	server_names_changed(refnum);
 
 	while ((value = new_next_arg(new_altnames, &new_altnames)))
 		add_server_altname(refnum, value);
@@ -4040,6 +4226,7 @@ void	destroy_005 (int refnum)
 	s->a005.max = 0;
 	s->a005.total_max = 0;
 	new_free(&s->a005.list);
+	server_names_changed(refnum);	/* NETWORK is gone */
 }
 
 /*
@@ -4175,6 +4362,12 @@ void	set_server_005 (int refnum, char *setting, const char *value)
 	    else
 		set_server_stricmp_table(refnum, 1);
 	}
+	else if (!my_stricmp(setting, "NETWORK"))
+		server_names_changed(refnum);
+	else if (!my_stricmp(setting, "PREFIX"))
+		rebuild_prefix_list(refnum);
+	else if (!my_stricmp(setting, "CHANTYPES"))
+		invalidate_recode_decisions();	/* is_channel() changed */
 
 	update_all_status();
 }
@@ -4227,18 +4420,15 @@ sorry_wrong_number:
 char	*validprefixes	(char *input)
 {
 	int refnum;
-	const char *ptochars; char *ptobrack;
+	char prefixes[33];
+
 	if (strlen(input) == 0) RETURN_EMPTY;
 	GET_INT_ARG(refnum, input);
 	if (!get_server(refnum)) RETURN_EMPTY;
 
-	//say("Reached meat of validprefixes");
-	ptochars = get_server_005(refnum, "PREFIX");
-	//say("PROTOCTL PREFIX=%s", ptochars);
-	ptobrack = malloc_strdup(strchr(ptochars, ')') + 1);
-	//say("ptobrack is%s null - %s", (ptobrack == NULL) ? "" : " not", (ptobrack != NULL) ? ptobrack : "nothing to show");
-
-	RETURN_MSTR(ptobrack);
+	/* Every prefix in 005 PREFIX, which might not have been sent. */
+	RETURN_STR(status_to_prefixes(refnum, ~(u_32int_t)0, 
+					prefixes, sizeof(prefixes)));
 }
 
 /* Used by function_serverctl */
@@ -4380,6 +4570,9 @@ char 	*serverctl 	(char *input)
 		} else if (!my_strnicmp(listc, "USERHOST", len)) {
 			ret = get_server_userhost(refnum);
 			RETURN_STR(ret);
+		} else if (!my_strnicmp(listc, "USERHOST_CACHE", len)) {
+			retval = userhost_cache_stats(refnum);
+			RETURN_MSTR(retval);
 		} else if (!my_strnicmp(listc, "VERSION", len)) {
 			ret = get_server_version_string(refnum);
 			RETURN_STR(ret);
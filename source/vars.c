@@ -325,6 +325,9 @@ void 	init_variables_stage1 (void)
 	VAR(LASTLOG, 			INT,  set_lastlog_size);
 	VAR(LASTLOG_LEVEL,		STR,  set_lastlog_mask);
 	VAR(LASTLOG_REWRITE,		STR, NULL);
+	VAR(LASTLOG_SPILL,		INT,  set_lastlog_spill);
+	VAR(LASTLOG_SPILL_DIR,		STR,  set_lastlog_spill);
+	VAR(LAZY_SYNC_CHANNELS,		STR,  NULL);
 #define DEFAULT_LOAD_PATH NULL
 	VAR(LOAD_PATH,			STR,  NULL);
 	VAR(LOG,			BOOL, logger);
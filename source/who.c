@@ -131,6 +131,18 @@ static void	WHO_DEBUG (const char *format, ...)
 #define WHO_INVISIBLE	0x2000
 #define WHO_OPERSPY	0x4000
 
+/*
+ * WHOX (the 354 numeric) lets us say which fields we want back, and tag
+ * our query with a number (the "querytype") that comes back on every 
+ * reply, so we know whose reply it is without relying on the queue order.
+ * We only use it for our own queries (the ones with a "line" callback),
+ * because /WHO -LINE and /ON WHO expect the traditional 352 reply.
+ * The fields always come back in WHOX_ORDER, no matter what order we 
+ * asked for them in.
+ */
+#define WHOX_ORDER	"tcuihsnfdlaor"
+static	const char	whox_fields[] = "tcuhnfar";
+
 #define S(x) (((x) != NULL) ? (x) : empty_string)
 
 static char *who_item_full_desc (WhoEntry *item)
@@ -141,7 +153,7 @@ static char *who_item_full_desc (WhoEntry *item)
 	    snprintf(retval, sizeof retval, 
 		"refnum [%d] "
 		"dirty [%d], piggyback [%d], unet [%d], unet_args [%s], "
-		"dalnet [%d], dalnet_args [%s], who_mask [%d], "
+		"dalnet [%d], dalnet_args [%s], whox [%d], who_mask [%d], "
 		"who_target [%s], who_name [%s], who_host [%s], "
 		"who_server [%s], who_nick [%s], who_real [%s], "
 		"who_stuff [%s], who_end [%s], next [%p], line [%p], "
@@ -150,7 +162,7 @@ static char *who_item_full_desc (WhoEntry *item)
 			item->dirty, item->piggyback, item->undernet_extended, 
 				S(item->undernet_extended_args),
 			item->dalnet_extended, S(item->dalnet_extended_args), 
-				item->who_mask,
+				item->whox_tag, item->who_mask,
 			S(item->who_target), S(item->who_name), 
 				S(item->who_host),
 			S(item->who_server), S(item->who_nick), 
@@ -216,6 +228,30 @@ static WhoEntry *who_previous_query (int refnum, WhoEntry *me)
 	return what;
 }
 
+/*
+ * Find the query that a WHOX reply with this querytype belongs to.
+ */
+static WhoEntry *who_queue_find_tag (int refnum, const char *tag)
+{
+	WhoEntry *what;
+	Server *s;
+	int	t;
+
+	if (!(s = get_server(refnum)) || !is_number(tag))
+		return NULL;
+
+	if ((t = atol(tag)) <= 0)
+		return NULL;
+
+	for (what = s->who_queue; what; what = what->next)
+		if (what->whox_tag == t)
+			break;
+
+	WHO_DEBUG("Returning item with whox tag [%d] - [%s]",
+			t, who_item_desc(what));
+	return what;
+}
+
 static void who_queue_add (int refnum, WhoEntry *item)
 {
 	WhoEntry *bottom;
@@ -309,6 +345,7 @@ static WhoEntry *get_new_who_entry (void)
 	new_w->undernet_extended_args = NULL;
 	new_w->dalnet_extended = 0;
 	new_w->dalnet_extended_args = NULL;
+	new_w->whox_tag = 0;
 	new_w->request_time.tv_sec = 0;
 	new_w->request_time.tv_usec = 0;
 	new_w->dirty_time.tv_sec = 0;
@@ -632,6 +669,17 @@ void 	whobase (int refnum, char *args, void (*line) (int, const char *, const ch
 	new_w->who_target = malloc_strdup(channel);
 	WHO_DEBUG("WHOBASE: Target is [%s]", new_w->who_target);
 
+	/*
+	 * Our own queries get WHOX if the server has it.  The querytype
+	 * only has to be unique among the queries we're waiting on.
+	 */
+	if (line && !new_w->who_mask && !new_w->undernet_extended && 
+		!new_w->dalnet_extended && get_server_005(refnum, "WHOX"))
+	{
+		new_w->whox_tag = new_w->refnum % 999 + 1;
+		WHO_DEBUG("WHOBASE: Using WHOX tag [%d]", new_w->whox_tag);
+	}
+
 	who_queue_add(refnum, new_w);
 
 	/*
@@ -639,6 +687,7 @@ void 	whobase (int refnum, char *args, void (*line) (int, const char *, const ch
 	 */
 	old = who_previous_query(refnum, new_w);
 	if (old && !old->dirty && old->who_target && channel && 
+		!old->whox_tag && !new_w->whox_tag &&
 		!strcmp(old->who_target, channel))
 	{
 		old->piggyback = 1;
@@ -663,6 +712,15 @@ void 	whobase (int refnum, char *args, void (*line) (int, const char *, const ch
 			new_w->undernet_extended_args ? 
 				new_w->undernet_extended_args : "");
 	}
+	else if (new_w->whox_tag)
+	{
+		WHO_DEBUG("WHOX QUERY: [%d] WHO %s %%%s,%d", 
+			refnum, new_w->who_target, whox_fields, 
+			new_w->whox_tag);
+
+		send_to_aserver(refnum, "WHO %s %%%s,%d", 
+			new_w->who_target, whox_fields, new_w->whox_tag);
+	}
 	else if (new_w->dalnet_extended)
 	{
 		WHO_DEBUG("DALNET QUERY: [%d] WHO %s %s", 
@@ -793,6 +851,14 @@ do
 		{ rfc1459_odd(from, comm, ArgList); break; }
 	name = LOCAL_COPY(ircname);
 
+	if (*status != 'S')
+	{
+		char *uh = alloca(strlen(user) + strlen(host) + 2);
+
+		sprintf(uh, "%s@%s", user, host);
+		cache_userhost(refnum, nick, uh);
+	}
+
 	if (*status == 'S')	/* this only true for the header WHOREPLY */
 	{
 		char buffer[1024];
@@ -871,15 +937,101 @@ while (new_w->piggyback && (new_w = new_w->next));
 	pop_message_from(l);
 }
 
+/*
+ * whox_reply - Handle a 354 reply to one of our own WHOX queries.
+ * Only the fields we asked for are present, so we walk WHOX_ORDER to see
+ * which argument is which, and then hand the callback an argument list
+ * that looks like a 352 reply.  Nobody asked for the hopcount or the
+ * server, so those are not filled in, and nothing gets formatted.
+ */
+static void	whox_reply (int refnum, WhoEntry *new_w, const char *from, const char *comm, const char **ArgList)
+{
+	const char *	channel = star, 
+		   *	user = star, 
+		   *	host = star, 
+		   *	nick = NULL, 
+		   *	status = "H", 
+		   *	account = NULL, 
+		   *	realname = empty_string;
+	const char *	reply[8];
+	const char *	f;
+	const char *	arg;
+	int		i = 0;
+	int		l;
+	char *		uh;
+
+	for (f = WHOX_ORDER; *f; f++)
+	{
+		if (!strchr(whox_fields, *f))
+			continue;
+		if (!(arg = ArgList[i++]))
+			{ rfc1459_odd(from, comm, ArgList); return; }
+
+		switch (*f)
+		{
+			case 'c': channel = arg; break;
+			case 'u': user = arg; break;
+			case 'h': host = arg; break;
+			case 'n': nick = arg; break;
+			case 'f': status = arg; break;
+			case 'a': account = arg; break;
+			case 'r': realname = arg; break;
+		}
+	}
+
+	if (!nick)
+		{ rfc1459_odd(from, comm, ArgList); return; }
+
+	uh = alloca(strlen(user) + strlen(host) + 2);
+	sprintf(uh, "%s@%s", user, host);
+	cache_userhost(refnum, nick, uh);
+
+	/* An account of "0" means they're not logged in */
+	if (account)
+		set_user_account(refnum, nick, 
+				strcmp(account, zero) ? account : NULL);
+
+	if (!new_w->dirty)
+	{
+		WHO_DEBUG("WHOX REPLY: Server [%d], who_refnum [%d]: "
+				"Reply is now dirty", refnum, new_w->refnum);
+		new_w->dirty = 1;
+	}
+
+	if (!new_w->line)
+		return;
+
+	reply[0] = channel;
+	reply[1] = user;
+	reply[2] = host;
+	reply[3] = star;
+	reply[4] = nick;
+	reply[5] = status;
+	reply[6] = realname;
+	reply[7] = NULL;
+
+	l = message_from(new_w->who_target, LEVEL_OTHER);
+	new_w->line(refnum, from, comm, reply);
+	pop_message_from(l);
+}
+
 /* Undernet's 354 numeric reply. */
 void	xwhoreply (int refnum, const char *from, const char *comm, const char **ArgList)
 {
-	WhoEntry *new_w = who_queue_top(refnum);
+	WhoEntry *new_w;
 	int	l;
 
 	if (!ArgList[0])
 		{ rfc1459_odd(from, comm, ArgList); return; }
 
+	if ((new_w = who_queue_find_tag(refnum, ArgList[0])))
+	{
+		whox_reply(refnum, new_w, from, comm, ArgList);
+		return;
+	}
+
+	new_w = who_queue_top(refnum);
+
 	if (!new_w)
 	{
 		new_w = get_new_who_entry();
@@ -1887,6 +2039,13 @@ void	userhost_returned (int refnum, const char *from, const char *comm, const ch
 			item.host = host;
 			item.extra = SAFE(top->extra);
 
+			{
+				char *uh = alloca(strlen(user) + strlen(host) + 2);
+
+				sprintf(uh, "%s@%s", user, host);
+				cache_userhost(refnum, nick, uh);
+			}
+
 			/*
 			 * If the user wanted a callback, then
 			 * feed the callback with the info.
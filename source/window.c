@@ -129,6 +129,14 @@ static  int     current_query_counter = 0;
  */
 static	int	current_display_counter = 1;
 
+/*
+ * How many rows to rewrap each time the client is idle (or the user tries 
+ * to scroll back past what's been rewrapped), and whether any window has
+ * rows left to rewrap.
+ */
+#define	REWRAP_CHUNK	500
+static	int	rewrapping = 0;
+
 
 static 	void 	remove_from_invisible_list 	(Window *);
 static 	void 	swap_window 			(Window *, Window *);
@@ -152,7 +160,9 @@ static 	void 	window_scrollback_to_string 	(Window *window, regex_t *str);
 static 	void 	window_scrollforward_to_string 	(Window *window, regex_t *str);
 static	int	change_line 			(Window *, const unsigned char *);
 static	int	add_to_display 			(Window *, const unsigned char *, intmax_t);
-static	Display *new_display_line 		(Display *prev, Window *w);
+static	Display *scrollback_push		(Scrollback *);
+static	Display *scrollback_unshift		(Scrollback *);
+static	void	scrollback_free			(Scrollback *);
 static 	int	count_fixed_windows 		(Screen *s);
 static	int	add_waiting_channel 		(Window *, const char *);
 static 	void   	destroy_window_waiting_channels	(int);
@@ -160,6 +170,9 @@ static 	int	flush_scrollback_after		(Window *);
 static 	int	flush_scrollback		(Window *);
 static void	unclear_window (Window *window);
 static	void	rebuild_scrollback (Window *w);
+static	void	detach_scrollback_rows	(Window *w, Scrollback *rows);
+static	int	continue_rewrap		(Window *w, int rows);
+static	void	finish_rewrap		(Window *w);
 static	void	window_check_columns (Window *w);
 static void	restore_window_positions (Window *w, intmax_t scrolling, intmax_t holding, intmax_t scrollback);
 static void	save_window_positions (Window *w, intmax_t *scrolling, intmax_t *holding, intmax_t *scrollback);
@@ -257,6 +270,7 @@ Window	*new_window (Screen *screen)
 	new_w->status.prefix_when_not_current = NULL;
 
 	/* Scrollback stuff */
+	memset(&new_w->scrollback_rows, 0, sizeof(Scrollback));
 	new_w->top_of_scrollback = NULL;	/* Filled in later */
 	new_w->display_ip = NULL;		/* Filled in later */
 	new_w->display_buffer_size = 0;
@@ -267,15 +281,17 @@ Window	*new_window (Screen *screen)
 	new_w->holding_distance_from_display_ip = -1;	/* Filled in later */
 	new_w->scrollback_top_of_display = NULL;	/* Filled in later */
 	new_w->scrollback_distance_from_display_ip = -1; /* Filled in later */
-	new_w->display_counter = 1;
 	new_w->hold_slider = get_int_var(HOLD_SLIDER_VAR);
+	new_w->rewrap_before = -1;
+	memset(&new_w->rewrap_rows, 0, sizeof(Scrollback));
+	memset(&new_w->rewrap_spare, 0, sizeof(Scrollback));
+	new_w->rewrap_spare_cols = 0;
+	new_w->rewrap_cols = 0;
 
 	/* The scrollback indicator */
 	new_w->scrollback_indicator = (Display *)new_malloc(sizeof(Display));
 	new_w->scrollback_indicator->line = NULL;
 	new_w->scrollback_indicator->count = -1;
-	new_w->scrollback_indicator->prev = NULL;
-	new_w->scrollback_indicator->next = NULL;
 	new_w->scrollback_indicator->when = time(NULL);
 
 	/* Window geometry stuff */
@@ -297,6 +313,7 @@ Window	*new_window (Screen *screen)
 	new_w->lastlog_mask = real_lastlog_mask();
 	new_w->lastlog_size = 0;
 	new_w->lastlog_max = get_int_var(LASTLOG_VAR);
+	new_w->lastlog_index = NULL;
 
 	/* LOGFILE stuff */
 	new_w->log = 0;
@@ -330,11 +347,9 @@ Window	*new_window (Screen *screen)
 	 */
 	/* Initialize the scrollback */
 	new_w->rebuild_scrollback = 0;
-	new_w->top_of_scrollback = new_display_line(NULL, new_w);
-	new_w->top_of_scrollback->line = NULL;
-	new_w->top_of_scrollback->next = NULL;
+	new_w->display_ip = scrollback_push(&new_w->scrollback_rows);
+	new_w->top_of_scrollback = new_w->display_ip;
 	new_w->display_buffer_size = 1;
-	new_w->display_ip = new_w->top_of_scrollback;
 	new_w->scrolling_top_of_display = new_w->top_of_scrollback;
 	new_w->old_display_lines = 1;
 
@@ -552,30 +567,17 @@ delete_window_contents:
 	new_free(&window->logfile);
 	new_free(&window->name);
 
-	/* Delete the indicator if it's not already in the logical display */
-	if (window->scrollback_indicator->prev == NULL &&
-	    window->scrollback_indicator->next == NULL)
-	{
-		new_free(&window->scrollback_indicator->line);
-		new_free((char **)&window->scrollback_indicator);
-	}
+	/* The indicator is never in the logical display */
+	new_free(&window->scrollback_indicator->line);
+	new_free((char **)&window->scrollback_indicator);
 
 	/* The logical display */
-	{ 
-		Display *next;
-		while (window->top_of_scrollback)
-		{
-			/* XXXX This should use delete_display_line! */
-			next = window->top_of_scrollback->next;
-			new_free(&window->top_of_scrollback->line);
-			new_free((char **)&window->top_of_scrollback);
-			window->display_buffer_size--;
-			window->top_of_scrollback = next;
-		}
-		window->display_ip = NULL;
-		if (window->display_buffer_size != 0)
-			panic(1, "delete_window: display_buffer_size is %d, should be 0", window->display_buffer_size);
-	}
+	scrollback_free(&window->scrollback_rows);
+	window->top_of_scrollback = NULL;
+	window->display_ip = NULL;
+	window->display_buffer_size = 0;
+	scrollback_free(&window->rewrap_rows);
+	scrollback_free(&window->rewrap_spare);
 
 	/* The lastlog... */
 	window->lastlog_max = 0;
@@ -1505,7 +1507,7 @@ static 	void 	resize_window (int how, Window *window, int offset)
  */
 void	resize_window_display (Window *window)
 {
-	int		cnt = 0, i;
+	int		cnt = 0;
 	Display 	*tmp;
 
 	if (dumb_mode)
@@ -1527,14 +1529,12 @@ void	resize_window_display (Window *window)
 	     * display to reveal what has previously scrolled off (for
 	     * ircII compatability
 	     */
-	    if (window->scrolladj)
+	    if (window->scrolladj && tmp)
 	    {
-		for (i = 0; i < cnt; i++)
-		{
-			if (!tmp || !tmp->prev)
-				break;
-			tmp = tmp->prev;
-		}
+		if (tmp->count - cnt < window->top_of_scrollback->count)
+			tmp = window->top_of_scrollback;
+		else
+			tmp = window_display_line(window, tmp->count - cnt);
 	    }
 	}
 
@@ -1546,11 +1546,12 @@ void	resize_window_display (Window *window)
 		/* Use any whitespace we may have lying around */
 		cnt += (window->old_display_lines - 
 			window->scrolling_distance_from_display_ip);
-		for (i = 0; i > cnt; i--)
+		if (cnt < 0 && tmp)
 		{
-			if (tmp == window->display_ip)
-				break;
-			tmp = tmp->next;
+			if (tmp->count - cnt > window->display_ip->count)
+				tmp = window->display_ip;
+			else
+				tmp = window_display_line(window, tmp->count - cnt);
 		}
 	}
 	window->scrolling_top_of_display = tmp;
@@ -1581,7 +1582,7 @@ void	resize_window_display (Window *window)
 void	window_scrollback_needs_rebuild (Window *w)
 {
 	debuglog("window_scrollback_needs_rebuild(%d)", w->refnum);
-	w->rebuild_scrollback = 1;
+	w->rebuild_scrollback |= 1;
 }
 
 /*
@@ -1661,12 +1662,14 @@ static	int	restart = 0;
 	}
 
 	recursion++;
+	rewrapping = 0;
 	while (traverse_all_windows(&tmp))
 	{
 		if (restart)
 		{
 			debuglog("update_all_windows: restarting");
 			restart = 0;
+			rewrapping = 0;
 			tmp = NULL;
 			continue;
 		}
@@ -1677,6 +1680,10 @@ static	int	restart = 0;
 					tmp->refnum);
 			rebuild_scrollback(tmp);
 		}
+		else if (tmp->rewrap_before != -1)
+			continue_rewrap(tmp, REWRAP_CHUNK);
+		if (tmp->rewrap_before != -1)
+			rewrapping = 1;
 
 		/* 
 		 * This should always be done, even for hidden windows
@@ -2069,18 +2076,83 @@ static	void	window_check_columns (Window *w)
 	if (w->screen && w->my_columns != w->screen->co)
 	{
 		w->my_columns = w->screen->co;
-		w->rebuild_scrollback = 1;
+		w->rebuild_scrollback |= 1;
 		/* rebuild_scrollback(w); */
 	}
 }
 
+/*
+ * rebuild_scrollback -- Break up the window's lastlog into rows all over
+ * again, usually because the window changed width.
+ *
+ * Rewrapping everything up front stalls the client for a long time with a
+ * big scrollback, so we only do enough to fill the window and to get back 
+ * to the top of each view in use, and the rest is done a piece at a time 
+ * by continue_rewrap() when the client is idle or the user scrolls back.
+ */
 static	void	rebuild_scrollback (Window *w)
 {
-	intmax_t	scrolling, holding, scrollback;
+	intmax_t	scrolling, holding, scrollback, until;
+	Scrollback	old_rows, rows;
+	int		old_cols;
 
 	save_window_positions(w, &scrolling, &holding, &scrollback);
+
+	/* Scratch windows are rebuilt the old fashioned way */
+	if (w->change_line != -1)
+	{
+		flush_scrollback(w);
+		reconstitute_scrollback(w);
+		restore_window_positions(w, scrolling, holding, scrollback);
+		w->rebuild_scrollback = 0;
+		return;
+	}
+
+	/*
+	 * Hang on to the rows we have now.  If we're staying the same width
+	 * (say, because lastlog entries were moved), they can be used as 
+	 * they are.  Otherwise they become the spare -- and if the old spare
+	 * was already the width we want, we use it instead.  This makes 
+	 * flipping back and forth between two sizes cheap.
+	 */
+	old_cols = w->rewrap_cols;
+	detach_scrollback_rows(w, &old_rows);
+	memset(&rows, 0, sizeof(rows));
+	if (w->rebuild_scrollback & 2)		/* /WINDOW REBUILD_SCROLLBACK */
+	{
+		scrollback_free(&old_rows);
+		scrollback_free(&w->rewrap_spare);
+	}
+	else if (old_cols == w->my_columns)
+		rows = old_rows;
+	else
+	{
+		if (w->rewrap_spare.count && 
+				w->rewrap_spare_cols == w->my_columns)
+			rows = w->rewrap_spare;
+		else
+			scrollback_free(&w->rewrap_spare);
+		w->rewrap_spare = old_rows;
+		w->rewrap_spare_cols = old_cols;
+	}
+
 	flush_scrollback(w);
-	reconstitute_scrollback(w);
+	w->rewrap_rows = rows;
+	w->rewrap_cols = w->my_columns;
+
+	/* Find the oldest line that some view is looking at */
+	until = -1;
+	if (scrolling != -1 && (until == -1 || scrolling < until))
+		until = scrolling;
+	if (holding != -1 && (until == -1 || holding < until))
+		until = holding;
+	if (scrollback != -1 && (until == -1 || scrollback < until))
+		until = scrollback;
+
+	w->rewrap_before = rewrap_scrollback(w, -1, until, w->display_lines);
+	if (w->rewrap_before == -1)
+		finish_rewrap(w);
+
 	restore_window_positions(w, scrolling, holding, scrollback);
 	w->rebuild_scrollback = 0;
 }
@@ -2118,7 +2190,8 @@ static void	restore_window_positions (Window *w, intmax_t scrolling, intmax_t ho
 	 * guaranteed never to match any valid scrollback item, so -1 is used
 	 * to ensure we do not set the corresponding view.
 	 */
-	for (d = w->top_of_scrollback; d != w->display_ip; d = d->next)
+	for (d = w->top_of_scrollback; d != w->display_ip; 
+			d = window_display_line(w, d->count + 1))
 	{
 	    if (d->linked_refnum == scrolling && !w->scrolling_top_of_display)
 		w->scrolling_top_of_display = d;
@@ -3244,18 +3317,15 @@ void 	clear_window_by_refnum (unsigned refnum, int unhold)
 
 static void	unclear_window (Window *window)
 {
-	int i;
+	intmax_t	top;
 
 	if (dumb_mode)
 		return;
 
-	window->scrolling_top_of_display = window->display_ip;
-	for (i = 0; i < window->display_lines; i++)
-	{
-		if (window->scrolling_top_of_display == window->top_of_scrollback)
-			break;
-		window->scrolling_top_of_display = window->scrolling_top_of_display->prev;
-	}
+	top = window->display_ip->count - window->display_lines;
+	if (top < window->top_of_scrollback->count)
+		top = window->top_of_scrollback->count;
+	window->scrolling_top_of_display = window_display_line(window, top);
 
 	recalculate_window_cursor_and_display_ip(window);
 	window_body_needs_redraw(window);
@@ -3322,18 +3392,16 @@ int	window_is_scrolled_back (Window *w)
  */
 int	unhold_a_window (Window *w)
 {
-	int	slider, i;
+	intmax_t	top;
 
 	if (!w->holding_top_of_display)
 		return 0;				/* ok, whatever */
 
-	slider = ((int)w->hold_slider * w->display_lines) / 100;
-	for (i = 0; i < slider; i++)
-	{
-		if (w->holding_top_of_display == w->display_ip)
-			break;
-		w->holding_top_of_display = w->holding_top_of_display->next;
-	}
+	top = w->holding_top_of_display->count + 
+			((int)w->hold_slider * w->display_lines) / 100;
+	if (top > w->display_ip->count)
+		top = w->display_ip->count;
+	w->holding_top_of_display = window_display_line(w, top);
 	recalculate_window_cursor_and_display_ip(w);
 	window_body_needs_redraw(w);
 	window_statusbar_needs_update(w);
@@ -4192,8 +4260,7 @@ static Window *window_hold_interval (Window *window, char **args)
 static Window *window_hold_mode (Window *window, char **args)
 {
 	short	hold_mode;
-	int	slider;
-	int	i;
+	intmax_t top;
 
 	if (window->holding_top_of_display)
 		hold_mode = 1;
@@ -4205,14 +4272,11 @@ static Window *window_hold_mode (Window *window, char **args)
 
 	if (hold_mode && !window->holding_top_of_display)
 	{
-		window->holding_top_of_display = window->scrolling_top_of_display;
-		slider = (window->hold_slider * window->display_lines) / 100;
-		for (i = 0; i < slider; i++)
-		{
-			if (window->holding_top_of_display == window->display_ip)
-				break;
-			window->holding_top_of_display = window->holding_top_of_display->next;
-		}
+		top = window->scrolling_top_of_display->count + 
+			(window->hold_slider * window->display_lines) / 100;
+		if (top > window->display_ip->count)
+			top = window->display_ip->count;
+		window->holding_top_of_display = window_display_line(window, top);
 		recalculate_window_cursor_and_display_ip(window);
 		window_body_needs_redraw(window);
 		window_statusbar_needs_update(window);
@@ -5099,7 +5163,7 @@ Window *window_query (Window *window, char **args)
 
 static Window *window_rebuild_scrollback (Window *window, char **args)
 {
-	window->rebuild_scrollback = 1;
+	window->rebuild_scrollback |= 2;	/* From scratch */
 	/* rebuild_scrollback(window); */
 	return window;
 }
@@ -5468,6 +5532,8 @@ static	Window *window_scroll_start (Window *window, char **args)
 }
 
 regex_t *last_regex = NULL;
+static	u_32int_t last_regex_trigrams[32];
+static	int	last_regex_ntrigrams = 0;
 
 static int	new_search_term (const char *arg)
 {
@@ -5488,8 +5554,10 @@ static int	new_search_term (const char *arg)
 		say("The regex [%s] isn't acceptable because [%s]", 
 				arg, errstr);
 		new_free((char **)&last_regex);
+		last_regex_ntrigrams = 0;
 		return -1;
 	}
+	last_regex_ntrigrams = regex_trigrams(arg, last_regex_trigrams, 32);
 	return 0;
 }
 
@@ -6139,72 +6207,156 @@ static void	go_back_to_indicator (Window *w)
 
 /********************** SCROLLBACK BUFFER MAINTAINANCE **********************/
 /* 
- * XXXX Dont you DARE touch this XXXX 
- *
- * Most of the time, a delete_display_line() is followed somewhat
- * immediately by a new_display_line().  So most of the time we just
- * cache that one item and re-use it.  That saves us thousands of
- * malloc()s.  In the cases where its not, then we just do things the
- * normal way.
+ * The scrollback rows live in a ring (see window.h), so getting to any row
+ * is just arithmetic, and adding and removing them at either end doesn't
+ * need any malloc()s.  Rows that fall off the top keep their 'line', and
+ * whoever gets that spot next can cheaply re-use it with malloc_strcpy().
  */
-static Display *recycle = NULL;
-
-static void 	delete_display_line (Display *stuff)
+static Display *scrollback_slot (Scrollback *sb, intmax_t pos)
 {
-	if (recycle == stuff)
-		panic(1, "delete_display_line: Deleting the same line twice is invalid.");
+	intmax_t	i = pos & (sb->size - 1);
+	Display **	block = &sb->blocks[i / SCROLLBACK_BLOCK];
+	int		j;
 
-	if (recycle)
+	if (!*block)
 	{
-		new_free((char **)&recycle->line);
-		new_free((char **)&recycle);
+		*block = (Display *)new_malloc(sizeof(Display) * SCROLLBACK_BLOCK);
+		for (j = 0; j < SCROLLBACK_BLOCK; j++)
+			(*block)[j].line = NULL;
 	}
-	recycle = stuff;
+	return *block + i % SCROLLBACK_BLOCK;
+}
 
-	/* 
-	 * Don't de-allocate the string; our consumer will call
-	 * malloc_strcpy() and they will appreciate being able to
-	 * cheaply re-use this string.
-	 */
-	*(stuff->line) = 0;
+static Display *scrollback_at (Scrollback *sb, intmax_t pos)
+{
+	if (pos < sb->first || pos >= sb->first + sb->count)
+		return NULL;
+	return scrollback_slot(sb, pos);
+}
+
+static void	scrollback_free_block (Display *block)
+{
+	int	j;
+
+	for (j = 0; j < SCROLLBACK_BLOCK; j++)
+		new_free(&block[j].line);
+	new_free((char **)&block);
 }
 
 /*
- * CAUTION: The return value of this function may or may not have 'line'
- * set to NULL.  Therefore, you MUST call malloc_strcpy() to initialize 
- * the 'line' field.  You will cause memory leaks if you fail to do this!
- * By not free()ing line, we save a free()/malloc() if the new original line
- * had enough space to hold the new line.  We let malloc_strcpy() do the
- * dirty work there.
+ * Make sure there's room for one more row at either end.  Like the lastlog
+ * rings, we always keep at least SCROLLBACK_BLOCK spots empty, so the rows
+ * in use never wrap around into a block that's still in use.  When the 
+ * ring grows, only the block pointers get moved around -- the rows stay
+ * right where they are.
  */
-static Display *new_display_line (Display *prev, Window *w)
+static void	scrollback_make_room (Scrollback *sb)
 {
-	Display *stuff;
+	Display **	blocks;
+	intmax_t	pos;
+	int		size, i;
 
-	if (recycle)
-	{
-		stuff = recycle;
-		recycle = NULL;
-	}
-	else
+	if (sb->count + SCROLLBACK_BLOCK < sb->size)
+		return;
+
+	size = sb->size ? sb->size * 2 : SCROLLBACK_BLOCK * 2;
+	blocks = (Display **)new_malloc(sizeof(Display *) * 
+						(size / SCROLLBACK_BLOCK));
+	memset(blocks, 0, sizeof(Display *) * (size / SCROLLBACK_BLOCK));
+
+	if (sb->count)
 	{
-		stuff = (Display *)new_malloc(sizeof(Display));
-		stuff->line = NULL;
+	    for (pos = sb->first & ~(intmax_t)(SCROLLBACK_BLOCK - 1);
+		 pos < sb->first + sb->count; pos += SCROLLBACK_BLOCK)
+	    {
+		i = (pos & (sb->size - 1)) / SCROLLBACK_BLOCK;
+		blocks[(pos & (size - 1)) / SCROLLBACK_BLOCK] = sb->blocks[i];
+		sb->blocks[i] = NULL;
+	    }
 	}
 
-	/*
-	 * Note that we don't destroy 'line' because it's either been 
-	 * set to NULL for a new line (above) or it's been zeroed out by
-	 * delete_display_line() and can be malloc_strcpy()d over thus
-	 * saving a free/new cycle.
-	 */
+	/* Anything left over isn't in use, so we don't need it. */
+	for (i = 0; i < sb->size / SCROLLBACK_BLOCK; i++)
+		if (sb->blocks[i])
+			scrollback_free_block(sb->blocks[i]);
+
+	new_free((char **)&sb->blocks);
+	sb->blocks = blocks;
+	sb->size = size;
+}
+
+/*
+ * CAUTION: The 'line' of the row you get back may be NULL, or it may be
+ * an old string that's been zeroed out.  Either way, you MUST call 
+ * malloc_strcpy() to set the 'line' field.
+ */
+static Display *scrollback_new_row (Scrollback *sb, intmax_t pos)
+{
+	Display *d = scrollback_slot(sb, pos);
+
+	if (d->line)
+		*(d->line) = 0;
+	d->count = pos;
+	d->unique_refnum = ++current_display_counter;
+	d->linked_refnum = -1;
+	d->when = time(NULL);
+	memset(d->trigrams, 0, sizeof(d->trigrams));
+	return d;
+}
+
+/* Add a new blank row at the bottom of the ring */
+static Display *scrollback_push (Scrollback *sb)
+{
+	scrollback_make_room(sb);
+	sb->count++;
+	return scrollback_new_row(sb, sb->first + sb->count - 1);
+}
+
+/* Add a new blank row at the top of the ring */
+static Display *scrollback_unshift (Scrollback *sb)
+{
+	scrollback_make_room(sb);
+	sb->first--;
+	sb->count++;
+	return scrollback_new_row(sb, sb->first);
+}
+
+static void	scrollback_free (Scrollback *sb)
+{
+	int	i;
+
+	for (i = 0; i < sb->size / SCROLLBACK_BLOCK; i++)
+		if (sb->blocks[i])
+			scrollback_free_block(sb->blocks[i]);
+	new_free((char **)&sb->blocks);
+	sb->first = 0;
+	sb->count = 0;
+	sb->size = 0;
+}
+
+/*
+ * Move the contents of the row 'from' to the row 'to'.  They trade strings
+ * so neither one has to malloc anything.
+ */
+static void	scrollback_move_row (Display *to, Display *from)
+{
+	char *	line = to->line;
+
+	to->line = from->line;
+	from->line = line;
+	to->linked_refnum = from->linked_refnum;
+	to->when = from->when;
+	memcpy(to->trigrams, from->trigrams, sizeof(to->trigrams));
+}
 
-	stuff->count = w->display_counter++;
-	stuff->unique_refnum = ++current_display_counter;
-	stuff->prev = prev;
-	stuff->next = NULL;
-	stuff->when = time(NULL);
-	return stuff;
+/*
+ * window_display_line -- The row at position 'pos' in the window's 
+ * scrollback, or NULL if there isn't one.  The row before 'd' is at 
+ * d->count - 1, and the row after it is at d->count + 1.
+ */
+Display *	window_display_line (Window *window, intmax_t pos)
+{
+	return scrollback_at(&window->scrollback_rows, pos);
 }
 
 /*
@@ -6244,17 +6396,20 @@ int 	add_to_scrollback (Window *window, const unsigned char *str, intmax_t refnu
 static int	add_to_display (Window *window, const unsigned char *str, intmax_t refnum)
 {
 	int	scroll;
-	int	i;
 
 	/* 
 	 * Add to the bottom of the scrollback buffer, and move the 
 	 * bottom of scrollback (display_ip) after it. 
 	 */
-	window->display_ip->next = new_display_line(window->display_ip, window);
 	malloc_strcpy(&window->display_ip->line, str);
+	memset(window->display_ip->trigrams, 0, sizeof(window->display_ip->trigrams));
+	trigram_signature_add(window->display_ip->trigrams, 
+			sizeof(window->display_ip->trigrams) * 8, str);
 	window->display_ip->linked_refnum = refnum;
-	window->display_ip = window->display_ip->next;
+	window->display_ip->when = time(NULL);
+	window->display_ip = scrollback_push(&window->scrollback_rows);
 	window->display_buffer_size++;
+	window->rewrap_cols = window->my_columns;
 
 	/*
 	 * Mark that the scrollable view, the scrollback view, and the hold
@@ -6317,15 +6472,11 @@ static int	add_to_display (Window *window, const unsigned char *str, intmax_t re
 		if (scroll > window->display_lines)
 			scroll = window->display_lines;
 
-		for (i = 0; i < scroll; i++)
-		{
-			if (window->scrolling_top_of_display == NULL)
-				panic(1, "add_to_display, Window %d tried to scroll %d lines but it is only %d lines tall", window->refnum, scroll, i);
-
-			window->scrolling_top_of_display = 
-				window->scrolling_top_of_display->next;
-			window->scrolling_distance_from_display_ip--;
-		}
+		window->scrolling_top_of_display = window_display_line(window,
+				window->scrolling_top_of_display->count + scroll);
+		if (window->scrolling_top_of_display == NULL)
+			panic(1, "add_to_display, Window %d tried to scroll %d lines but it is only %d lines tall", window->refnum, scroll, window->scrolling_distance_from_display_ip);
+		window->scrolling_distance_from_display_ip -= scroll;
 	}
 
 	return 1;
@@ -6349,6 +6500,8 @@ static int	add_to_display (Window *window, const unsigned char *str, intmax_t re
  */
 int	trim_scrollback (Window *window)
 {
+	int	excess;
+
 	/* Do not trim the scrollback if we are in scrollback mode */
 	if (window->scrollback_top_of_display)
 		return 0;
@@ -6364,22 +6517,27 @@ int	trim_scrollback (Window *window)
 	 * active -- once we get out of hold mode or scrollback mode, then
 	 * we truncate the display buffer at that point.)
 	 */
-	while (window->display_buffer_size > window->display_buffer_max)
+	if ((excess = window->display_buffer_size - 
+			window->display_buffer_max) > 0)
 	{
-		Display *next = window->top_of_scrollback->next;
-
 		/*
 		 * XXX Pure, unmitigated paranoia -- if the only thing in
 		 * the scrollback buffer is the display_ip, then the buffer
 		 * is actually completely empty.  WE MUST NEVER DELETE THE
-		 * DISPLAY_IP EVER EVER EVER.  So we just bail here.
+		 * DISPLAY_IP EVER EVER EVER.  So we stop short of it.
 		 */
-		if (window->top_of_scrollback == window->display_ip)
-			break;
+		if (excess > window->display_buffer_size - 1)
+			excess = window->display_buffer_size - 1;
 
-		delete_display_line(window->top_of_scrollback);
-		window->top_of_scrollback = next;
-		window->display_buffer_size--;
+		window->scrollback_rows.first += excess;
+		window->scrollback_rows.count -= excess;
+		window->display_buffer_size -= excess;
+		window->top_of_scrollback = window_display_line(window,
+					window->scrollback_rows.first);
+
+		/* Anything we haven't rewrapped yet would go right here */
+		if (excess > 0)
+			finish_rewrap(window);
 	}
 
 	/* Ok.  Go ahead and print it */
@@ -6393,10 +6551,11 @@ int	trim_scrollback (Window *window)
  */
 static int	flush_scrollback (Window *w)
 {
-	Display *holder, *curr_line;
+	/* Don't bring back what we haven't rewrapped yet, either */
+	finish_rewrap(w);
 
-	/* Save the old scrollback buffer */
-	holder = w->top_of_scrollback;
+	/* Delete the old scrollback */
+	scrollback_free(&w->scrollback_rows);
 
 	/* Reset all of the scrollback values */
         w->top_of_scrollback = NULL;        /* Filled in later */
@@ -6408,25 +6567,13 @@ static int	flush_scrollback (Window *w)
         w->holding_distance_from_display_ip = -1;   /* Filled in later */
         w->scrollback_top_of_display = NULL;        /* Filled in later */
         w->scrollback_distance_from_display_ip = -1; /* Filled in later */
-        w->display_counter = 1;
 
 	/* Reconstitute a new scrollback buffer */
-        w->top_of_scrollback = new_display_line(NULL, w);
-        w->top_of_scrollback->line = NULL;
-        w->top_of_scrollback->next = NULL;
+        w->display_ip = scrollback_push(&w->scrollback_rows);
+        w->top_of_scrollback = w->display_ip;
         w->display_buffer_size = 1;
-        w->display_ip = w->top_of_scrollback;
         w->scrolling_top_of_display = w->top_of_scrollback;
 
-	/* Delete the old scrollback */
-	/* XXXX - this should use delete_display_line! */ 
-	while ((curr_line = holder))
-	{
-		holder = curr_line->next;
-		new_free(&curr_line->line);
-		new_free((char **)&curr_line);
-	}
-
 	/* Recalculate and redraw the window. */
 	recalculate_window_cursor_and_display_ip(w);
 	window_body_needs_redraw(w);
@@ -6459,53 +6606,39 @@ static int	flush_scrollback (Window *w)
  */
 static int	flush_scrollback_after (Window *window)
 {
-	Display *curr_line, *next_line;
-	int	count;
+	intmax_t	keep;
 
 	/* Determine what is currently visible in the hold view */
-	if (!(curr_line = window->holding_top_of_display))
+	if (!window->holding_top_of_display)
 	{
 		say("/WINDOW FLUSH doesn't do anything unless you're in hold mode");
 		return 0;
 	}
 
 	/*
-	 * Move "curr_line" to the first line below the bottom of the window.
-	 * We do this by moving forward one line at a time for the size of 
-	 * the window.  If we bump into the display_ip, then that means there
-	 * is nothing to flush (since the nothing "below" the bottom of the 
+	 * Figure out where the first line below the bottom of the window
+	 * is.  If that's the display_ip (or beyond it), then there is 
+	 * nothing to flush (since the nothing "below" the bottom of the 
 	 * window.)
 	 */
-	for (count = 1; count < window->display_lines; count++)
-	{
-		if (curr_line == window->display_ip)
-			return 0;
-		curr_line = curr_line->next;
-	}
+	keep = window->holding_top_of_display->count + window->display_lines;
+	if (keep >= window->display_ip->count)
+		return 0;
 
 	/* 
 	 * Reset the bottom of the scrollback (display_ip) to just below
-	 * the bottom of the hold view window.
+	 * the bottom of the hold view window, which GCs all of the lines
+	 * below the hold view in one fell swoop.
 	 */
-	next_line = curr_line->next;
-	curr_line->next = window->display_ip;
-	window->display_ip->prev = curr_line;
-
-	/*
-	 * Now GC all of the lines below the hold view until we get to the
-	 * end of the scrollback (display_ip).
-	 */
-	curr_line = next_line;
-	while (curr_line != window->display_ip)
-	{
-		next_line = curr_line->next;
-		delete_display_line(curr_line);
-		window->display_buffer_size--;
-		curr_line = next_line;
-	}
+	window->display_buffer_size -= window->display_ip->count - keep;
+	window->scrollback_rows.count -= window->display_ip->count - keep;
+	window->display_ip = scrollback_new_row(&window->scrollback_rows, keep);
 
 	/* And reset the scrollable view so it points to the hold view. */
 	window->scrolling_top_of_display = window->holding_top_of_display;
+	if (window->scrollback_top_of_display && 
+	    window->scrollback_top_of_display->count > keep)
+		window->scrollback_top_of_display = NULL;
 
 	/* 
 	 * Since we moved the end of scrollback, we have to recalculate the
@@ -6515,6 +6648,150 @@ static int	flush_scrollback_after (Window *window)
 	return 1;
 }
 
+/*
+ * prepend_to_scrollback -- add the rows of one logical line to the TOP of
+ * the scrollback buffer, above everything else.  This is used to put the 
+ * older lines back after a resize (see rebuild_scrollback()).  Since the
+ * new rows are above every view, none of the views need to be touched.
+ * 'rows' is a NULL terminated array, as returned by prepare_display().
+ * Returns the number of rows that were added.
+ */
+int	prepend_to_scrollback (Window *window, unsigned char **rows, intmax_t refnum)
+{
+	Display *d;
+	int	count = 0, i;
+
+	/* The last row goes on first, so the first row ends up on top */
+	while (rows[count])
+		count++;
+
+	for (i = count - 1; i >= 0; i--)
+	{
+		d = scrollback_unshift(&window->scrollback_rows);
+		malloc_strcpy(&d->line, rows[i]);
+		trigram_signature_add(d->trigrams, sizeof(d->trigrams) * 8, 
+					rows[i]);
+		d->linked_refnum = refnum;
+		window->top_of_scrollback = d;
+		window->display_buffer_size++;
+	}
+
+	window->rewrap_cols = window->my_columns;
+	return count;
+}
+
+/*
+ * reuse_scrollback_rows -- If we still have the rows for the lastlog entry
+ * 'refnum' from before the rebuild, and they're the right width, then move
+ * them to the top of the scrollback instead of making them all over again.
+ *
+ * The entries get put back newest first, so we eat the reusable rows from
+ * the bottom up.  Any rows newer than 'refnum' belong to entries that 
+ * aren't here any more, so they get thrown away as we go.
+ * Returns the number of rows that were reused.
+ */
+int	reuse_scrollback_rows (Window *window, intmax_t refnum)
+{
+	Scrollback *	rows = &window->rewrap_rows;
+	Display *	d;
+	int		count = 0;
+
+	while ((d = scrollback_at(rows, rows->first + rows->count - 1)) &&
+			d->linked_refnum > refnum)
+		rows->count--;
+
+	/* Put them on top of the scrollback, bottom row first */
+	while ((d = scrollback_at(rows, rows->first + rows->count - 1)) &&
+			d->linked_refnum == refnum)
+	{
+		scrollback_move_row(scrollback_unshift(&window->scrollback_rows), d);
+		rows->count--;
+		count++;
+	}
+
+	window->top_of_scrollback = window_display_line(window, 
+					window->scrollback_rows.first);
+	window->display_buffer_size += count;
+	return count;
+}
+
+/*
+ * detach_scrollback_rows -- Take all of the rows out of the window's 
+ * scrollback (except the display_ip, which isn't really a row) and put
+ * them in 'rows'.  Any rows still waiting to be reused are older than all
+ * of these, so they go on the front.  The window's scrollback is left
+ * empty, so it had better be flush_scrollback()ed right away.
+ */
+static void	detach_scrollback_rows (Window *w, Scrollback *rows)
+{
+	Scrollback *	sb = &w->scrollback_rows;
+	intmax_t	pos;
+
+	sb->count--;
+	*rows = w->rewrap_rows;
+	memset(&w->rewrap_rows, 0, sizeof(Scrollback));
+
+	if (rows->count == 0)
+	{
+		scrollback_free(rows);
+		*rows = *sb;
+		memset(sb, 0, sizeof(Scrollback));
+	}
+	else
+	{
+		for (pos = sb->first; pos < sb->first + sb->count; pos++)
+			scrollback_move_row(scrollback_push(rows), 
+						scrollback_at(sb, pos));
+		sb->count = 0;
+	}
+
+	w->top_of_scrollback = NULL;
+	w->display_ip = NULL;
+	w->display_buffer_size = 0;
+	w->rewrap_before = -1;
+}
+
+/*
+ * continue_rewrap -- Rewrap at least another 'rows' rows of the window's
+ * older lastlog entries into the top of its scrollback.  We're done once 
+ * there's nothing older, or once the scrollback is full, since anything 
+ * more would just be thrown away by trim_scrollback().
+ * Returns 1 if anything was added.
+ */
+static int	continue_rewrap (Window *w, int rows)
+{
+	int	size = w->display_buffer_size;
+
+	if (w->rewrap_before == -1)
+		return 0;
+
+	if (w->display_buffer_size < w->display_buffer_max)
+		w->rewrap_before = rewrap_scrollback(w, w->rewrap_before, -1, rows);
+	if (w->rewrap_before == -1 || 
+	    w->display_buffer_size >= w->display_buffer_max)
+		finish_rewrap(w);
+
+	if (w->display_buffer_size == size)
+		return 0;
+	window_statusbar_needs_update(w);
+	return 1;
+}
+
+static void	finish_rewrap (Window *w)
+{
+	scrollback_free(&w->rewrap_rows);
+	w->rewrap_before = -1;
+}
+
+/*
+ * Returns 1 if any window still has lines that need rewrapping, so the
+ * main loop knows not to go to sleep.
+ */
+int	scrollback_rewrap_pending (void)
+{
+	return rewrapping;
+}
+
 
 
 /********************** Scrollback functionality ***************************/
@@ -6531,6 +6808,7 @@ static int	flush_scrollback_after (Window *window)
  *			not change anything
  * test - A callback function that will tell us if this is the line we are
  *	  interested in or not.  Returns 0 for "keep going" and -1 for "stop"
+ *	  If it's NULL, we stop as soon as we've skipped 'skip_lines'.
  * meta - A private value to pass to the tester.
  */
 static void	window_scrollback_backwards (Window *window, int skip_lines, int abort_if_not_found, int (*test)(Window *, Display *, void *), void *meta)
@@ -6538,7 +6816,8 @@ static void	window_scrollback_backwards (Window *window, int skip_lines, int abo
 	Display *new_top;
 	int	new_lines;
 
-	if (window->scrollback_top_of_display == window->top_of_scrollback)
+	if (window->scrollback_top_of_display == window->top_of_scrollback &&
+	    !continue_rewrap(window, REWRAP_CHUNK))
 	{
 		term_beep();
 		return;
@@ -6552,10 +6831,30 @@ static void	window_scrollback_backwards (Window *window, int skip_lines, int abo
 	else
 		new_top = window->scrolling_top_of_display;
 
+	/* 
+	 * The lines we skip don't need to be looked at, so just go right
+	 * there (or to the top, whichever comes first).
+	 */
+	if (skip_lines > 0)
+	{
+		while (new_top->count - skip_lines < 
+				window->top_of_scrollback->count &&
+			continue_rewrap(window, REWRAP_CHUNK))
+			;
+		if (new_top->count - skip_lines < 
+				window->top_of_scrollback->count)
+			new_top = window->top_of_scrollback;
+		else
+			new_top = window_display_line(window, 
+					new_top->count - skip_lines);
+		skip_lines = 0;
+	}
+
 	for (;;)
 	{
-		/* Always stop when we reach the top */
-		if (new_top == window->top_of_scrollback)
+		/* Always stop when we reach the top (of what's been wrapped) */
+		if (new_top == window->top_of_scrollback &&
+		    !continue_rewrap(window, REWRAP_CHUNK))
 		{
 			if (abort_if_not_found)
 			{
@@ -6565,13 +6864,11 @@ static void	window_scrollback_backwards (Window *window, int skip_lines, int abo
 			break;
 		}
 
-		if (skip_lines > 0)
-			skip_lines--;
 		/* This function returns -1 when it wants us to stop. */
-		else if ((*test)(window, new_top, meta))
+		if (!test || (*test)(window, new_top, meta))
 			break;
 
-		new_top = new_top->prev;
+		new_top = window_display_line(window, new_top->count - 1);
 	}
 
 	window->scrollback_top_of_display = new_top;
@@ -6595,6 +6892,7 @@ static void	window_scrollback_backwards (Window *window, int skip_lines, int abo
  *			not change anything
  * test - A callback function that will tell us if this is the line we are
  *	  interested in or not.  Returns 0 for "keep going" and -1 for "stop"
+ *	  If it's NULL, we stop as soon as we've skipped 'skip_lines'.
  * meta - A private value to pass to the tester.
  */
 static void	window_scrollback_forwards (Window *window, int skip_lines, int abort_if_not_found, int (*test)(Window *, Display *, void *), void *meta)
@@ -6620,6 +6918,16 @@ static void	window_scrollback_forwards (Window *window, int skip_lines, int abor
 		return;
 	}
 
+	if (skip_lines > 0)
+	{
+		if (new_top->count + skip_lines > window->display_ip->count)
+			new_top = window->display_ip;
+		else
+			new_top = window_display_line(window, 
+					new_top->count + skip_lines);
+		skip_lines = 0;
+	}
+
 	for (;;)
 	{
 		/* Always stop when we reach the bottom */
@@ -6633,13 +6941,11 @@ static void	window_scrollback_forwards (Window *window, int skip_lines, int abor
 			break;
 		}
 
-		if (skip_lines > 0)
-			skip_lines--;
 		/* This function returns -1 when it wants us to stop. */
-		else if ((*test)(window, new_top, meta))
+		if (!test || (*test)(window, new_top, meta))
 			break;
 
-		new_top = new_top->next;
+		new_top = window_display_line(window, new_top->count + 1);
 	}
 
 	/* Set the top of scrollback to wherever we landed */
@@ -6655,37 +6961,18 @@ static void	window_scrollback_forwards (Window *window, int skip_lines, int abor
 }
 
 /* * * */
-/*
- * A scrollback tester that counts off the number of lines to move.
- * Returns -1 when the count has been reached.
- */
-static	int	window_scroll_lines_tester (Window *window, Display *line, void *meta)
-{
-	if (*(int *)meta > 0)
-	{
-		(*(int *)meta)--;
-		return 0;		/* keep going */
-	}
-	else
-		return -1;		/* We're done. stop! */
-}
-
 /* Scroll up "my_lines" on "window".  Will stop if it reaches top */
 static void 	window_scrollback_backwards_lines (Window *window, int my_lines)
 {
-	/* Do not skip line, Move even if not found, don't leave blank space */
-	window_scrollback_backwards(window, 0, 0,
-			window_scroll_lines_tester, 
-			(void *)&my_lines);
+	/* Skip the lines, Move even if not found, don't leave blank space */
+	window_scrollback_backwards(window, my_lines, 0, NULL, NULL);
 }
 
 /* Scroll down "my_lines" on "window".  Will stop if it reaches bottom */
 static void 	window_scrollback_forwards_lines (Window *window, int my_lines)
 {
-	/* Do not skip line, Move even if not found, don't leave blank space */
-	window_scrollback_forwards(window, 0, 0,
-			window_scroll_lines_tester, 
-			(void *)&my_lines);
+	/* Skip the lines, Move even if not found, don't leave blank space */
+	window_scrollback_forwards(window, my_lines, 0, NULL, NULL);
 }
 
 /* * * */
@@ -6695,6 +6982,12 @@ static void 	window_scrollback_forwards_lines (Window *window, int my_lines)
  */
 static	int	window_scroll_regex_tester (Window *window, Display *line, void *meta)
 {
+	/* If it can't possibly match, don't bother with the regex */
+	if (meta == last_regex && last_regex_ntrigrams &&
+	    !trigram_signature_test(line->trigrams, sizeof(line->trigrams) * 8,
+				last_regex_trigrams, last_regex_ntrigrams))
+		return 0;
+
 	/* If it matches, stop here */
 	if (regexec((regex_t *)meta, line->line, 0, NULL, 0) == 0)
 		return -1;	/* Stop right here. */
@@ -6725,8 +7018,10 @@ static void 	window_scrollforward_to_string (Window *window, regex_t *preg)
  */
 static	int	window_scroll_time_tester (Window *window, Display *line, void *meta)
 {
+	Display *prev = window_display_line(window, line->count - 1);
+
 	/* If this is the oldest line, then just stop here */
-	if (line->prev == NULL)
+	if (prev == NULL)
 		return -1;		/* Stop right here */
 
 	/* 
@@ -6734,7 +7029,7 @@ static	int	window_scroll_time_tester (Window *window, Display *line, void *meta)
 	 * older than 'meta' then we stop here.
 	 */
 	if (line->when >= *(time_t *)meta && 
-	    line->prev->when < *(time_t *)meta)
+	    prev->when < *(time_t *)meta)
 		return -1;		/* Stop right here */
 
 	return 0;	/* Keep going */
@@ -6885,23 +7180,11 @@ BUILT_IN_KEYBINDING(toggle_stop_screen)
  */
 void 	recalculate_window_cursor_and_display_ip (Window *window)
 {
-	Display *tmp;
-
 	window->cursor = 0;
-	window->display_buffer_size = 0;
+	window->display_buffer_size = window->scrollback_rows.count;
 	window->scrolling_distance_from_display_ip = -1;
 	window->holding_distance_from_display_ip = -1;
 	window->scrollback_distance_from_display_ip = -1;
-	window->display_counter = 1;
-
-	/* Recount and resequence the scrollback */
-	for (tmp = window->top_of_scrollback;; tmp = tmp->next)
-	{
-		window->display_buffer_size++;
-		tmp->count = window->display_counter++;
-		if (tmp == window->display_ip)
-			break;
-	}
 
 	/* Calculate the distances to the bottom of scrollback */
 	if (window->holding_top_of_display)
@@ -7057,7 +7340,6 @@ void 	make_window_current (Window *window)
 static int	change_line (Window *window, const unsigned char *str)
 {
 	Display *my_line;
-	int 	cnt;
 	int	chg_line;
 
 	chg_line = window->change_line;
@@ -7080,23 +7362,20 @@ static int	change_line (Window *window, const unsigned char *str)
 		add_to_display(window, empty_string, -1);
 
 	/* Now find the line we want to change */
-	my_line = window->scrolling_top_of_display;
-	if (my_line == window->display_ip)
+	if (window->scrolling_top_of_display->count + chg_line >= 
+			window->display_ip->count)
 		panic(1, "Can't change line [%d] -- doesn't exist", 
 			chg_line);
-	for (cnt = 0; cnt < chg_line; cnt++)
-	{
-		my_line = my_line->next;
-		if (my_line == window->display_ip)
-			panic(1, "Can't change line [%d] -- doesn't exist", 
-				chg_line);
-	}
+	my_line = window_display_line(window, 
+			window->scrolling_top_of_display->count + chg_line);
 
 	/*
 	 * Now change the line, move the logical cursor, and then let
 	 * the caller (window_disp) output the new line.
 	 */
 	malloc_strcpy(&my_line->line, str);
+	memset(my_line->trigrams, 0, sizeof(my_line->trigrams));
+	trigram_signature_add(my_line->trigrams, sizeof(my_line->trigrams) * 8, str);
 	window->cursor = chg_line;
 	return 1;		/* Express a success */
 }
@@ -7299,7 +7578,7 @@ char 	*windowctl 	(char *input)
 	    } else if (!my_strnicmp(listc, "SCROLLBACK_DISTANCE", len)) {
 		RETURN_INT(w->scrollback_distance_from_display_ip);
 	    } else if (!my_strnicmp(listc, "DISPLAY_COUNTER", len)) {
-		RETURN_INT(w->display_counter);
+		RETURN_INT(w->display_buffer_size + 1);
 	    } else if (!my_strnicmp(listc, "HOLD_SLIDER", len)) {
 		RETURN_INT(w->hold_slider);
 	    } else if (!my_strnicmp(listc, "HOLD_INTERVAL", len)) {
@@ -7372,9 +7651,11 @@ char 	*windowctl 	(char *input)
 		int	line;
 
 		GET_INT_ARG(line, input);
-		Line = w->display_ip;
-		for (; line > 0 && Line; line--)
-			Line = Line->prev;
+		while (w->display_ip->count - line < w->top_of_scrollback->count
+			&& continue_rewrap(w, w->top_of_scrollback->count - 
+					(w->display_ip->count - line)))
+			;
+		Line = window_display_line(w, w->display_ip->count - line);
 
 		if (Line && Line->line) {
 			char *ret2 = denormalize_string(Line->line);